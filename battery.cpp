@@ -6,12 +6,16 @@
 #include <fstream>
 #include <csignal>
 #include <ctime>
-#include <cstdarg>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <getopt.h>
 #include <libgen.h> // basename
 
 #include "KP184.h"
+#include "clock.h"
+#include "csvlog.h"
+#include "battlog.h"
+#include "journal.h"
+#include "adaptive.h"
 #include "util.h"
 
 using namespace std;
@@ -21,6 +25,7 @@ static const struct timespec defconf_interval = { 1, 0 };
 static const unsigned long defconf_n0samp = 3;
 static const unsigned long defconf_ntsamp = 3;
 static const useconds_t interframe_delay = 10000;
+static const unsigned long defconf_sync = 10;
 
 enum {
   TERM_NONE = 0,
@@ -34,7 +39,26 @@ enum {
   TERM_MAX = TERM_ERR
 };
 static int term;
-static FILE *outfile = NULL;
+
+// what a run needs to go on after the host or battery went down,
+// committed to the journal next to the CSV file every sample
+typedef struct {
+  uint64_t wall;        // CLOCK_REALTIME of the commit, us
+  uint64_t us;          // last sample since the start
+  uint64_t loadus;      // load switched on since the start
+  uint64_t sampleno;
+  SampleIntegrator::state_t integ;
+  double load;
+  double cload;
+  int32_t mode;
+  int32_t vlmv;
+  int32_t vhmv;
+  uint32_t n0samp;
+  uint32_t vsamp;
+  uint32_t csamp;
+  uint32_t done;        // ended by a threshold or the time, nothing to resume
+  uint32_t reserved;
+} runstate_t;
 
 void sig_handler(int signum, siginfo_t *info, void *ptr)
 {
@@ -100,76 +124,49 @@ int setup(KP184 &device, KP184::mode_t mode, double val)
 {
   int rc;
 
-  rc = device.setOutput(false);
+  rc = device.configure(mode, val);
   if (rc) {
-    fprintf(stderr, "ERR Switching load off: %s\n", strerror(-rc));
-    return rc;
-  }
-
-  usleep(interframe_delay);
-  rc = device.setMode(mode);
-  if (rc) {
-    fprintf(stderr, "ERR Setting mode: %s\n", strerror(-rc));
-    return rc;
-  }
-
-  usleep(interframe_delay);
-  rc = device.setModeValue(mode, val);
-  if (rc) {
-    fprintf(stderr, "ERR Setting mode value: %s\n", strerror(-rc));
+    fprintf(stderr, "ERR Switching load off and setting mode: %s\n", strerror(-rc));
     return rc;
   }
 
   return 0;
 } 
 
-int writefile(const char *filepath, bool header, bool append, bool persist, const char *fmt...)
+// gets the load back to where it was after the device failed, the driver
+// has retried and reopened the link by now, so the output isn't switched off
+// the status tells the driver which of the writes the device doesn't need
+int restore(KP184 &device, KP184::mode_t mode, double val, bool out)
 {
-  va_list args;
-
-  if (outfile == NULL) {
-    if (filepath) {
-      int rc;
-      struct stat st = {};
-
-      if ((rc = stat(filepath, &st)) == 0) {
-        if (S_ISDIR(st.st_mode) || S_ISBLK(st.st_mode)) {
-          fprintf(stderr, "\nERR %s shouldn't be directory or block device\n", filepath);
-          return -EINVAL;
-        }
-      }
-
-      if (header && append && (st.st_size > 0))
-        return 0;
-
-      outfile = fopen(filepath, (header && !append) ? "w" : "a");
-      if (outfile == NULL) {
-        rc = -errno;
-        fprintf(stderr, "\nERR Opening %s: %s\n", filepath, strerror(errno));
-        return rc;
-      }
+  KP184::mode_t cmode;
+  double voltage, current;
+  bool sw;
+  int rc;
 
-    } else
-      outfile = stdout;
+  if ((rc = device.getStatus(sw, cmode, voltage, current)) != 0)
+    return rc;
+  device.getClock().usleep(interframe_delay);
+  if ((rc = device.setMode(mode)) != 0)
+    return rc;
+  device.getClock().usleep(interframe_delay);
+  if ((rc = device.setModeValue(mode, val)) != 0)
+    return rc;
+  if (out) {
+    device.getClock().usleep(interframe_delay);
+    rc = device.setOutput(true);
   }
 
-  va_start(args, fmt);
-  vfprintf(outfile, fmt, args);
-  va_end(args);
-
-  if (filepath && !persist)
-    fclose(outfile), outfile = NULL;
-
-  return 0;
+  return rc;
 }
 
 void usage(const char prog[])
 {
-  printf("usage: %s <-t tty|-s host[:port]> <-l load> <-v Volt> [-B conf] [-a addr]"
-         " [-V Volt] [-c Amp] [-C Amp] [-i interval] [-N samples] [-n samples]"
-         " [-f path] [-o] [-q]\n", prog);
+  printf("usage: %s <-t tty|-s host[:port]|-m host[:port]> <-l load> <-v Volt> [-B conf] [-a addr]"
+         " [-V Volt] [-c Amp] [-C Amp] [-i interval] [-A interval] [-P interval] [-N samples] [-n samples]"
+         " [-f path] [-o] [-b] [-y sync] [-r] [-x path] [-F] [-S] [-q]\n", prog);
   printf(" -t: communicate via TTY port\n");
   printf(" -s: communicate via socket\n");
+  printf(" -m: communicate via Modbus TCP gateway\n");
   printf(" -B: serial configuration string [%s]\n", defconf_serial);
   printf(" -a: device address [%hhu]\n", KP184::defAddress());
   printf(" -l: load mode and value: val[m]<A|R|W>\n");
@@ -180,40 +177,76 @@ void usage(const char prog[])
   printf(" -T: maximum load time, h:m:s\n");
   printf(" -i: sample interval, s [%g s]\n",
         (double)defconf_interval.tv_sec + (double)defconf_interval.tv_nsec / NSEC);
+  printf(" -A: adaptive interval, from -i on the knee up to this one on the plateau, s\n");
+  printf(" -P: predict the low voltage threshold crossing, sample around it and confirm it\n"
+         "     at this interval, s\n");
   printf(" -N: initial no load samples [%lu]\n", defconf_n0samp);
   printf(" -n: sequential samples exceeding thresholds [%lu]\n", defconf_ntsamp);
   printf(" -f: output CSV file name [stdout]\n");
   printf(" -o: do not append CSV file\n");
+  printf(" -b: write the file as a binary log, always anew, test/battlog converts it to CSV\n");
+  printf(" -y: CSV file is synced to the disk every interval, s, 0 at the end only [%lu]\n",
+         defconf_sync);
+  printf(" -r, --resume: go on with the run of the CSV file, as its journal has it, after a crash\n"
+         "     or a stop by a signal, the journal is removed when a run ends on its own\n");
+  printf(" -x: record wire traffic trace file\n");
+  printf(" -F: probe function codes, set the load up in one frame if the device can\n");
+  printf(" -S: simulated time, samples are taken as fast as the device replies\n");
   printf(" -q: produce no additional information\n");
 }
 
 int main(int argc, char *argv[])
 {
-  int rc = 0, op;
+  int rc = 0, op, blrc = 0;
   KP184 kp184;
+  Trace trace;
+  Journal<runstate_t> journal;
+  runstate_t rs = {};
+  std::string jpath;
+  CSVLog csv;
+  BattLog blog;
   Link::linktype_t ltype = Link::NONE;
-  KP184::mode_t mode = KP184::MODE_CV, cmode; // N/A
+  KP184::mode_t mode = KP184::MODE_CV; // N/A
   const char *prog = basename(argv[0]), *link = NULL, *lconf = defconf_serial, *saddr = NULL;
   const char *sload = NULL, *svlthres = NULL, *svhthres = NULL, *sclthres = NULL, *schthres = NULL;
-  const char *sint = NULL, *stend = NULL, *csvfile = NULL;
-  const char *sn0samp = NULL, *sntsamp = NULL;
+  const char *sint = NULL, *stend = NULL, *csvfile = NULL, *tracefile = NULL, *ssync = NULL;
+  const char *sn0samp = NULL, *sntsamp = NULL, *smaxint = NULL, *sconfint = NULL;
   double vlthres, load, vhthres = -1.0, clthres = -1.0, chthres = -1.0;
-  double voltage, current, pv, pc, capacity, energy;
-  unsigned long sampleno, n0samp = defconf_n0samp, ntsamp = defconf_ntsamp, vsamp, csamp;
-  bool sw, bstat = false, quiet = false, fappend = true, fpersist = false;
-  struct timespec tstart, tload, tsamp, thalf;
+  double cload;
+  int32_t vlmv, vhmv, clma, chma; // thresholds in what samples come in, -1 none
+  uint64_t usamp = 0, jsynced = 0;
+  unsigned long csvno = 0;
+  uint64_t pus = 0, xus = 0; // previous loaded sample, threshold crossing
+  int32_t pmv = -1;
+  double pah = 0.0, pwh = 0.0, xah = 0.0, xwh = 0.0;
+  bool xvalid = false;
+  uint32_t baseint, confint = 0;
+  bool jsync;
+  unsigned long sync = defconf_sync, sampleno, n0samp = defconf_n0samp, ntsamp = defconf_ntsamp, vsamp, csamp;
+  bool bstat = false, quiet = false, fappend = true, simtime = false, binary = false;
+  bool probe = false, resume = false, gap = false;
+  struct timespec tstart, tload, tsamp, thalf, toff;
   struct itimerspec tsint, tsend = {};
-  sigset_t timset;
-  timer_t tintid = 0, tendid = 0;
+  int tintid = 0, tendid = 0;
   static struct sigaction sigact;
-  siginfo_t sinfo;
   struct winsize ws;
+  Sample smp;
+  SampleIntegrator integ;
+  AdaptiveInterval adapt;
+  CrossingPredictor cross;
+  SimClock simclock;
+  Clock *clk = &Clock::system();
+  static const struct option longopts[] = {
+    { "resume", no_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 }
+  };
 
   opterr = 0;
-  while ((op = getopt(argc, argv, "t:s:B:a:l:v:V:c:C:T:i:N:n:f:oq")) != -1) {
+  while ((op = getopt_long(argc, argv, "t:s:m:B:a:l:v:V:c:C:T:i:A:P:N:n:f:oby:rx:FSq", longopts, NULL)) != -1) {
     switch(op) {
     case 't': ltype = Link::SERIAL; link = optarg; break;
     case 's': ltype = Link::SOCKET; link = optarg; break;
+    case 'm': ltype = Link::MBTCP; link = optarg; break;
     case 'B': lconf = optarg; break;
     case 'a': saddr = optarg; break;
     case 'l': sload = optarg; break;
@@ -227,6 +260,14 @@ int main(int argc, char *argv[])
     case 'n': sntsamp = optarg; break;
     case 'f': csvfile = optarg; break;
     case 'o': fappend = false; break;
+    case 'b': binary = true; break;
+    case 'r': resume = true; break;
+    case 'y': ssync = optarg; break;
+    case 'x': tracefile = optarg; break;
+    case 'F': probe = true; break;
+    case 'S': simtime = true; break;
+    case 'A': smaxint = optarg; break;
+    case 'P': sconfint = optarg; break;
     case 'q': quiet = true; break;
     case '?':
     case 'h':
@@ -335,6 +376,41 @@ int main(int argc, char *argv[])
     tsint.it_interval.tv_nsec = defconf_interval.tv_nsec;
   }
   ts_div(thalf, tsint.it_interval, 2);
+  baseint = (uint32_t)(tsint.it_interval.tv_sec * USEC + tsint.it_interval.tv_nsec / (NSEC/USEC));
+
+  if (smaxint) {
+    double sec;
+
+    Util::str2du(smaxint, sec, smaxint);
+    if (*smaxint) {
+      fprintf(stderr, "ERR Malformed adaptive interval value\n");
+      rc = -EINVAL;
+    } else if (sec * NSEC < (double)tsint.it_interval.tv_sec * NSEC + tsint.it_interval.tv_nsec) {
+      fprintf(stderr, "ERR Adaptive interval can't be shorter than the sample interval\n");
+      rc = -EINVAL;
+    } else if (sec > 3600.0) {
+      fprintf(stderr, "ERR Maximum adaptive interval is 3600 s\n");
+      rc = -EINVAL;
+    } else
+      adapt.setBounds(baseint, (uint32_t)(sec * USEC));
+  }
+
+  if (sconfint) {
+    double sec;
+
+    Util::str2du(sconfint, sec, sconfint);
+    if (*sconfint) {
+      fprintf(stderr, "ERR Malformed confirmation interval value\n");
+      rc = -EINVAL;
+    } else if (sec < 0.05) {
+      fprintf(stderr, "ERR Minimum confirmation interval is 0.05 s\n");
+      rc = -EINVAL;
+    } else if (sec * NSEC > (double)tsint.it_interval.tv_sec * NSEC + tsint.it_interval.tv_nsec) {
+      fprintf(stderr, "ERR Confirmation interval can't be longer than the sample interval\n");
+      rc = -EINVAL;
+    } else
+      confint = (uint32_t)(sec * USEC);
+  }
 
   if (sn0samp && Util::str2ul(sn0samp, n0samp)) {
     fprintf(stderr, "ERR Malformed no load samples value\n");
@@ -345,6 +421,21 @@ int main(int argc, char *argv[])
     fprintf(stderr, "ERR Malformed threshold samples value\n");
     rc = -EINVAL;
   }
+  if (ssync && Util::str2ul(ssync, sync)) {
+    fprintf(stderr, "ERR Malformed sync interval value\n");
+    rc = -EINVAL;
+  }
+
+  if (binary && (csvfile == NULL)) {
+    fprintf(stderr, "ERR Binary log needs a file (-f)\n");
+    rc = -EINVAL;
+  }
+
+  if (resume && ((csvfile == NULL) || binary)) {
+    fprintf(stderr, "ERR Resume needs the CSV file (-f) of the run\n");
+    rc = -EINVAL;
+  }
+
   if (ntsamp == 0) {
     fprintf(stderr, "ERR Threshold sample count should be greater than 0\n");
     rc = -EINVAL;
@@ -353,6 +444,38 @@ int main(int argc, char *argv[])
   if (rc != 0)
    return rc;
 
+  // the journal of a binary log would point into blocks rewritten anew,
+  // a new run's journal is created once the sampling starts
+  if (csvfile && !binary)
+    jpath = std::string(csvfile) + ".journal";
+  if (resume) {
+    if ((rc = journal.open(jpath.c_str(), false)) != 0) {
+      if (rc == -ENOENT)
+        fprintf(stderr, "ERR No journal %s, the run has ended or never started\n", jpath.c_str());
+      else
+        fprintf(stderr, "ERR Opening journal %s: %s\n", jpath.c_str(), strerror(-rc));
+      return rc;
+    }
+    if ((rc = journal.load(rs)) != 0) {
+      fprintf(stderr, "ERR Journal %s has no state to resume\n", jpath.c_str());
+      return rc;
+    }
+    if (rs.done) {
+      fprintf(stderr, "ERR Run of %s has ended, nothing to resume\n", csvfile);
+      return -EALREADY;
+    }
+    if ((rs.mode != mode) || (rs.load != load) || (rs.vlmv != (int32_t)lround(vlthres * 1000.0)) ||
+        (rs.n0samp != n0samp)) {
+      fprintf(stderr, "ERR Journal %s is of a run with another load or thresholds\n", jpath.c_str());
+      return -EINVAL;
+    }
+    // the CSV is written behind the journal, numbers go on from its last line
+    if ((rc = CSVLog::last(csvfile, csvno)) != 0) {
+      fprintf(stderr, "ERR Reading %s: %s\n", csvfile, strerror(-rc));
+      return rc;
+    }
+  }
+
   memset(&sigact, 0, sizeof(sigact));
   sigact.sa_sigaction = sig_handler;
   sigact.sa_flags = SA_SIGINFO;
@@ -361,34 +484,53 @@ int main(int argc, char *argv[])
   sigaction(SIGINT, &sigact, NULL);
   sigaction(SIGQUIT, &sigact, NULL);
 
+  if (simtime) {
+    clk = &simclock;
+    kp184.setClock(simclock);
+  }
+
   rc = kp184.open(ltype, link, lconf);
   if (rc)
     return rc;
 
-  rc = setup(kp184, mode, load);
-  if (rc)
-    goto close;
+  if (tracefile) {
+    if ((rc = trace.open(tracefile, ltype)) != 0) {
+      fprintf(stderr, "ERR Can't open trace file %s: %s\n", tracefile, strerror(-rc));
+      goto close;
+    }
+    kp184.setTrace(&trace);
+  }
 
-  sigemptyset(&timset);
-  sigaddset(&timset, SIGALRM);
-  sigprocmask(SIG_BLOCK, &timset, NULL);
-  rc = timer_create(CLOCK_MONOTONIC, NULL, &tintid);
-  if (rc == EAGAIN)
-    rc = timer_create(CLOCK_MONOTONIC, NULL, &tintid); // one more time
-  if (rc) {
-    perror("ERR Can't create sample timer");
+  // falls back to writing one register at a time
+  if (probe && ((rc = kp184.probe()) < 0))
+    fprintf(stderr, "ERR Probing function codes: %s\n", strerror(-rc));
+
+  if (resume) {
+    // the load comes back as it was, on if it was switched on
+    if ((rc = restore(kp184, mode, rs.cload, rs.sampleno > n0samp)) != 0) {
+      fprintf(stderr, "ERR Reattaching the load: %s\n", strerror(-rc));
+      goto close;
+    }
+  } else {
+    rc = setup(kp184, mode, load);
+    if (rc)
+      goto close;
+  }
+
+  if ((rc = clk->timerCreate()) < 0) {
+    fprintf(stderr, "ERR Can't create sample timer: %s\n", strerror(-rc));
     goto close;
   }
+  tintid = rc;
 
   if (ts_cmp(tsend.it_value, { 0, 0 }) > 0) {
-    rc = timer_create(CLOCK_MONOTONIC, NULL, &tendid);
-    if (rc == EAGAIN)
-      rc = timer_create(CLOCK_MONOTONIC, NULL, &tendid);
-    if (rc) {
-      perror("ERR Can't create termination timer");
+    if ((rc = clk->timerCreate()) < 0) {
+      fprintf(stderr, "ERR Can't create termination timer: %s\n", strerror(-rc));
       goto close;
     }
+    tendid = rc;
   }
+  rc = 0;
 
   if (!quiet) {
     fprintf(stderr, "Connection: %s %s%s%s address %hhu\n", Link::linkTypeStr(ltype), link, lconf ? " " : "",
@@ -403,101 +545,196 @@ int main(int argc, char *argv[])
       fprintf(stderr, " High current threshold: %g A\n", chthres);
     if (stend)
       fprintf(stderr, " Maximum load time: %s\n", ts2str(tsend.it_value));
-    fprintf(stderr, " Interval: %g s\n No load samples: %lu\n Threshold samples: %lu\n",
-                    (double)tsint.it_interval.tv_sec +
-                    (double)tsint.it_interval.tv_nsec / NSEC, n0samp, ntsamp);
+    fprintf(stderr, " Interval: %g s\n", (double)tsint.it_interval.tv_sec +
+                    (double)tsint.it_interval.tv_nsec / NSEC);
+    if (smaxint)
+      fprintf(stderr, " Adaptive interval: up to %g s\n", (double)adapt.getMax() / USEC);
+    if (sconfint)
+      fprintf(stderr, " Predicted crossing, confirmation interval: %g s\n", (double)confint / USEC);
+    fprintf(stderr, " No load samples: %lu\n Threshold samples: %lu\n", n0samp, ntsamp);
     if (csvfile)
-      fprintf(stderr, " CSV file: %s\n", csvfile);
+      fprintf(stderr, " %s file: %s\n", binary ? "Binary log" : "CSV", csvfile);
+    if (tracefile)
+      fprintf(stderr, " Trace file: %s\n", tracefile);
+    if (!jpath.empty())
+      fprintf(stderr, " Journal: %s\n", jpath.c_str());
+    if (resume)
+      fprintf(stderr, " Resumed after sample %lu at %.6f s\n", csvno, (double)rs.us / USEC);
+    if (resume && (rs.sampleno > csvno))
+      fprintf(stderr, " Samples lost: %llu\n", (unsigned long long)(rs.sampleno - csvno));
+    if (simtime)
+      fprintf(stderr, " Simulated time\n");
+    if (probe)
+      fprintf(stderr, " Function codes: 03 06%s%s%s\n",
+                      (kp184.getFunctions() & KP184::FUNC_READAI) ? " 04" : "",
+                      (kp184.getFunctions() & KP184::FUNC_WRITEAO) ? " 10" : "",
+                      (kp184.getFunctions() & KP184::FUNC_RWAO) ? " 17" : "");
   }
 
-  writefile(csvfile, true, fappend, fpersist, "No.;time;voltage;unit;current;unit\n");
+  if (binary) {
+    char meta[512];
+
+    snprintf(meta, sizeof(meta), "mode=%s\nload=%g\nunit=%s\nvlthres=%g\nvhthres=%g\n"
+             "clthres=%g\nchthres=%g\ninterval=%g\nn0samp=%lu\nntsamp=%lu\nlink=%s %s\n"
+             "address=%hhu\nmaxtime=%s\nmaxinterval=%g\n", KP184::modeStr(mode), load, KP184::modeUnit(mode),
+             vlthres, vhthres, clthres, chthres, (double)tsint.it_interval.tv_sec +
+             (double)tsint.it_interval.tv_nsec / NSEC, n0samp, ntsamp, Link::linkTypeStr(ltype),
+             link, kp184.getAddress(), stend ? ts2str(tsend.it_value) : "",
+             smaxint ? (double)adapt.getMax() / USEC : 0.0);
+    rc = blog.open(csvfile, meta);
+  } else if ((rc = csv.open(csvfile, fappend || resume)) == 0)
+    csv.setSync((unsigned int)sync * 1000);
+  if (rc != 0) {
+    fprintf(stderr, "ERR Opening %s: %s\n", csvfile ? csvfile : "stdout", strerror(-rc));
+    goto close;
+  }
+  if (!resume && !jpath.empty() && ((rc = journal.open(jpath.c_str(), true)) != 0)) {
+    fprintf(stderr, "ERR Creating journal %s: %s\n", jpath.c_str(), strerror(-rc));
+    goto close;
+  }
 
-  usleep(interframe_delay);
+  clk->usleep(interframe_delay);
 
   vsamp = csamp = ntsamp;
   sampleno = 0;
   bstat = !quiet && ((csvfile != NULL) || (isatty(STDOUT_FILENO) == 0));
-  if ((tsint.it_interval.tv_sec == 0) && tsint.it_interval.tv_nsec < (NSEC/2)) // < 0.5s
-    fpersist = true;
-  capacity = energy = 0.0;
+  vlmv = (int32_t)lround(vlthres * 1000.0);
+  vhmv = (vhthres > 0.0) ? (int32_t)lround(vhthres * 1000.0) : -1;
+  clma = (clthres >= 0.0) ? (int32_t)lround(clthres * 1000.0) : -1;
+  chma = (chthres >= 0.0) ? (int32_t)lround(chthres * 1000.0) : -1;
+  cload = load;
   term = TERM_NONE;
 
   tsint.it_value.tv_sec = tsint.it_interval.tv_sec;
   tsint.it_value.tv_nsec = tsint.it_interval.tv_nsec;
   tload.tv_sec = tload.tv_nsec = 0;
-  clock_gettime(CLOCK_MONOTONIC, &tstart);
-  if (timer_settime(tintid, 0, &tsint, NULL) == -1) {
+  clk->now(tstart);
+  tsamp = tstart;
+  if (resume) {
+    // time goes on from the last sample by as long as the run was down
+    struct timespec twall, toff;
+    uint64_t us;
+
+    clock_gettime(CLOCK_REALTIME, &twall);
+    us = (uint64_t)twall.tv_sec * USEC + twall.tv_nsec / (NSEC/USEC);
+    us = rs.us + ((us > rs.wall) ? us - rs.wall : 0);
+    toff = { (time_t)(us / USEC), (long)(us % USEC) * (NSEC/USEC) };
+    ts_sub(tstart, tstart, toff);
+    toff = { (time_t)(rs.loadus / USEC), (long)(rs.loadus % USEC) * (NSEC/USEC) };
+    ts_add(tload, tstart, toff);
+
+    sampleno = csvno;
+    vsamp = rs.vsamp;
+    csamp = rs.csamp;
+    vhmv = rs.vhmv;
+    cload = rs.cload;
+    integ.setState(rs.integ);
+    gap = true;
+
+    // the maximum load time counts the time down too
+    if ((sampleno > n0samp) && (ts_cmp(tsend.it_value, { 0, 0 }) > 0)) {
+      struct itimerspec tsrem = {};
+
+      ts_sub(toff, tsamp, tload);
+      ts_sub(tsrem.it_value, tsend.it_value, toff);
+      if (ts_cmp(tsrem.it_value, { 0, 0 }) <= 0)
+        term = TERM_TIME;
+      else if (clk->timerSet(tendid, tsrem) < 0) {
+        perror("ERR Setting termination timer failure");
+        term = TERM_ERR;
+      }
+    }
+  }
+  rs.mode = mode;
+  rs.load = load;
+  rs.vlmv = vlmv;
+  rs.n0samp = (uint32_t)n0samp;
+  if (clk->timerSet(tintid, tsint) < 0) {
     perror("ERR Setting termination timer failure");
     term = TERM_ERR;
   }
   while(term < TERM_IMMED) {
-    struct timespec tcur, tprev;
+    struct timespec tcur;
 
     if (sampleno == n0samp) {
       rc = kp184.setOutput(true);
       if (rc) goto looperr;
-      clock_gettime(CLOCK_MONOTONIC, &tsamp);
-      tload.tv_sec = tsamp.tv_sec;
-      tload.tv_nsec = tsamp.tv_nsec;
+      clk->now(tload);
       if (ts_cmp(tsend.it_value, { 0, 0 }) > 0) {
-        if (timer_settime(tendid, 0, &tsend, NULL) == -1) {
+        if (clk->timerSet(tendid, tsend) < 0) {
           perror("\nERR Setting termination timer failure");
           term = TERM_ERR;
           break;
         }
       }
-      usleep(300000); // allow load to stabilize
+      clk->usleep(300000); // allow load to stabilize
     }
-    rc = kp184.getStatus(sw, cmode, voltage, current);
+    rc = kp184.getSample(smp, tsamp);
     if (rc) goto looperr;
-    if (sampleno != n0samp) clock_gettime(CLOCK_MONOTONIC, &tsamp);
+    // the first loaded sample is stamped at the load switch
+    if (sampleno == n0samp) tsamp = tload;
+    if (gap) {
+      smp.flags |= Sample::FLAG_GAP;
+      gap = false;
+    }
     ts_sub(tcur, tsamp, tstart);
+    usamp = (uint64_t)tcur.tv_sec * USEC + tcur.tv_nsec / (NSEC/USEC);
     ++sampleno;
 
     // high current threshold
-    if ((chthres >= 0.0) && (current >= chthres)) {
-      usleep(interframe_delay);
+    if ((chma >= 0) && (smp.ma >= chma)) {
+      clk->usleep(interframe_delay);
       kp184.setOutput(false);
-      fprintf(stderr, "\n!!! Current %g A reached high threshold, load is turned off !!!\n", current);
+      fprintf(stderr, "\n!!! Current %g A reached high threshold, load is turned off !!!\n", smp.amps());
       term = TERM_HICUR;
     }
 
-    writefile(csvfile, false, fappend, fpersist, "%lu;%ld.%06ld;%g;V;%g;A\n",
-             sampleno, tcur.tv_sec, tcur.tv_nsec / (NSEC/USEC), voltage, current);
+    if (binary) {
+      int lrc = blog.append(sampleno, usamp, smp);
+      if ((lrc != 0) && (blrc == 0)) blrc = lrc;
+    } else
+      csv.push(sampleno, usamp, smp);
 
-    if ((sampleno - 1) > n0samp) {
-      ts_sub(tprev, tsamp, tprev);
-      double passed = (double)tprev.tv_sec + (double)tprev.tv_nsec / NSEC;
-      capacity += (current + pc) / 2.0 * passed / 3600.0;
-      energy += (current + pc) * (voltage + pv) / 4.0 * passed / 3600.0;
-    }
+    if (sampleno > n0samp)
+      integ.add(smp);
 
     if (bstat) {
       op = fprintf(stderr, "\r%lu %ld.%06ld s %g V %g A %.5g W %.5g Ah %.5g Wh",
            sampleno, tcur.tv_sec, tcur.tv_nsec / 1000,
-           voltage, current, voltage * current, capacity, energy);
+           smp.volts(), smp.amps(), smp.watts(), integ.ah(), integ.wh());
       ioctl(STDERR_FILENO, TIOCGWINSZ, &ws);
       fprintf(stderr, "%*s", ws.ws_col - op, "");
       fflush(stderr);
     }
 
-    pv = voltage; pc = current;
-    tprev.tv_sec = tsamp.tv_sec;
-    tprev.tv_nsec = tsamp.tv_nsec;
-
     if (term) break;
 
     // voltage thresholds
-    if ((vhthres > 0.0) && (voltage <= vhthres)) {
-      clock_gettime(CLOCK_MONOTONIC, &tcur);
+    if ((vhmv > 0) && (smp.mv <= vhmv)) {
+      clk->now(tcur);
       ts_sub(tcur, tcur, tsamp);
       ts_sub(tcur, thalf, tcur); // remaining time to half interval
-      while (nanosleep(&tcur, &tcur) == EINTR);
-      rc = kp184.setModeValue(mode, load / 2.0);
+      if (ts_cmp(tcur, { 0, 0 }) > 0)
+        clk->sleep(tcur);
+      cload = load / 2.0;
+      vhmv = -1;
+      adapt.reset(); // the voltage jumps, it's another discharge now
+      cross.reset();
+      rc = kp184.setModeValue(mode, cload);
       if (rc) goto looperr;
-      vhthres = -1.0;
     } else {
-      if (voltage <= vlthres) {
+      if (sconfint && (sampleno > n0samp))
+        cross.add(usamp, smp.mv);
+      if (smp.mv <= vlmv) {
+        // where the line between the samples crosses the threshold
+        if (pmv > vlmv) {
+          double f = (double)(pmv - vlmv) / (pmv - smp.mv);
+
+          xus = pus + (uint64_t)(f * (double)(usamp - pus));
+          xah = pah + f * (integ.ah() - pah);
+          xwh = pwh + f * (integ.wh() - pwh);
+          xvalid = true;
+        }
         --vsamp;
         if (vsamp == 0) {
           term = TERM_LOWVOLT;
@@ -508,8 +745,8 @@ int main(int argc, char *argv[])
     }
 
     // low current thresholds
-    if ((sampleno > n0samp) && (clthres >= 0.0)) {
-      if (current <= clthres) {
+    if ((sampleno > n0samp) && (clma >= 0)) {
+      if (smp.ma <= clma) {
         --csamp;
         if (csamp == 0) {
           term = TERM_LOWCUR;
@@ -519,12 +756,74 @@ int main(int argc, char *argv[])
         ++csamp;
     }
 
+    if (journal.isOpen()) {
+      struct timespec twall;
+
+      clock_gettime(CLOCK_REALTIME, &twall);
+      rs.wall = (uint64_t)twall.tv_sec * USEC + twall.tv_nsec / (NSEC/USEC);
+      rs.us = usamp;
+      rs.loadus = (sampleno > n0samp) ? (uint64_t)(tload.tv_sec - tstart.tv_sec) * USEC +
+                                        (tload.tv_nsec - tstart.tv_nsec) / (NSEC/USEC) : 0;
+      rs.sampleno = sampleno;
+      rs.integ = integ.getState();
+      rs.cload = cload;
+      rs.vhmv = vhmv;
+      rs.vsamp = (uint32_t)vsamp;
+      rs.csamp = (uint32_t)csamp;
+      // synced along with the CSV, the page cache keeps it if only battery dies
+      jsync = (sync > 0) && (usamp - jsynced >= sync * USEC);
+      if (jsync)
+        jsynced = usamp;
+      if (((rc = journal.commit(rs, jsync)) != 0) && !quiet)
+        fprintf(stderr, "\nERR Committing journal: %s\n", strerror(-rc));
+    }
+
+    if (sampleno > n0samp) {
+      pus = usamp;
+      pmv = smp.mv;
+      pah = integ.ah();
+      pwh = integ.wh();
+    }
+
+    // the timer goes on from the sample at the interval the discharge asks for,
+    // the samples around the predicted crossing and confirming it come sooner
+    if ((smaxint || sconfint) && (sampleno > n0samp)) {
+      uint32_t want = baseint;
+      uint64_t ahead;
+
+      if (smaxint)
+        want = adapt.next(smp, (vhmv > 0) ? vhmv : vlmv);
+      if (sconfint && (vhmv <= 0)) {
+        if (smp.mv <= vlmv)
+          want = confint;
+        else if (cross.predict(vlmv, ahead) && (ahead < want))
+          want = (ahead > 2 * (uint64_t)confint) ? (uint32_t)(ahead - confint) : confint;
+      }
+
+      if (want != (uint32_t)(tsint.it_interval.tv_sec * USEC + tsint.it_interval.tv_nsec / (NSEC/USEC))) {
+        tsint.it_interval = { (time_t)(want / USEC), (long)(want % USEC) * (NSEC/USEC) };
+        ts_div(thalf, tsint.it_interval, 2);
+        clk->now(tcur);
+        ts_sub(tcur, tcur, tsamp);
+        ts_sub(tsint.it_value, tsint.it_interval, tcur);
+        if (ts_cmp(tsint.it_value, { 0, 0 }) <= 0)
+          tsint.it_value = { 0, 1 };
+        if (clk->timerSet(tintid, tsint) < 0) {
+          perror("\nERR Setting sample timer failure");
+          term = TERM_ERR;
+        }
+      }
+    }
+
     // wait for timers
     while (term == TERM_NONE) {
-      int sret = sigwaitinfo(&timset, &sinfo);
-      if ((sret != SIGALRM) || (sinfo.si_value.sival_ptr == 0))
+      int id = clk->wait();
+      if (id == -EINTR)
         continue;
-      if ((timer_t)sinfo.si_value.sival_ptr != tintid)
+      if (id < 0) {
+        fprintf(stderr, "\nERR Waiting for timers: %s\n", strerror(-id));
+        term = TERM_ERR;
+      } else if (id != tintid)
         term = TERM_TIME;
       break;
     }
@@ -535,35 +834,51 @@ looperr:
     fprintf(stderr, "\nERR Communicating device: %s\n", strerror(-rc));
     fprintf(stderr, "Trying to reconnect");
     do {
-      usleep(900000UL);
+      clk->usleep(900000UL);
+      kp184.countRetry();
       fputs(".\a", stderr);
-      if ((rc = kp184.reOpen()) != 0) continue;
-      if ((rc = setup(kp184, mode, load)) != 0) continue;
-      usleep(interframe_delay);
-      if (sampleno >= n0samp) rc = kp184.setOutput(true);
+      rc = restore(kp184, mode, cload, sampleno >= n0samp);
     } while((term == TERM_NONE) && (rc != 0));
-    usleep(interframe_delay);
+    clk->usleep(interframe_delay);
     fputs("\n", stderr);
   }
 
-  usleep(interframe_delay);
+  clk->usleep(interframe_delay);
   if (!quiet) fprintf(stderr, "%sSwitching the load off", bstat ? "\n" : "");
   do {
     rc = kp184.setOutput(false);
     if (rc != 0) {
       fputs(".\a", stderr);
-      sleep(1);
-      kp184.reOpen();
+      clk->usleep(1000000UL);
+      kp184.countRetry();
       continue;
     }
     break;
   } while(true);
+  clk->now(toff);
+
+  if (csv.stalls() && !quiet)
+    fprintf(stderr, "\nCSV writer fell behind %lu times", csv.stalls());
+  if ((rc = csv.close()) != 0)
+    fprintf(stderr, "\nERR Writing %s: %s", csvfile ? csvfile : "stdout", strerror(-rc));
+  if (((rc = blog.close()) != 0) || ((rc = blrc) != 0))
+    fprintf(stderr, "\nERR Writing %s: %s", csvfile, strerror(-rc));
+
+  if (journal.isOpen()) {
+    // only a run which ended on its own is done, one stopped by a signal
+    // keeps its journal to be resumed, a shutdown sends SIGTERM and a gone
+    // device is given up on by interrupting; done is committed in case
+    // removing it fails
+    rs.done = (term != TERM_USER) && (term != TERM_ERR);
+    if ((rc = journal.commit(rs, true)) != 0)
+      fprintf(stderr, "\nERR Committing journal: %s", strerror(-rc));
+    journal.close();
+    if (rs.done && (unlink(jpath.c_str()) < 0))
+      fprintf(stderr, "\nERR Removing journal %s: %s", jpath.c_str(), strerror(errno));
+  }
 
-  if ((outfile != NULL) && (outfile != stdout))
-    fclose(outfile);
-
-  if (tintid) timer_delete(tintid);
-  if (tendid) timer_delete(tendid);
+  if (tintid) clk->timerDelete(tintid);
+  if (tendid) clk->timerDelete(tendid);
 
   ts_sub(tload, tsamp, tload);
 
@@ -573,12 +888,24 @@ looperr:
       "low current threshold", "high current threshold", "error" };
     fprintf(stderr, "\nTerminated by %s\n", sreason[term - 1]);
 
+    if ((term == TERM_LOWVOLT) && xvalid) {
+      ts_sub(toff, toff, tstart);
+      fprintf(stderr, "Crossed %g V at %.3f s %.5g Ah %.5g Wh, load off %.3f s later\n",
+             vlthres, (double)xus / USEC, xah, xwh,
+             (double)toff.tv_sec + (double)toff.tv_nsec / NSEC - (double)xus / USEC);
+    }
+
     if (!bstat)
       fprintf(stderr, "Load was on for %lu samples %s %.5g Ah %.5g Wh\n",
-             sampleno - n0samp, ts2str(tload), capacity, energy);
+             sampleno - n0samp, ts2str(tload), integ.ah(), integ.wh());
+
+    fprintf(stderr, "Link statistics:\n");
+    kp184.getStats().print(stderr, " ");
   }
 
 close:
+  kp184.setTrace(NULL);
+  trace.close();
   kp184.close();
 
   return term;
@@ -4,8 +4,13 @@
 #include <cerrno>
 #include <unistd.h>
 #include <termios.h>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 #include "KP184.h"
+#include "worker.h"
 #include "util.h" // str2*, matches
 
 #include "device.h"
@@ -13,10 +18,214 @@
 using namespace std;
 
 KP184 kp184;
+KP184Worker worker(kp184);
+Trace trace;
 
 static const char *prompt = "> ";
 // settings
 static const char *defconf_serial = "19200,8,N,1";
+static const unsigned int defconf_statttl = 200; // ms, voltage, current and power share a read
+
+// the worker polls the status in the background, the guard switches the load
+// off once the current goes over a limit; meanwhile the worker owns the device
+// and commands are queued to it in between the polls
+class Monitor {
+public:
+  Monitor() : m_on(false), m_stop(false), m_interval(0), m_limit(0.0) {}
+
+  ~Monitor() { stop(); }
+
+  bool isOn() const { return m_on; }
+
+  unsigned int getInterval() const { return m_interval; }
+
+  double getLimit() const { return m_limit; }
+
+  // ms, A, 0 for no guard
+  int start(unsigned int interval, double limit) {
+    int rc;
+
+    stop();
+    worker.setInterval(interval);
+    if ((rc = worker.start()) < 0)
+      return rc;
+    m_on = true;
+    m_stop = false;
+    m_interval = interval;
+    m_limit = limit;
+    if (limit > 0.0)
+      m_guard = thread(&Monitor::guard, this);
+
+    return 0;
+  }
+
+  void stop() {
+    if (!m_on)
+      return;
+
+    if (m_guard.joinable()) {
+      {
+        lock_guard<mutex> lock(m_lock);
+        m_stop = true;
+      }
+      m_cond.notify_all();
+      m_guard.join();
+    }
+    worker.stop();
+    m_on = false;
+  }
+
+private:
+  // looks at every new status, the worker runs the switch off right after
+  // the poll in progress, ahead of whatever the shell queues next
+  void guard() {
+    unique_lock<mutex> lock(m_lock);
+    KP184Worker::status_t st;
+    uint32_t seq = 0;
+    int rc;
+
+    while (!m_cond.wait_for(lock, chrono::milliseconds(m_interval), [this] { return m_stop; })) {
+      worker.getStatus(st);
+      if ((st.seq == seq) || !st.out || (st.current <= m_limit)) {
+        seq = st.seq;
+        continue;
+      }
+      seq = st.seq;
+
+      lock.unlock();
+      rc = worker.setOutput(false);
+      if (rc == 0)
+        printf("\nOK Load switched OFF, current %g A over %g A\n", st.current, m_limit);
+      else
+        printf("\nERR Switching the load OFF at %g A: %s\n", st.current, strerror(-rc));
+      fflush(stdout);
+      lock.lock();
+    }
+  }
+
+  bool m_on;
+  bool m_stop;
+  unsigned int m_interval;
+  double m_limit;
+  thread m_guard;
+  mutex m_lock;
+  condition_variable m_cond;
+};
+
+static Monitor monitor;
+
+// the device or, while monitoring, the worker
+
+static bool busy()
+{
+  if (!monitor.isOn())
+    return false;
+
+  printf("ERR Monitor is on, turn it off first\n");
+  return true;
+}
+
+// status read now, not a poll's
+static int refresh(KP184Worker::status_t &st)
+{
+  int rc;
+
+  if ((rc = worker.refresh()) < 0)
+    return rc;
+  worker.getStatus(st);
+
+  return 0;
+}
+
+static int setOutput(bool on)
+{
+  return monitor.isOn() ? worker.setOutput(on) : kp184.setOutput(on);
+}
+
+static int setMode(KP184::mode_t mode)
+{
+  return monitor.isOn() ? worker.setMode(mode) : kp184.setMode(mode);
+}
+
+static int setModeValue(KP184::mode_t mode, double value)
+{
+  return monitor.isOn() ? worker.setModeValue(mode, value) : kp184.setModeValue(mode, value);
+}
+
+static int getStatus(bool &out, KP184::mode_t &mode, double &voltage, double &current)
+{
+  KP184Worker::status_t st;
+  int rc;
+
+  if (!monitor.isOn())
+    return kp184.getStatus(out, mode, voltage, current);
+
+  if ((rc = refresh(st)) == 0) {
+    out = st.out;
+    mode = st.mode;
+    voltage = st.voltage;
+    current = st.current;
+  }
+
+  return rc;
+}
+
+static int getOutput(bool &out)
+{
+  KP184::mode_t mode;
+  double voltage, current;
+
+  if (!monitor.isOn())
+    return kp184.getOutput(out);
+  return getStatus(out, mode, voltage, current);
+}
+
+static int getMode(KP184::mode_t &mode)
+{
+  bool out;
+  double voltage, current;
+
+  if (!monitor.isOn())
+    return kp184.getMode(mode);
+  return getStatus(out, mode, voltage, current);
+}
+
+static int getVoltage(double &voltage)
+{
+  bool out;
+  KP184::mode_t mode;
+  double current;
+
+  if (!monitor.isOn())
+    return kp184.getVoltage(voltage);
+  return getStatus(out, mode, voltage, current);
+}
+
+static int getCurrent(double &current)
+{
+  bool out;
+  KP184::mode_t mode;
+  double voltage;
+
+  if (!monitor.isOn())
+    return kp184.getCurrent(current);
+  return getStatus(out, mode, voltage, current);
+}
+
+static int getPower(double &power)
+{
+  bool out;
+  KP184::mode_t mode;
+  double voltage, current;
+  int rc;
+
+  if (!monitor.isOn())
+    return kp184.getPower(power);
+  if ((rc = getStatus(out, mode, voltage, current)) == 0)
+    power = voltage * current;
+
+  return rc;
+}
 
 // public
 
@@ -63,8 +272,70 @@ int set_debug(int argc, char *argv[])
 }
 #endif
 
+int set_trace(int argc, char *argv[])
+{
+  int rc;
+
+  argc--; argv++;
+
+  if (argc < 1) { // get trace file
+    if (trace.isOpen())
+      printf("%s\n", trace.getPath());
+    else
+      printf("off\n");
+  } else {
+    kp184.setTrace(NULL);
+    trace.close();
+    if (strcmp(argv[0], "off") == 0)
+      return 0;
+    if ((rc = trace.open(argv[0], kp184.getLinkType())) < 0) {
+      printf("ERR Opening trace file %s: %s\n", argv[0], strerror(-rc));
+      return rc;
+    }
+    kp184.setTrace(&trace);
+  }
+
+  return 0;
+}
+
+int set_shadow(int argc, char *argv[])
+{
+  bool shadow;
+
+  argc--; argv++;
+
+  if (argc) {
+    Util::str2b(argv[0], shadow);
+    kp184.setShadow(shadow);
+  } else
+    printf("%s\n", kp184.getShadow() ? "on" : "off");
+
+  return 0;
+}
+
+int set_cache(int argc, char *argv[])
+{
+  unsigned long ms;
+  int rc;
+
+  argc--; argv++;
+
+  if (argc < 1) // get status cache window
+    printf("OK %u ms\n", kp184.getStatusTTL());
+  else {
+    if ((rc = Util::str2ul(argv[0], ms)))
+      return rc;
+    kp184.setStatusTTL((unsigned int)ms);
+  }
+
+  return 0;
+}
+
 cmd_t settings[] = {
   { "address", set_address, "Get or set target device address" },
+  { "trace", set_trace, "Record wire traffic to a file or turn it off" },
+  { "shadow", set_shadow, "Skip writes of values the device has already, off by default" },
+  { "cache", set_cache, "Get or set how long read status is reused, ms" },
 #ifdef MBDEBUG
   { "debug", set_debug, "Enable or disable debug mode" },
 #endif
@@ -98,6 +369,8 @@ int cmd_setting(int argc, char *argv[])
       rc = -ENOSYS;
     } else if (amb)
       rc = -EINVAL;
+    else if ((argc > 1) && busy())
+      rc = -EBUSY;
     else
       rc = setptr->proc(argc, argv);
   } else {
@@ -118,7 +391,7 @@ int cmd_switch(int argc, char *argv[])
 
   Util::str2b(argv[0], sw);
 
-  rc = kp184.setOutput(sw);
+  rc = setOutput(sw);
   if (rc == 0)
     printf("OK Load switched %s\n", sw ? "ON" : "OFF");
   else
@@ -138,7 +411,7 @@ int cmd_load(int argc, char *argv[])
   else {
     bool sw;
 
-    rc = kp184.getOutput(sw);
+    rc = getOutput(sw);
     if (rc == 0)
       printf("OK Load is %s\n", sw ? "ON" : "OFF");
     else
@@ -177,13 +450,13 @@ int cmd_mode(int argc, char *argv[])
       break;
     } while(*ptr);
 
-    rc = kp184.setMode(mode);
+    rc = setMode(mode);
     if (rc == 0)
       printf("OK Mode set to %s\n", KP184::modeStr(mode));
     else
       printf("ERR Setting mode: %s\n", strerror(-rc));
   } else {
-    rc = kp184.getMode(mode);
+    rc = getMode(mode);
     if (rc == 0)
       printf("OK %s\n", KP184::modeStr(mode));
     else
@@ -205,7 +478,7 @@ int cmd_voltage(int argc, char *argv[])
     if (rc)
       return rc;
 
-    rc = kp184.setVoltage(val);
+    rc = setModeValue(KP184::MODE_CV, val);
     if (rc == 0)
       printf("OK Constant voltage set to %g V\n", val);
     else {
@@ -216,7 +489,7 @@ int cmd_voltage(int argc, char *argv[])
         printf("ERR Setting constant voltage: %s\n", strerror(-rc));
     }
   } else {
-    rc = kp184.getVoltage(val);
+    rc = getVoltage(val);
     if (rc == 0)
       printf("OK %g V\n", val);
     else
@@ -238,7 +511,7 @@ int cmd_current(int argc, char *argv[])
     if (rc)
       return rc;
 
-    rc = kp184.setCurrent(val);
+    rc = setModeValue(KP184::MODE_CC, val);
     if (rc == 0)
       printf("OK Constant current set to %g A\n", val);
     else {
@@ -249,7 +522,7 @@ int cmd_current(int argc, char *argv[])
         printf("ERR Setting constant current: %s\n", strerror(-rc));
     }
   } else {
-    rc = kp184.getCurrent(val);
+    rc = getCurrent(val);
     if (rc == 0)
       printf("OK %g A\n", val);
     else
@@ -275,7 +548,7 @@ int cmd_resistance(int argc, char *argv[])
   if (rc)
     return rc;
 
-  rc = kp184.setResistance(val);
+  rc = setModeValue(KP184::MODE_CR, val);
   if (rc == 0)
     printf("OK Constant resistance set to %g Ohm\n", val);
   else {
@@ -301,7 +574,7 @@ int cmd_power(int argc, char *argv[])
     if (rc)
       return rc;
 
-    rc = kp184.setPower(val);
+    rc = setModeValue(KP184::MODE_CP, val);
     if (rc == 0)
       printf("OK Constant power set to %g W\n", val);
     else {
@@ -312,7 +585,7 @@ int cmd_power(int argc, char *argv[])
         printf("ERR Setting constant power: %s\n", strerror(-rc));
     }
   } else {
-    rc = kp184.getPower(val);
+    rc = getPower(val);
     if (rc == 0)
       printf("OK %g W\n", val);
     else
@@ -329,7 +602,7 @@ int cmd_status(int argc, char *argv[])
   KP184::mode_t mode;
   double v, c;
 
-  rc = kp184.getStatus(out, mode, v, c);
+  rc = getStatus(out, mode, v, c);
   if (rc == 0) {
     printf("Load %s\n", out ? "ON" : "OFF");
     printf("Mode %s\n", KP184::modeStr(mode));
@@ -342,6 +615,111 @@ int cmd_status(int argc, char *argv[])
   return rc;
 }
 
+int cmd_probe(int argc, char *argv[])
+{
+  int rc;
+
+  if (busy())
+    return -EBUSY;
+
+  rc = kp184.probe();
+  if (rc >= 0)
+    printf("OK Function codes 03 06%s%s%s\n",
+           (rc & KP184::FUNC_READAI) ? " 04" : "",
+           (rc & KP184::FUNC_WRITEAO) ? " 10" : "",
+           (rc & KP184::FUNC_RWAO) ? " 17" : "");
+  else
+    printf("ERR Probing function codes: %s\n", strerror(-rc));
+
+  return (rc < 0) ? rc : 0;
+}
+
+int cmd_stats(int argc, char *argv[])
+{
+  argc--; argv++;
+
+  if (busy())
+    return -EBUSY;
+
+  if (argc > 0) {
+    if (Util::matches(argv[0], "reset") != 0) {
+      printf("ERR Unknown stats argument %s\n", argv[0]);
+      return -EINVAL;
+    }
+    kp184.resetStats();
+    printf("OK Statistics reset\n");
+  } else
+    kp184.getStats().print(stdout);
+
+  return 0;
+}
+
+int cmd_monitor(int argc, char *argv[])
+{
+  KP184Worker::status_t st;
+  unsigned long ms;
+  double limit = 0.0;
+  int rc;
+
+  argc--; argv++;
+
+  if (argc < 1) {
+    struct timespec now;
+
+    if (!monitor.isOn()) {
+      printf("OK Monitor is off\n");
+      return 0;
+    }
+    printf("OK Monitor every %u ms", monitor.getInterval());
+    if (monitor.getLimit() > 0.0)
+      printf(", load OFF over %g A", monitor.getLimit());
+    printf("\n");
+
+    worker.getStatus(st);
+    if (st.seq == 0) {
+      printf("No status yet\n");
+      return 0;
+    }
+    kp184.getClock().now(now);
+    printf("Sample %u, %.3f s ago%s\n", st.seq,
+           (double)(now.tv_sec - st.time.tv_sec) + (now.tv_nsec - st.time.tv_nsec) / 1e9,
+           (st.rc == 0) ? "" : ", the last poll failed");
+    printf("Load %s\n", st.out ? "ON" : "OFF");
+    printf("Mode %s\n", KP184::modeStr(st.mode));
+    printf("Voltage %g V\n", st.voltage);
+    printf("Current %g A\n", st.current);
+    printf("Power %.2f W\n", st.current * st.voltage);
+
+    return 0;
+  }
+
+  if (strcmp(argv[0], "off") == 0) {
+    monitor.stop();
+    printf("OK Monitor is off\n");
+    return 0;
+  }
+
+  if ((rc = Util::str2ul(argv[0], ms)))
+    return rc;
+  if (ms == 0) {
+    printf("ERR Monitor interval must be over 0 ms\n");
+    return -EINVAL;
+  }
+  if ((argc > 1) && (rc = Util::str2d(argv[1], limit)))
+    return rc;
+
+  rc = monitor.start((unsigned int)ms, limit);
+  if (rc == 0) {
+    printf("OK Monitor every %lu ms", ms);
+    if (limit > 0.0)
+      printf(", load OFF over %g A", limit);
+    printf("\n");
+  } else
+    printf("ERR Starting monitor: %s\n", strerror(-rc));
+
+  return rc;
+}
+
 cmd_t devcmds[] = {
   { "off", cmd_switch, "Switch the load OFF" },
   { "on", cmd_switch, "Switch the load ON" },
@@ -352,17 +730,26 @@ cmd_t devcmds[] = {
   { "resistance", cmd_resistance, "Set constant resistance, Ohm" },
   { "power", cmd_power, "Set constant power, W" },
   { "status", cmd_status, "Get active status" },
+  { "probe", cmd_probe, "Find which of function codes 04, 10 and 17 the device takes" },
+  { "stats", cmd_stats, "Get or reset link statistics" },
+  { "monitor", cmd_monitor, "Poll status every ms in the background [and switch the load OFF over A], or off" },
   { "setting", cmd_setting, "Manage internal program settings" },
   CMD_END
 };
 
 int openDevice(Link::linktype_t type, const char *link, const char *config)
 {
+  kp184.setStatusTTL(defconf_statttl);
+  // what's typed is sent, the front panel may have changed the load,
+  // "setting shadow on" skips writes of known values
+  kp184.setShadow(false);
   return kp184.open(type, link, config);
 }
 
 int reOpenDevice()
 {
+  if (busy())
+    return -EBUSY;
   return kp184.reOpen();
 }
 
@@ -4,10 +4,13 @@
 #include <cstring>  // memcmp
 #include <cerrno>   // E*
 #include <cmath> // NaN
+#include <ctime>
 #include <sys/types.h> // ssize_t
 #include <unistd.h>  // usleep
 
 #include "mbrtu.h"
+#include "battmodel.h"
+#include "sample.h"
 
 class KP184: public mbRTU<24, 1, 1, 250> {
 public:
@@ -17,9 +20,11 @@ public:
     m_cres(100.0),
     m_cpow(10.0),
     m_volt(15.213),
-    m_curr(1.0)
+    m_curr(1.0),
+    m_speed(def_speed)
   {
     setAddress(def_devaddr);
+    m_tbatt = now();
   }
 
   typedef enum {
@@ -53,13 +58,31 @@ public:
     return modeunit[mode];
   }
 
-  int openSocket(const char addr[]) { return 0; }
+  typedef enum {
+    FUNC_READAI = 0x01,
+    FUNC_WRITEAO = 0x02,
+    FUNC_RWAO = 0x04
+  } func_t;
+
+  int openSocket(const char addr[], const char service[] = "8899") { return 0; }
 
   int openSerial(const char path[], const char config[]) { return 0; }
 
   int getHandle() { return 0; }
 
-  int open(linktype_t type, const char link[], const char config[]) { return 0; }
+  // link names a battery model file to discharge instead of the default one
+  int open(linktype_t type, const char link[], const char config[]) {
+    BatteryModel batt;
+    int rc;
+
+    if (link && (access(link, F_OK) == 0)) {
+      if ((rc = batt.load(link)) != 0)
+        return rc;
+      setBattery(batt, m_speed);
+    }
+
+    return 0;
+  }
 
   int reOpen() { return 0; }
 
@@ -67,9 +90,27 @@ public:
 
   int flush(queue_t queue) { return 0; }
 
+  // load is connected to the battery, its time runs speed times faster than
+  // the system clock, so hours of discharge pass in seconds
+  void setBattery(const BatteryModel &batt, double speed = def_speed) {
+    m_batt = batt;
+    m_speed = speed;
+    m_tbatt = now();
+  }
+
+  const BatteryModel &getBattery() { return m_batt; }
+
+  // battery runs on the clock, a simulated one as it is
+  void setClock(Clock &clock) {
+    advance();
+    mbRTU::setClock(clock);
+    m_tbatt = now();
+  }
+
   int getStatus(bool &out, mode_t &mode, double &voltage, double &current) {
     int rc;
 
+    advance();
     if ((rc = getOutput(out, false)))
       return rc;
     getMode(mode, true);
@@ -78,6 +119,26 @@ public:
     return 0;
   }
 
+  int getSample(Sample &s, struct timespec &since, bool fromcache = false) {
+    double voltage, current;
+    struct timespec ts;
+
+    if (!fromcache)
+      advance();
+    measure(voltage, current);
+    getClock().now(ts);
+
+    s.dt = Sample::delta(since, ts);
+    s.mv = (int32_t)lround(voltage * 1000.0);
+    s.ma = (int32_t)lround(current * 1000.0);
+    s.flags = m_sw ? Sample::FLAG_OUT : 0;
+    s.mode = (uint8_t)m_mode;
+    s.reserved = 0;
+    since = ts;
+
+    return 0;
+  }
+
   int getOutput(bool &out, bool fromcache = false) {
     out = m_sw;
     return 0;
@@ -90,28 +151,39 @@ public:
   }
 
   int getVoltage(double &voltage, bool fromcache = false) {
+    double current;
 
-    voltage = m_volt;
+    if (!fromcache)
+      advance();
+    measure(voltage, current);
 
     return 0;
   }
 
   int getCurrent(double &current, bool fromcache = false) {
+    double voltage;
 
-    current = m_sw ? m_curr : 0.0;
+    if (!fromcache)
+      advance();
+    measure(voltage, current);
 
     return 0;
   }
 
   int getPower(double &power, bool fromcache = false) {
+    double voltage, current;
 
-    power = m_volt * m_curr;
+    if (!fromcache)
+      advance();
+    measure(voltage, current);
+    power = voltage * current;
 
     return 0;
   }
 
   int setOutput(bool on) {
 
+    advance();
     m_sw = on;
 
     return 0;
@@ -119,6 +191,7 @@ public:
 
   int setMode(mode_t mode) {
 
+    advance();
     m_mode = mode;
 
     return 0;
@@ -130,6 +203,7 @@ public:
         (voltage > modeValMax(MODE_CV)))
       return -EINVAL;
 
+    advance();
     m_volt = voltage;
 
     return 0;
@@ -141,6 +215,7 @@ public:
         (current > modeValMax(MODE_CC)))
       return -EINVAL;
 
+    advance();
     m_curr = current;
 
     return 0;
@@ -152,6 +227,7 @@ public:
         (resistance > modeValMax(MODE_CR)))
       return -EINVAL;
 
+    advance();
     m_cres = resistance;
 
     return 0;
@@ -163,6 +239,7 @@ public:
         (power > modeValMax(MODE_CP)))
       return -EINVAL;
 
+    advance();
     m_cpow = power;
 
     return 0;
@@ -180,7 +257,84 @@ public:
     return -EINVAL;
   }
 
+  int configure(mode_t mode, double value) {
+    int rc;
+
+    if ((rc = setOutput(false)) || (rc = setMode(mode)))
+      return rc;
+    return setModeValue(mode, value);
+  }
+
+  // there are no frames to tell
+  int probe() { return 0; }
+
+  void setFunctions(unsigned int funcs) {}
+
+  unsigned int getFunctions() { return 0; }
+
 private:
+  static constexpr double def_speed = 1000.0;
+  static constexpr double max_current = 40.0;
+  static constexpr double max_step = 1.0; // s of battery time the current is held for
+
+  // battery time, s
+  double now() {
+    struct timespec ts;
+    double t;
+
+    getClock().now(ts);
+    t = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+
+    return getClock().simulated() ? t : t * m_speed;
+  }
+
+  // operating point of the load on the battery
+  void measure(double &voltage, double &current) {
+    double emf = m_batt.emf(), r = m_batt.resistance();
+
+    current = 0.0;
+    if (m_sw && (emf > 0.0)) {
+      switch (m_mode) {
+      case MODE_CV:
+        if (emf > m_volt)
+          current = (r > 0.0) ? (emf - m_volt) / r : max_current;
+        break;
+      case MODE_CC:
+        current = m_curr;
+        break;
+      case MODE_CR:
+        current = emf / (m_cres + r);
+        break;
+      case MODE_CP: {
+        double d = emf * emf - 4.0 * r * m_cpow;
+        if (r <= 0.0)
+          current = m_cpow / emf;
+        else
+          current = (d >= 0.0) ? (emf - sqrt(d)) / (2.0 * r) : emf / (2.0 * r);
+        break;
+      }
+      }
+      if (current > max_current)
+        current = max_current;
+    }
+    voltage = m_batt.terminal(current);
+  }
+
+  // runs the battery up to now, the current follows the voltage
+  void advance() {
+    double t = now();
+
+    while (t > m_tbatt) {
+      double voltage, current, dt = t - m_tbatt;
+
+      measure(voltage, current);
+      if ((current > 0.0) && (dt > max_step))
+        dt = max_step;
+      m_batt.step(current, dt);
+      m_tbatt += dt;
+    }
+  }
+
   typedef enum {
     REG_ONOFF = 0x010E,
     REG_MODE  = 0x0110,
@@ -199,7 +353,10 @@ private:
   double m_cpow;
   double m_volt;
   double m_curr;
+  BatteryModel m_batt;
+  double m_speed;
+  double m_tbatt;   // battery time it's run up to
 
 };
 
-#endif /* _KP184_H */
+#endif /* _KP184_H */
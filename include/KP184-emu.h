@@ -0,0 +1,396 @@
+#ifndef _KP184_EMU_H
+#define _KP184_EMU_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <sys/types.h> // ssize_t
+
+#include "KP184.h"
+#include "battmodel.h"
+
+// device side of KP184 protocol, answers requests the way the real device does
+class KP184Emu {
+public:
+  KP184Emu(devaddr_t addr = KP184::defAddress()) :
+    m_addr(addr),
+    m_out(false),
+    m_mode(KP184::MODE_CV),
+    m_setcv(0),
+    m_setcc(0),
+    m_setcr(0),
+    m_setcw(0),
+    m_srcvolt(12.0),
+    m_srcres(0.05),
+    m_multi(false),
+    m_hasbatt(false),
+    m_speed(1.0),
+    m_tbatt(0.0)
+  {
+  }
+
+  void setAddress(devaddr_t addr) { m_addr = addr; }
+
+  // input, multiple and read/write multiple register requests are taken
+  // as firmware which has them might, otherwise refused as the device does
+  void setMulti(bool on) { m_multi = on; }
+
+  bool getMulti() { return m_multi; }
+
+  devaddr_t getAddress() { return m_addr; }
+
+  // source the load is connected to: open circuit voltage, V and resistance, Ohm
+  void setSource(double voltage, double resistance) {
+    m_srcvolt = voltage;
+    m_srcres = resistance;
+  }
+
+  // battery drives the source instead, its time runs speed times faster
+  // than the monotonic clock, so hours of discharge pass in seconds
+  void setBattery(const BatteryModel &batt, double speed = 1.0) {
+    m_batt = batt;
+    m_hasbatt = true;
+    m_speed = speed;
+    m_tbatt = now();
+    m_srcvolt = m_batt.emf();
+    m_srcres = m_batt.resistance();
+  }
+
+  const BatteryModel &getBattery() { return m_batt; }
+
+  // time of the battery, s
+  double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9) * m_speed;
+  }
+
+  // runs the battery up to time t, s, with whatever the load draws meanwhile
+  void advance(double t) {
+    double step = (t - m_tbatt) / max_steps;
+
+    if (!m_hasbatt)
+      return;
+    if (step < max_step)
+      step = max_step;
+
+    while (t > m_tbatt) {
+      double voltage, current, dt = t - m_tbatt;
+
+      // the current follows the voltage unless there's none
+      measure(voltage, current);
+      if ((current > 0.0) && (dt > step))
+        dt = step;
+      m_batt.step(current, dt);
+      m_tbatt += dt;
+      m_srcvolt = m_batt.emf();
+      m_srcres = m_batt.resistance();
+    }
+  }
+
+  bool getOutput() { return m_out; }
+
+  KP184::mode_t getMode() { return m_mode; }
+
+  // returns total length of the request at the head of the buffer,
+  // 0 if more bytes are needed to tell
+  static size_t requestLength(const uint8_t buf[], size_t len) {
+    if (len < 2)
+      return 0;
+
+    switch (buf[1]) {
+    case OP_WRITE1AO: // addr + code + reg[2] + 1[2] + 4 + val[4]
+      if (len < 7)
+        return 0;
+      if (buf[6] == 4)
+        return 11 + 2;
+      break;
+    case OP_WRITEAO: // addr + code + reg[2] + cnt[2] + count + data
+      if (len < 7)
+        return 0;
+      return 7 + buf[6] + 2;
+    case OP_RWAO: // addr + code + rreg[2] + rcnt[2] + wreg[2] + wcnt[2] + count + data
+      if (len < 11)
+        return 0;
+      return 11 + buf[10] + 2;
+    default:
+      break;
+    }
+
+    // addr + code + reg[2] + val[2]
+    return 6 + 2;
+  }
+
+  // returns total length of Modbus TCP request at the head of the buffer,
+  // 0 if more bytes are needed to tell
+  static size_t requestLengthTCP(const uint8_t buf[], size_t len) {
+    if (len < mbap_len)
+      return 0;
+    return mbap_len + ((size_t)buf[4] << 8 | buf[5]);
+  }
+
+  // Modbus TCP flavour of process(), as a gateway would pass it to the device
+  ssize_t processTCP(const uint8_t req[], size_t len, uint8_t reply[], size_t size) {
+    uint8_t rtu[max_reqlen + 2], rbuf[max_replylen];
+    ssize_t rlen;
+
+    if ((len <= mbap_len) || (len - mbap_len > max_reqlen) ||
+        (size < mbap_len + max_replylen))
+      return -EINVAL;
+
+    len -= mbap_len;
+    memcpy(rtu, req + mbap_len, len);
+    len = KP184::addCRC(rtu, len);
+    if ((rlen = process(rtu, len, rbuf, sizeof(rbuf))) <= 0)
+      return rlen;
+
+    rlen -= 2; // no CRC
+    memcpy(reply, req, 4); // transaction and protocol
+    reply[4] = (uint8_t)(rlen >> 8);
+    reply[5] = (uint8_t)(rlen & 0xFF);
+    memcpy(reply + mbap_len, rbuf, rlen);
+
+    return mbap_len + rlen;
+  }
+
+  // len is full request frame length (inc. CRC)
+  // returns reply frame length (inc. CRC), 0 if the device keeps silent
+  ssize_t process(const uint8_t req[], size_t len, uint8_t reply[], size_t size) {
+    regaddr_t reg;
+    int32_t val;
+    size_t rlen;
+    uint8_t code;
+
+    if (size < max_replylen)
+      return -ENOBUFS;
+    advance(now());
+    if (KP184::checkCRC(req, len) < 0)
+      return 0;
+    len -= 2;
+    if ((req[0] != m_addr) && (req[0] != 0))
+      return 0;
+
+    reg = (regaddr_t)((int)req[2] << 8 | req[3]);
+    code = req[1];
+    if (!m_multi && ((code == OP_READAI) || (code == OP_WRITEAO) || (code == OP_RWAO)))
+      code = 0;
+    switch (code) {
+    case OP_READAO:
+    case OP_READAI:
+      if ((len != 6) || (reg != REG_STAT)) {
+        rlen = exception(reply, req[1], EXC_ADDR);
+        break;
+      }
+      // byte count doesn't match the status block which follows
+      reply[0] = m_addr;
+      reply[1] = req[1];
+      reply[2] = 0x1E;
+      status(reply + 3);
+      rlen = 3 + stat_len;
+      break;
+    case OP_WRITEAO:
+      if ((len != 7 + (size_t)req[6]) || !writeMulti(reg, req + 4, req + 6)) {
+        rlen = exception(reply, req[1], EXC_VALUE);
+        break;
+      }
+      memcpy(reply, req, 6);
+      reply[0] = m_addr;
+      rlen = 6;
+      break;
+    case OP_RWAO:
+      if ((len != 11 + (size_t)req[10]) || (reg != REG_STAT) ||
+          !writeMulti((regaddr_t)((int)req[6] << 8 | req[7]), req + 8, req + 10)) {
+        rlen = exception(reply, req[1], EXC_VALUE);
+        break;
+      }
+      reply[0] = m_addr;
+      reply[1] = OP_RWAO;
+      reply[2] = 0x1E;
+      status(reply + 3);
+      rlen = 3 + stat_len;
+      break;
+    case OP_WRITE1AO:
+      if ((len != 11) || (req[6] != 4)) {
+        rlen = exception(reply, req[1], EXC_VALUE);
+        break;
+      }
+      val = (int32_t)((uint32_t)req[7] << 24 | (uint32_t)req[8] << 16 |
+                      (uint32_t)req[9] << 8 | req[10]);
+      if (!write(reg, val)) {
+        rlen = exception(reply, req[1], EXC_ADDR);
+        break;
+      }
+      // echo is cut after the byte count
+      memcpy(reply, req, 7);
+      reply[0] = m_addr;
+      rlen = 7;
+      break;
+    default:
+      rlen = exception(reply, req[1], EXC_FUNC);
+      break;
+    }
+
+    if (req[0] == 0) // broadcast
+      return 0;
+
+    return KP184::addCRC(reply, rlen);
+  }
+
+  // operating point of the load
+  void measure(double &voltage, double &current) {
+    double r = m_srcres;
+
+    voltage = m_srcvolt;
+    current = 0.0;
+    if (!m_out || (m_srcvolt <= 0.0))
+      return;
+
+    switch (m_mode) {
+    case KP184::MODE_CV:
+      if (m_srcvolt > m_setcv / 1000.0)
+        current = (r > 0.0) ? (m_srcvolt - m_setcv / 1000.0) / r : max_current;
+      break;
+    case KP184::MODE_CC:
+      current = m_setcc / 1000.0;
+      break;
+    case KP184::MODE_CR:
+      if (m_setcr > 0)
+        current = m_srcvolt / (m_setcr / 10.0 + r);
+      else
+        current = max_current;
+      break;
+    case KP184::MODE_CP:
+      if (r > 0.0) {
+        // V * I = P, V = Voc - I * R
+        double d = m_srcvolt * m_srcvolt - 4.0 * r * m_setcw / 100.0;
+        current = (d >= 0.0) ? (m_srcvolt - sqrt(d)) / (2.0 * r) : m_srcvolt / (2.0 * r);
+      } else
+        current = m_setcw / 100.0 / m_srcvolt;
+      break;
+    }
+
+    if (current > max_current)
+      current = max_current;
+    voltage = m_srcvolt - current * r;
+    if (voltage < 0.0)
+      voltage = 0.0;
+  }
+
+protected:
+  typedef enum {
+    OP_READAO = 0x03,
+    OP_READAI = 0x04,
+    OP_WRITE1AO = 0x06,
+    OP_WRITEAO = 0x10,
+    OP_RWAO = 0x17
+  } opcode_t;
+
+  typedef enum {
+    EXC_FUNC = 0x01,
+    EXC_ADDR = 0x02,
+    EXC_VALUE = 0x03
+  } exception_t;
+
+  typedef enum {
+    REG_ONOFF = 0x010E,
+    REG_MODE  = 0x0110,
+    REG_SETCV = 0x0112,
+    REG_SETCC = 0x0116,
+    REG_SETCR = 0x011A,
+    REG_SETCW = 0x011E,
+    REG_STAT  = 0x0300
+  } regaddr_t;
+
+  static const size_t stat_len = 18;
+  static const size_t max_reqlen = 22;
+  static const size_t max_replylen = 3 + stat_len + 2;
+  static const size_t mbap_len = 6;
+  static constexpr double max_current = 40.0;
+  static constexpr double max_step = 1.0;   // s of battery time the current is held for
+  static constexpr double max_steps = 1000.0; // per advance, longer ones beyond
+
+  size_t exception(uint8_t reply[], uint8_t code, exception_t exc) {
+    reply[0] = m_addr;
+    reply[1] = code | 0x80;
+    reply[2] = (uint8_t)exc;
+    return 3;
+  }
+
+  // returns false on unknown register
+  virtual bool write(regaddr_t reg, int32_t val) {
+    switch (reg) {
+    case REG_ONOFF: m_out = (val != 0); break;
+    case REG_MODE:
+      if ((val < KP184::MODE_CV) || (val > KP184::MODE_CP))
+        return false;
+      m_mode = (KP184::mode_t)val;
+      break;
+    case REG_SETCV: m_setcv = val; break;
+    case REG_SETCC: m_setcc = val; break;
+    case REG_SETCR: m_setcr = val; break;
+    case REG_SETCW: m_setcw = val; break;
+    default:
+      return false;
+    }
+
+    return true;
+  }
+
+  // cnt[2] + count + data of 32-bit registers 2 words apart,
+  // returns false if any of them is unknown, the ones before are written
+  bool writeMulti(regaddr_t reg, const uint8_t cnt[], const uint8_t data[]) {
+    size_t n = (size_t)cnt[0] << 8 | cnt[1];
+
+    if ((n == 0) || (n % 2) || (data[0] != 2 * n))
+      return false;
+
+    for (size_t i = 0; i < n / 2; i++) {
+      const uint8_t *v = data + 1 + 4 * i;
+
+      if (!write((regaddr_t)(reg + 2 * i),
+                 (int32_t)((uint32_t)v[0] << 24 | (uint32_t)v[1] << 16 |
+                           (uint32_t)v[2] << 8 | v[3])))
+        return false;
+    }
+
+    return true;
+  }
+
+  // status block as captured from the device, see io.ref
+  virtual void status(uint8_t buf[]) {
+    static const uint8_t tail[stat_len - 8] = {
+      0x00, 0x01, 0xF4, 0x07, 0xD0, 0x07, 0xD0, 0x00, 0x00, 0x00 };
+    double voltage, current;
+    uint32_t mv, ma;
+
+    measure(voltage, current);
+    mv = (uint32_t)lround(voltage * 1000.0) & 0xFFFFFF;
+    ma = (uint32_t)lround(current * 1000.0) & 0xFFFFFF;
+
+    buf[0] = (uint8_t)((m_out ? 0x01 : 0x00) | (m_mode << 1));
+    buf[1] = 0;
+    buf[2] = (uint8_t)(mv >> 16); buf[3] = (uint8_t)(mv >> 8); buf[4] = (uint8_t)mv;
+    buf[5] = (uint8_t)(ma >> 16); buf[6] = (uint8_t)(ma >> 8); buf[7] = (uint8_t)ma;
+    memcpy(buf + 8, tail, sizeof(tail));
+  }
+
+  devaddr_t m_addr;
+  bool m_out;
+  KP184::mode_t m_mode;
+  int32_t m_setcv;
+  int32_t m_setcc;
+  int32_t m_setcr;
+  int32_t m_setcw;
+  double m_srcvolt;
+  double m_srcres;
+  bool m_multi;
+  BatteryModel m_batt;
+  bool m_hasbatt;
+  double m_speed;
+  double m_tbatt;    // battery time it's run up to
+};
+
+#endif /* _KP184_EMU_H */
@@ -8,11 +8,32 @@
 #include <unistd.h>  // usleep
 
 #include "mbrtu.h"
+#include "sample.h"
+
+// read request frames of a register for every device address, built at compile time
+class KP184Frames {
+public:
+  constexpr KP184Frames(uint8_t code, uint16_t reg) : f() {
+    for (int addr = 0; addr < 256; addr++) {
+      uint16_t crc = 0;
+
+      f[addr][0] = (uint8_t)addr;
+      f[addr][1] = code;
+      f[addr][2] = (uint8_t)(reg >> 8); f[addr][3] = (uint8_t)(reg & 0xFF);
+      f[addr][4] = 0; f[addr][5] = 0;
+      crc = CRC16::table(f[addr], 6, CRC16::init);
+      f[addr][6] = (uint8_t)(crc >> 8); f[addr][7] = (uint8_t)(crc & 0xFF);
+    }
+  }
+
+  uint8_t f[256][8];
+};
 
 class KP184: public mbRTU<24, 1, 1, 250> {
 public:
-  KP184() {
+  KP184() : m_statvalid(false), m_statttl(0), m_shadowon(true), m_funcs(0) {
     setAddress(def_devaddr);
+    invalidate();
   }
 
   typedef enum {
@@ -46,6 +67,16 @@ public:
     return modeunit[mode];
   }
 
+  // function codes beyond read holding (0x03) and the KP184 flavour of
+  // write single register (0x06), which every firmware takes
+  typedef enum {
+    FUNC_READAI = 0x01, // read input registers (0x04)
+    FUNC_WRITEAO = 0x02, // write multiple registers (0x10)
+    FUNC_RWAO = 0x04     // read/write multiple registers (0x17)
+  } func_t;
+
+  // getters read the status from the device unless fromcache is set or the
+  // cached one is within the window set by setStatusTTL()
   int getStatus(bool &out, mode_t &mode, double &voltage, double &current) {
     int rc;
 
@@ -61,7 +92,7 @@ public:
     if (!fromcache) {
       int rc;
 
-      if ((rc = readStatus()) < 0)
+      if ((rc = refreshStatus(m_statttl)) < 0)
         return rc;
     }
 
@@ -73,7 +104,7 @@ public:
     if (!fromcache) {
       int rc;
 
-      if ((rc = readStatus()) < 0)
+      if ((rc = refreshStatus(m_statttl)) < 0)
         return rc;
     }
 
@@ -85,7 +116,7 @@ public:
     if (!fromcache) {
       int rc;
 
-      if ((rc = readStatus()) < 0)
+      if ((rc = refreshStatus(m_statttl)) < 0)
         return rc;
     }
 
@@ -98,7 +129,7 @@ public:
     if (!fromcache) {
       int rc;
 
-      if ((rc = readStatus()) < 0)
+      if ((rc = refreshStatus(m_statttl)) < 0)
         return rc;
     }
 
@@ -121,84 +152,312 @@ public:
     return 0;
   }
 
-  int setOutput(bool on) {
-    int32_t val = 0;
+  // status as a sample, dt is from since to the time the status was
+  // recv'd at, which is stored back in since for the next one
+  int getSample(Sample &s, struct timespec &since, bool fromcache = false) {
+    if (!fromcache) {
+      int rc;
 
-    if (on)
-      val = 1;
+      if ((rc = refreshStatus(m_statttl)) < 0)
+        return rc;
+    }
+    if (!m_statvalid)
+      return -ENODATA;
 
-    return presetSingleRegister(REG_ONOFF, val);
+    s.dt = Sample::delta(since, m_stattime);
+    s.mv = (int32_t)statcache[2] << 16 | (int32_t)statcache[3] << 8 | statcache[4];
+    s.ma = (int32_t)statcache[5] << 16 | (int32_t)statcache[6] << 8 | statcache[7];
+    s.flags = statOutput(statcache[0]) ? Sample::FLAG_OUT : 0;
+    s.mode = (uint8_t)statMode(statcache[0]);
+    s.reserved = 0;
+    since = m_stattime;
+
+    return 0;
   }
 
-  int setMode(mode_t mode) {
-    int32_t val = mode;
+  // status no older than maxage ms is kept, older one is read again, 0 always reads,
+  // so consumers polling at different rates can share the reads
+  int refreshStatus(unsigned int maxage) {
+    struct timespec now;
+    int64_t age;
+    ssize_t rc;
+
+    if (m_statvalid && (maxage > 0)) {
+      getClock().now(now);
+      age = (int64_t)(now.tv_sec - m_stattime.tv_sec) * 1000 +
+            (now.tv_nsec - m_stattime.tv_nsec) / 1000000;
+      if ((age >= 0) && (age <= (int64_t)maxage))
+        return 0;
+    }
 
-    if (val > MODE_CP)
-      return -EINVAL;
+    if ((rc = readStatus()) < 0)
+      return (int)rc;
+
+    return 0;
+  }
 
-    return presetSingleRegister(REG_MODE, val);
+  // freshness window of the getters, ms, 0 reads every time
+  void setStatusTTL(unsigned int ms) { m_statttl = ms; }
+
+  unsigned int getStatusTTL() { return m_statttl; }
+
+  // device clock time the cached status was recv'd at, -ENODATA if there's none
+  int getStatusTime(struct timespec &ts) {
+    if (!m_statvalid)
+      return -ENODATA;
+
+    ts = m_stattime;
+    return 0;
+  }
+
+  int setOutput(bool on) {
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_ONOFF, on ? 1 : 0))
+      return 0;
+    return wait(setOutputAsync(on, syncDone, &rc), rc);
+  }
+
+  int setMode(mode_t mode) {
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_MODE, mode))
+      return 0;
+    return wait(setModeAsync(mode, syncDone, &rc), rc);
   }
 
   int setVoltage(double voltage) {
-    int32_t val;
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_SETCV, (int32_t)(voltage * 1000.0)))
+      return 0;
+    return wait(setVoltageAsync(voltage, syncDone, &rc), rc);
+  }
+
+  int setCurrent(double current) {
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_SETCC, (int32_t)(current * 1000.0)))
+      return 0;
+    return wait(setCurrentAsync(current, syncDone, &rc), rc);
+  }
+
+  int setResistance(double resistance) {
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_SETCR, (int32_t)(resistance * 10.0)))
+      return 0;
+    return wait(setResistanceAsync(resistance, syncDone, &rc), rc);
+  }
+
+  int setPower(double power) {
+    int rc = -EINPROGRESS;
+    if (shadowed(REG_SETCW, (int32_t)(power * 100.0)))
+      return 0;
+    return wait(setPowerAsync(power, syncDone, &rc), rc);
+  }
+
+  int setModeValue(mode_t mode, double value) {
+    switch(mode) {
+    case MODE_CV: return setVoltage(value);
+    case MODE_CC: return setCurrent(value);
+    case MODE_CR: return setResistance(value);
+    case MODE_CP: return setPower(value);
+    default: break;
+    }
+
+    return -EINVAL;
+  }
+
+  // switches the output off and sets the mode and its value. With multiple
+  // register writes output, mode and voltage, which are next to each other,
+  // go in one frame and the other values in a frame of their own, else
+  // they're written one by one with a pause between the frames
+  int configure(mode_t mode, double value) {
+    int32_t vals[3] = { 0, mode, 0 };
+    regaddr_t reg;
+    int rc;
+
+    if ((rc = setpoint(mode, value, reg, vals[2])) < 0)
+      return rc;
+
+    if (m_funcs & FUNC_WRITEAO) {
+      if (!shadowed(REG_ONOFF, 0) || !shadowed(REG_MODE, mode)) {
+        if (reg == REG_SETCV)
+          return presetRegisters(REG_ONOFF, 3, vals);
+        if ((rc = presetRegisters(REG_ONOFF, 2, vals)) != 0)
+          return rc;
+        getClock().usleep(write_gap);
+      }
+      return setModeValue(mode, value);
+    }
+
+    if ((rc = setOutput(false)) != 0)
+      return rc;
+    getClock().usleep(write_gap);
+    if ((rc = setMode(mode)) != 0)
+      return rc;
+    getClock().usleep(write_gap);
+    return setModeValue(mode, value);
+  }
+
+  // tries the function codes of func_t with requests which change nothing
+  // and returns the mask of the ones the device answers, configure() uses
+  // them from now on. Firmware which keeps silent costs a timeout for each
+  // returns -errno if the device doesn't answer the status read
+  int probe() {
+    static const retry_t none = { 0, 0, 0, 0 };
+    retry_t retry = getRetry();
+    uint8_t buf[sizeof(statcache)], val[4] = { 0, 0, 0, 0 };
+    int32_t mode;
+    ssize_t rc;
+    int funcs = 0;
+
+    if ((rc = readStatus()) < 0)
+      return (int)rc;
+    mode = statMode(statcache[0]);
+    val[3] = (uint8_t)mode;
+
+    setRetry(none);
+    // the replies may have the byte count as off as the status one has
+    rc = readInputRegisters(REG_STAT, sizeof(statcache) / 2, buf, sizeof(buf));
+    if ((rc >= 0) || (rc == -ENODATA))
+      funcs |= FUNC_READAI;
+    if (presetRegisters(REG_MODE, 1, &mode) == 0)
+      funcs |= FUNC_WRITEAO;
+    rc = readWriteMultipleRegisters(REG_STAT, sizeof(statcache) / 2, REG_MODE, 2, val,
+                                    buf, sizeof(buf));
+    if ((rc >= 0) || (rc == -ENODATA))
+      funcs |= FUNC_RWAO;
+    setRetry(retry);
+
+    invalidate(); // of the failed ones, who knows
+    m_funcs = (unsigned int)funcs;
+
+    return funcs;
+  }
+
+  // func_t mask configure() uses, without probing
+  void setFunctions(unsigned int funcs) { m_funcs = funcs; }
+
+  unsigned int getFunctions() { return m_funcs; }
+
+  // the blocking setters skip writes of the value a register is known to
+  // have: the one last written, or read back from the status block. Failed
+  // writes and other devices forget it, after reopening the link output
+  // and mode are known from the next status and the setpoints are kept if
+  // the output is found on, as a power cycle would have switched it off
+  void setShadow(bool on) {
+    m_shadowon = on;
+    invalidate();
+  }
+
+  bool getShadow() { return m_shadowon; }
+
+  int open(linktype_t type, const char link[], const char config[]) {
+    invalidate();
+    return mbRTU::open(type, link, config);
+  }
+
+  int attach(Link &link) {
+    invalidate();
+    return mbRTU::attach(link);
+  }
+
+  int reOpen() {
+    shadow_t shadow[SH_MAX + 1];
+    int rc;
+
+    memcpy(shadow, m_shadow, sizeof(shadow));
+    rc = mbRTU::reOpen(); // forgets by opening
+    for (int i = 0; i <= SH_MAX; i++) {
+      m_shadow[i] = shadow[i];
+      if (m_shadow[i].state == SH_VALID)
+        m_shadow[i].state = (i > SH_MODE) ? SH_STALE : SH_INVALID;
+    }
+
+    return rc;
+  }
+
+  int setAddress(devaddr_t devaddr) {
+    if (devaddr != getAddress())
+      invalidate();
+    return mbRTU::setAddress(devaddr);
+  }
+
+  // asynchronous operations queue the transaction and return at once:
+  // 0 if queued or -errno. done is called with the result once the queue
+  // is run by runIO() (as the synchronous methods above do) or by Reactor
+  typedef void (*done_t)(KP184 &dev, int rc, void *ctx);
+
+  // rc is status length, status is then available from the cache
+  int getStatusAsync(done_t done, void *ctx) {
+    StatusXfer *x = new StatusXfer(*this, done, ctx);
 
+    x->slen = statusRequest(x->sbuf, x->expect, x->framed);
+
+    return submit(x);
+  }
+
+  int setOutputAsync(bool on, done_t done, void *ctx) {
+    return presetAsync(REG_ONOFF, on ? 1 : 0, done, ctx);
+  }
+
+  int setModeAsync(mode_t mode, done_t done, void *ctx) {
+    if (mode > MODE_CP)
+      return -EINVAL;
+
+    return presetAsync(REG_MODE, mode, done, ctx);
+  }
+
+  int setVoltageAsync(double voltage, done_t done, void *ctx) {
     if ((voltage < modeValMin(MODE_CV)) ||
         (voltage > modeValMax(MODE_CV)))
       return -EINVAL;
 
-    val = (int32_t)(voltage * 1000.0);
-
-    return presetSingleRegister(REG_SETCV, val);
+    return presetAsync(REG_SETCV, (int32_t)(voltage * 1000.0), done, ctx);
   }
 
-  int setCurrent(double current) {
-    int32_t val;
-
+  int setCurrentAsync(double current, done_t done, void *ctx) {
     if ((current < modeValMin(MODE_CC)) ||
         (current > modeValMax(MODE_CC)))
       return -EINVAL;
 
-    val = (int32_t)(current * 1000.0);
-
-    return presetSingleRegister(REG_SETCC, val);
+    return presetAsync(REG_SETCC, (int32_t)(current * 1000.0), done, ctx);
   }
 
-  int setResistance(double resistance) {
-    int32_t val;
-
+  int setResistanceAsync(double resistance, done_t done, void *ctx) {
     if ((resistance < modeValMin(MODE_CR)) ||
         (resistance > modeValMax(MODE_CR)))
       return -EINVAL;
 
-    val = (int32_t)(resistance * 10.0);
-
-    return presetSingleRegister(REG_SETCR, val);
+    return presetAsync(REG_SETCR, (int32_t)(resistance * 10.0), done, ctx);
   }
 
-  int setPower(double power) {
-    int32_t val;
-
+  int setPowerAsync(double power, done_t done, void *ctx) {
     if ((power < modeValMin(MODE_CP)) ||
         (power > modeValMax(MODE_CP)))
       return -EINVAL;
 
-    val = (int32_t)(power * 100.0);
-
-    return presetSingleRegister(REG_SETCW, val);
+    return presetAsync(REG_SETCW, (int32_t)(power * 100.0), done, ctx);
   }
 
-  int setModeValue(mode_t mode, double value) {
+  int setModeValueAsync(mode_t mode, double value, done_t done, void *ctx) {
     switch(mode) {
-    case MODE_CV: return setVoltage(value);
-    case MODE_CC: return setCurrent(value);
-    case MODE_CR: return setResistance(value);
-    case MODE_CP: return setPower(value);
+    case MODE_CV: return setVoltageAsync(value, done, ctx);
+    case MODE_CC: return setCurrentAsync(value, done, ctx);
+    case MODE_CR: return setResistanceAsync(value, done, ctx);
+    case MODE_CP: return setPowerAsync(value, done, ctx);
     default: break;
     }
 
     return -EINVAL;
   }
 
+  size_t replyLength(const uint8_t buf[], size_t len, size_t expect) {
+    // write reply echoes non-conforming 4-byte value header
+    // addr + code + reg[2] + 1[2] + 4
+    if ((len >= 2) && (buf[1] == OP_WRITE1AO))
+      return 7 + 2;
+
+    return mbRTU::replyLength(buf, len, expect);
+  }
+
 private:
   typedef enum {
     REG_ONOFF = 0x010E,
@@ -212,38 +471,207 @@ private:
     REG_STAT  = 0x0300
   } regaddr_t;
 
+  // the device needs a quiet line between write frames
+  static const useconds_t write_gap = 10000;
+
   static bool statOutput(unsigned char byte) { return (byte & 0x01) != 0; };
   static mode_t statMode(unsigned char byte) { return (mode_t)((byte >> 1) & 0x03); };
 
-  ssize_t readStatus() {
-    ssize_t ret;
-    size_t slen;
-    uint8_t sbuf[8], rbuf[max_msglen];
+  typedef enum {
+    SH_ONOFF = 0,
+    SH_MODE,
+    SH_SETCV,
+    SH_SETCC,
+    SH_SETCR,
+    SH_SETCW,
+    SH_MAX = SH_SETCW
+  } shadowidx_t;
+
+  typedef enum {
+    SH_INVALID = 0,
+    SH_VALID,
+    SH_STALE   // setpoint from before reopening, see setShadow()
+  } shadowstate_t;
+
+  typedef struct {
+    int32_t val;
+    shadowstate_t state;
+  } shadow_t;
+
+  static int shadowIndex(regaddr_t reg) {
+    switch (reg) {
+    case REG_ONOFF: return SH_ONOFF;
+    case REG_MODE:  return SH_MODE;
+    case REG_SETCV: return SH_SETCV;
+    case REG_SETCC: return SH_SETCC;
+    case REG_SETCR: return SH_SETCR;
+    case REG_SETCW: return SH_SETCW;
+    default: break;
+    }
+
+    return -1;
+  }
+
+  void invalidate() {
+    for (int i = 0; i <= SH_MAX; i++)
+      m_shadow[i].state = SH_INVALID;
+    m_statvalid = false;
+  }
 
-    slen = IOheader(sbuf, OP_READAO, REG_STAT, 0);
-    ret = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf));
-    if (ret < 0)
-      return ret;
-    if (ret < 11)
+  // true if the register is known to have the value already and nothing
+  // queued could change it
+  bool shadowed(regaddr_t reg, int32_t val) {
+    int i = shadowIndex(reg);
+
+    return m_shadowon && (i >= 0) && (queued() == 0) &&
+           (m_shadow[i].state == SH_VALID) && (m_shadow[i].val == val);
+  }
+
+  // write of the register completed with rc
+  void written(regaddr_t reg, int32_t val, int rc) {
+    int i = shadowIndex(reg);
+
+    m_statvalid = false; // output, mode or the load may have changed
+    if (i < 0)
+      return;
+    m_shadow[i].val = val;
+    m_shadow[i].state = (rc == 0) ? SH_VALID : SH_INVALID;
+  }
+
+  // status block recv'd, output and mode are what it says
+  void statusRead() {
+    bool out = statOutput(statcache[0]);
+
+    for (int i = SH_SETCV; i <= SH_MAX; i++)
+      if (m_shadow[i].state == SH_STALE)
+        m_shadow[i].state = out ? SH_VALID : SH_INVALID;
+    m_shadow[SH_ONOFF].val = out ? 1 : 0;
+    m_shadow[SH_ONOFF].state = SH_VALID;
+    m_shadow[SH_MODE].val = statMode(statcache[0]);
+    m_shadow[SH_MODE].state = SH_VALID;
+  }
+
+  // completion of synchronous operations, see mbRTU::wait()
+  static void syncDone(KP184 &dev, int rc, void *ctx) { *(int *)ctx = rc; }
+
+  class StatusXfer : public Xfer {
+  public:
+    StatusXfer(KP184 &dev, done_t done, void *ctx) : m_dev(dev), m_done(done), m_ctx(ctx) {}
+
+    int reply(uint8_t rbuf[], size_t len) { return (int)m_dev.statusReply(rbuf, len); }
+
+    void complete(int rc) { if (m_done) m_done(m_dev, rc, m_ctx); }
+
+  private:
+    KP184 &m_dev;
+    done_t m_done;
+    void *m_ctx;
+  };
+
+  class WriteXfer : public Xfer {
+  public:
+    WriteXfer(KP184 &dev, done_t done, void *ctx) : m_dev(dev), m_done(done), m_ctx(ctx) {}
+
+    int reply(uint8_t rbuf[], size_t len) { return m_dev.writeReply(sbuf, rbuf, len); }
+
+    void complete(int rc) {
+      // addr + code + reg[2] + 1[2] + 4 + val[4]
+      m_dev.written((regaddr_t)((uint16_t)sbuf[2] << 8 | sbuf[3]),
+                    (int32_t)((uint32_t)sbuf[7] << 24 | (uint32_t)sbuf[8] << 16 |
+                              (uint32_t)sbuf[9] << 8 | sbuf[10]), rc);
+      if (m_done) m_done(m_dev, rc, m_ctx);
+    }
+
+  private:
+    KP184 &m_dev;
+    done_t m_done;
+    void *m_ctx;
+  };
+
+  static constexpr KP184Frames statframes = KP184Frames(OP_READAO, REG_STAT);
+
+  // copies precomputed status request frame, framed is set
+  // expect is set to reply payload length, returns payload length
+  size_t statusRequest(uint8_t sbuf[], size_t &expect, bool &framed) {
+    memcpy(sbuf, statframes.f[getAddress()], sizeof(statframes.f[0]));
+    expect = 3 + sizeof(statcache);
+    framed = true;
+    return sizeof(statframes.f[0]) - 2;
+  }
+
+  // len is recv'd payload length (excl. CRC)
+  // fills status cache, returns status length
+  ssize_t statusReply(const uint8_t rbuf[], ssize_t len) {
+    if (len < 11)
       return -ENODATA;
     if (rbuf[0] != getAddress())
       return -EFAULT;
     if (rbuf[1] != OP_READAO)
       return -ENOMSG;
     // rely on recv'd len to support buggy KP184 protocol
-    ret -= 3;
-    if ((size_t)ret > sizeof(statcache))
+    len -= 3;
+    if ((size_t)len > sizeof(statcache))
       return -ENOBUFS;
-    memcpy(statcache, rbuf + 3, ret);
+    memcpy(statcache, rbuf + 3, len);
+    if (len > 0) {
+      getClock().now(m_stattime);
+      m_statvalid = true;
+      statusRead();
+    }
 
-    return ret;
+    return len;
+  }
+
+  ssize_t readStatus() {
+    int rc = -EINPROGRESS;
+    return wait(getStatusAsync(syncDone, &rc), rc);
+  }
+
+  // register and its raw value of the mode value
+  static int setpoint(mode_t mode, double value, regaddr_t &reg, int32_t &val) {
+    static const regaddr_t regs[MODE_CP + 1] = { REG_SETCV, REG_SETCC, REG_SETCR, REG_SETCW };
+    static const double scale[MODE_CP + 1] = { 1000.0, 1000.0, 10.0, 100.0 };
+
+    if ((mode > MODE_CP) || (value < modeValMin(mode)) || (value > modeValMax(mode)))
+      return -EINVAL;
+
+    reg = regs[mode];
+    val = (int32_t)(value * scale[mode]);
+    return 0;
+  }
+
+  // n 32-bit registers from firstreg in one write multiple request,
+  // each takes 2 of its words, returns as presetMultipleRegisters()
+  int presetRegisters(regaddr_t firstreg, size_t n, const int32_t vals[]) {
+    uint8_t buf[4 * 3];
+    int rc;
+
+    if (n > sizeof(buf) / 4)
+      return -EMSGSIZE;
+
+    for (size_t i = 0; i < n; i++) {
+      buf[4 * i] = (uint8_t)((vals[i] >> 24) & 0xFF);
+      buf[4 * i + 1] = (uint8_t)((vals[i] >> 16) & 0xFF);
+      buf[4 * i + 2] = (uint8_t)((vals[i] >> 8) & 0xFF);
+      buf[4 * i + 3] = (uint8_t)(vals[i] & 0xFF);
+    }
+    rc = presetMultipleRegisters(firstreg, (uint16_t)(2 * n), buf);
+    for (size_t i = 0; i < n; i++)
+      written((regaddr_t)(firstreg + 2 * i), vals[i], rc);
+
+    return rc;
   }
 
   using mbRTU::presetSingleRegister;
   int presetSingleRegister(regaddr_t reg, int32_t val) {
-    int rc;
+    int rc = -EINPROGRESS;
+    return wait(presetAsync(reg, val, syncDone, &rc), rc);
+  }
+
+  int presetAsync(regaddr_t reg, int32_t val, done_t done, void *ctx) {
+    WriteXfer *x = new WriteXfer(*this, done, ctx);
+    uint8_t *sbuf = x->sbuf;
     size_t slen;
-    uint8_t sbuf[16], rbuf[16];
 
     slen = IOheader(sbuf, OP_WRITE1AO, reg, 1);
     // KP184 is not conforming at all
@@ -252,10 +680,15 @@ private:
     sbuf[slen++] = (uint8_t)((val >> 16) & 0xFF);
     sbuf[slen++] = (uint8_t)((val >> 8) & 0xFF);
     sbuf[slen++] = (uint8_t)(val & 0xFF);
-    rc = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf));
-    if (rc < 0)
-      return rc;
-    if (rc != 7)
+    x->slen = slen;
+    x->expect = 7;
+
+    return submit(x);
+  }
+
+  // len is recv'd payload length (excl. CRC)
+  int writeReply(const uint8_t sbuf[], const uint8_t rbuf[], size_t len) {
+    if (len != 7)
       return -ENODATA;
     if (rbuf[0] != getAddress())
       return -EFAULT;
@@ -268,6 +701,12 @@ private:
   }
 
   unsigned char statcache[18];
+  struct timespec m_stattime; // device clock
+  bool m_statvalid;
+  unsigned int m_statttl;     // ms
+  shadow_t m_shadow[SH_MAX + 1];
+  bool m_shadowon;
+  unsigned int m_funcs;       // func_t
 };
 
-#endif /* _KP184_H */
+#endif /* _KP184_H */
@@ -0,0 +1,194 @@
+#ifndef _ADAPTIVE_H
+#define _ADAPTIVE_H
+
+#include <cstdint>
+#include <cmath>
+
+#include "sample.h"
+
+// sample interval following the discharge: long while the voltage stays
+// flat, short as it falls faster or comes close to a threshold, so the
+// plateau takes few samples and the knee many
+//
+// the interval is such that the voltage falls by no more than the step
+// and by no more than a fraction of what's left to the threshold until the
+// next sample, the fall rate is an average over the last few samples or
+// the last one's if it falls faster, a fall setting in shortens it at once
+class AdaptiveInterval {
+public:
+  static const uint32_t defstep = 10;   // mV
+
+  AdaptiveInterval() : m_min(1000000), m_max(1000000), m_step(defstep) { reset(); }
+
+  // us
+  void setBounds(uint32_t min, uint32_t max) {
+    m_min = min;
+    m_max = (max < min) ? min : max;
+    m_interval = m_min;
+  }
+
+  uint32_t getMin() const { return m_min; }
+
+  uint32_t getMax() const { return m_max; }
+
+  // mV the voltage may fall by between samples on the plateau
+  void setStep(uint32_t mv) { m_step = mv ? mv : 1; }
+
+  // forgets the fall rate, the load changed, back to the shortest interval
+  void reset() {
+    m_rate = 0.0;
+    m_last = 0.0;
+    m_started = false;
+    m_interval = m_min;
+  }
+
+  // mV/s the voltage falls by, 0 if it doesn't
+  double rate() const {
+    double r = (m_last > m_rate) ? m_last : m_rate;
+
+    return (r > 0.0) ? r : 0.0;
+  }
+
+  uint32_t interval() const { return m_interval; }
+
+  // takes the sample in and returns the interval to the next one, target
+  // is the threshold the voltage falls towards, mV, the interval grows
+  // by no more than twice a sample so a change in the fall is caught soon
+  uint32_t next(const Sample &s, int32_t target) {
+    int32_t margin = s.mv - target;
+    double want;
+
+    if (m_started && (s.dt > 0)) {
+      m_last = (double)(m_prev - s.mv) * 1e6 / s.dt;
+      m_rate += (m_last - m_rate) * weight;
+    }
+    m_prev = s.mv;
+    m_started = true;
+
+    if (margin <= (int32_t)m_step)
+      want = 0.0;
+    else if (rate() <= 0.0)
+      want = m_max;
+    else {
+      double dv = (double)margin / margin_parts;
+
+      if (dv > m_step)
+        dv = m_step;
+      want = dv / rate() * 1e6;
+    }
+
+    if (want > 2.0 * m_interval)
+      want = 2.0 * m_interval;
+    m_interval = (want < m_min) ? m_min : (want > m_max) ? m_max : (uint32_t)want;
+
+    return m_interval;
+  }
+
+private:
+  static constexpr double weight = 0.25;  // of the last sample in the rate
+  static const int margin_parts = 8;      // samples at least to the threshold
+
+  uint32_t m_min;
+  uint32_t m_max;
+  uint32_t m_step;
+  uint32_t m_interval;
+  int32_t m_prev;
+  double m_rate;         // mV/s, averaged
+  double m_last;         // mV/s, over the last interval
+  bool m_started;
+};
+
+// when the voltage is to cross a threshold, from a least squares fit of the
+// last few samples, a parabola so the knee bending down is followed, a line
+// if the parabola doesn't reach the threshold or there are too few samples
+class CrossingPredictor {
+public:
+  static const int points = 6;
+
+  CrossingPredictor() { reset(); }
+
+  // forgets the samples, the load changed
+  void reset() { m_head = m_count = 0; }
+
+  // us is the time of the sample since the start
+  void add(uint64_t us, int32_t mv) {
+    m_us[m_head] = us;
+    m_mv[m_head] = mv;
+    m_head = (m_head + 1) % points;
+    if (m_count < points)
+      m_count++;
+  }
+
+  // us after the last sample the voltage reaches target at,
+  // false if it doesn't fall towards it
+  bool predict(int32_t target, uint64_t &us) const {
+    double s[5] = {}, sv[3] = {}, x;
+    uint64_t last;
+    int n = m_count;
+
+    if (n < 2)
+      return false;
+    last = m_us[(m_head + points - 1) % points];
+
+    // x in s before the last sample, v in mV over the target
+    for (int i = 0; i < n; i++) {
+      int k = (m_head + points - 1 - i) % points;
+      double xi = -(double)(last - m_us[k]) / 1e6, vi = (double)(m_mv[k] - target), p = 1.0;
+
+      for (int j = 0; j < 5; j++, p *= xi) {
+        s[j] += p;
+        if (j < 3)
+          sv[j] += p * vi;
+      }
+    }
+
+    if ((n >= 4) && parabola(s, sv, x)) {
+      us = (uint64_t)(x * 1e6);
+      return true;
+    }
+
+    // v = a + b x
+    double d = s[0] * s[2] - s[1] * s[1], a, b;
+
+    if (d == 0.0)
+      return false;
+    a = (sv[0] * s[2] - s[1] * sv[1]) / d;
+    b = (s[0] * sv[1] - s[1] * sv[0]) / d;
+    if ((b >= 0.0) || (a <= 0.0))
+      return false;
+    us = (uint64_t)(-a / b * 1e6);
+
+    return true;
+  }
+
+private:
+  // v = a + b x + c x^2 by Cramer's rule, x of the first root ahead
+  static bool parabola(const double s[5], const double sv[3], double &x) {
+    double d = det(s[0], s[1], s[2], s[1], s[2], s[3], s[2], s[3], s[4]), a, b, c, q;
+
+    if (d == 0.0)
+      return false;
+    a = det(sv[0], s[1], s[2], sv[1], s[2], s[3], sv[2], s[3], s[4]) / d;
+    b = det(s[0], sv[0], s[2], s[1], sv[1], s[3], s[2], sv[2], s[4]) / d;
+    c = det(s[0], s[1], sv[0], s[1], s[2], sv[1], s[2], s[3], sv[2]) / d;
+    if ((a <= 0.0) || (c == 0.0) || ((q = b * b - 4.0 * a * c) < 0.0))
+      return false;
+    // a > 0, bending down one root is ahead, bending up both or none are
+    // and this one is the nearer
+    x = (-b - sqrt(q)) / (2.0 * c);
+
+    return x > 0.0;
+  }
+
+  static double det(double a, double b, double c, double d, double e, double f,
+                    double g, double h, double i) {
+    return a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+  }
+
+  uint64_t m_us[points];
+  int32_t m_mv[points];
+  int m_head;
+  int m_count;
+};
+
+#endif /* _ADAPTIVE_H */
@@ -0,0 +1,431 @@
+#ifndef _BATTLOG_H
+#define _BATTLOG_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sample.h"
+
+// binary discharge log, samples in columns of fixed size blocks, so a
+// reader mapping the file finds any block by its number and any time by
+// the index without parsing what's before
+//
+// little endian:
+//   header: magic[8] "KP184LOG", version u16, reserved u16, metadata length u32,
+//           start time u64 (CLOCK_REALTIME, us), block samples u32, reserved u32,
+//           metadata "key=value\n" text padded to 8 bytes
+//   blocks: count u32, reserved u32, first no u64, first time u64 (us since start),
+//           dt u32[n] (us since the previous sample or the start), mV s32[n], mA s32[n],
+//           flags u8[n], mode u8[n], a partial block takes the full size
+//   index:  first time u64, first no u64 per block
+//   footer: blocks u32, reserved u32, index offset u64, magic[8] "KP184END"
+// the last block is rewritten in place as it fills, the index and the footer
+// are written when closed, a log without them is read by its block headers
+class BattLog {
+public:
+  static const size_t header_len = 32;
+  static const size_t blkhdr_len = 24;
+  static const size_t footer_len = 24;
+  static const uint32_t block_samples = 1024;
+  static const size_t block_len = blkhdr_len + 14 * block_samples;
+  static const uint16_t version = 1;
+
+  BattLog() : m_fd(-1), m_count(0), m_dirty(0) {
+    m_block.resize(block_len);
+  }
+
+  ~BattLog() {
+    close();
+  }
+
+  // creates the log anew, meta is the "key=value\n" lines of the run
+  int open(const char path[], const char meta[]) {
+    std::vector<uint8_t> hdr;
+    size_t mlen = strlen(meta);
+    struct timespec ts;
+    int rc;
+
+    if (m_fd >= 0)
+      return -EALREADY;
+    if ((m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+      return -errno;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    m_base = header_len + ((mlen + 7) & ~(size_t)7);
+    hdr.resize(m_base, 0);
+    memcpy(hdr.data(), "KP184LOG", 8);
+    put16(&hdr[8], version);
+    put32(&hdr[12], (uint32_t)mlen);
+    put64(&hdr[16], (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    put32(&hdr[24], block_samples);
+    memcpy(&hdr[header_len], meta, mlen);
+    if ((rc = writeAt(hdr.data(), hdr.size(), 0)) < 0) {
+      ::close(m_fd);
+      m_fd = -1;
+      return rc;
+    }
+
+    m_index.clear();
+    m_count = 0;
+    m_dirty = 0;
+    m_us = 0;
+
+    return 0;
+  }
+
+  // writes the last block, the index and the footer and syncs,
+  // returns 0 or the first error
+  int close() {
+    std::vector<uint8_t> tail;
+    uint64_t off;
+    int rc = 0;
+
+    if (m_fd < 0)
+      return 0;
+
+    if (m_dirty)
+      rc = flush();
+    off = m_base + (uint64_t)m_index.size() * block_len;
+    tail.resize(16 * m_index.size() + footer_len);
+    for (size_t i = 0; i < m_index.size(); i++) {
+      put64(&tail[16 * i], m_index[i].us);
+      put64(&tail[16 * i + 8], m_index[i].no);
+    }
+    put32(&tail[16 * m_index.size()], (uint32_t)m_index.size());
+    put32(&tail[16 * m_index.size() + 4], 0);
+    put64(&tail[16 * m_index.size() + 8], off);
+    memcpy(&tail[16 * m_index.size() + 16], "KP184END", 8);
+    if (rc == 0)
+      rc = writeAt(tail.data(), tail.size(), off);
+    if ((rc == 0) && (fdatasync(m_fd) < 0))
+      rc = -errno;
+
+    ::close(m_fd);
+    m_fd = -1;
+
+    return rc;
+  }
+
+  bool isOpen() { return m_fd >= 0; }
+
+  // samples come numbered one after another, us is the time since the start,
+  // dt is logged as the step between the times given, not as the sample has it
+  // returns 0 or -errno if the block couldn't be written
+  int append(unsigned long no, uint64_t us, const Sample &s) {
+    uint8_t *b = m_block.data();
+    int rc = 0;
+
+    if (m_fd < 0)
+      return -EBADF;
+
+    if (m_count == 0) {
+      memset(b, 0, block_len);
+      put64(b + 8, no);
+      put64(b + 16, us);
+      m_index.push_back({ us, no });
+    }
+
+    put32(b + blkhdr_len + 4 * m_count, (us - m_us > UINT32_MAX) ? UINT32_MAX : (uint32_t)(us - m_us));
+    put32(b + blkhdr_len + 4 * (block_samples + m_count), (uint32_t)s.mv);
+    put32(b + blkhdr_len + 4 * (2 * block_samples + m_count), (uint32_t)s.ma);
+    b[blkhdr_len + 12 * block_samples + m_count] = s.flags;
+    b[blkhdr_len + 13 * block_samples + m_count] = s.mode;
+    put32(b, ++m_count);
+    m_us = us;
+
+    // partial block goes out now and then, so a crash loses little
+    if ((++m_dirty == flush_samples) || (m_count == block_samples))
+      rc = flush();
+    if (m_count == block_samples)
+      m_count = 0;
+
+    return rc;
+  }
+
+  static void put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+  static void put32(uint8_t *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+  static void put64(uint8_t *p, uint64_t v) { put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32)); }
+  static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+  static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+  static uint64_t get64(const uint8_t *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+
+private:
+  static const uint32_t flush_samples = 64;
+
+  typedef struct {
+    uint64_t us;
+    uint64_t no;
+  } index_t;
+
+  int writeAt(const uint8_t buf[], size_t len, uint64_t off) {
+    while (len > 0) {
+      ssize_t rc = pwrite(m_fd, buf, len, (off_t)off);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        return -errno;
+      }
+      buf += rc;
+      len -= (size_t)rc;
+      off += (uint64_t)rc;
+    }
+
+    return 0;
+  }
+
+  // the block being filled to its place
+  int flush() {
+    m_dirty = 0;
+    return writeAt(m_block.data(), block_len, m_base + (uint64_t)(m_index.size() - 1) * block_len);
+  }
+
+  int m_fd;
+  size_t m_base;                  // offset of the first block
+  std::vector<uint8_t> m_block;
+  uint32_t m_count;               // samples in the block being filled
+  uint32_t m_dirty;               // of them not written yet
+  uint64_t m_us;                  // time of the last sample
+  std::vector<index_t> m_index;
+};
+
+// random access reader of mapped logs
+class BattLogReader {
+public:
+  typedef struct {
+    unsigned long no;
+    uint64_t us;        // since the start of the run
+    Sample s;
+  } record_t;
+
+  BattLogReader() : m_map(NULL), m_size(0) {}
+
+  ~BattLogReader() {
+    close();
+  }
+
+  int open(const char path[]) {
+    struct stat st;
+    int fd, rc;
+
+    if (m_map)
+      return -EALREADY;
+    if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return -errno;
+    if (fstat(fd, &st) < 0) {
+      rc = -errno;
+      ::close(fd);
+      return rc;
+    }
+    if ((size_t)st.st_size < BattLog::header_len) {
+      ::close(fd);
+      return -EBADMSG;
+    }
+    m_size = (size_t)st.st_size;
+    m_map = (const uint8_t *)mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    rc = -errno;
+    ::close(fd);
+    if (m_map == MAP_FAILED) {
+      m_map = NULL;
+      m_size = 0;
+      return rc;
+    }
+
+    if ((rc = parse()) < 0) {
+      close();
+      return rc;
+    }
+    rewind();
+
+    return 0;
+  }
+
+  void close() {
+    if (m_map)
+      munmap((void *)m_map, m_size);
+    m_map = NULL;
+    m_size = 0;
+    m_index.clear();
+  }
+
+  // CLOCK_REALTIME the run was started at, us
+  uint64_t getStartTime() { return BattLog::get64(m_map + 16); }
+
+  // "key=value\n" lines of the run
+  std::string getMetadata() {
+    return std::string((const char *)m_map + BattLog::header_len, BattLog::get32(m_map + 12));
+  }
+
+  // value of the metadata key, empty if there's none
+  std::string getMeta(const char key[]) {
+    std::string meta = getMetadata(), k = std::string(key) + "=";
+    size_t pos = 0;
+
+    while (pos < meta.size()) {
+      size_t end = meta.find('\n', pos);
+
+      if (end == std::string::npos)
+        end = meta.size();
+      if (meta.compare(pos, k.size(), k) == 0)
+        return meta.substr(pos + k.size(), end - pos - k.size());
+      pos = end + 1;
+    }
+
+    return std::string();
+  }
+
+  // false if the footer is missing, the run didn't end well
+  bool complete() { return m_complete; }
+
+  size_t blocks() { return m_index.size(); }
+
+  uint64_t samples() {
+    if (m_index.empty())
+      return 0;
+    return (uint64_t)(m_index.size() - 1) * m_bsamples + count(m_index.size() - 1);
+  }
+
+  void rewind() {
+    m_block = 0;
+    m_pos = 0;
+    m_us = m_index.empty() ? 0 : m_index[0].us;
+  }
+
+  // to the first sample at or after us, by the index and within one block
+  void seek(uint64_t us) {
+    size_t lo = 0, hi = m_index.size();
+
+    // last block starting at or before us
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if (m_index[mid].us <= us)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+    m_block = lo;
+    m_pos = 0;
+    m_us = m_index.empty() ? 0 : m_index[lo].us;
+    while (m_block < m_index.size()) {
+      const uint8_t *b = block(m_block);
+
+      if (m_pos >= count(m_block)) {
+        if (++m_block < m_index.size())
+          m_us = m_index[m_block].us;
+        m_pos = 0;
+        continue;
+      }
+      if (m_pos > 0)
+        m_us += BattLog::get32(b + BattLog::blkhdr_len + 4 * m_pos);
+      if (m_us >= us)
+        break;
+      m_pos++;
+    }
+  }
+
+  // 1 if rec is filled, 0 at the end
+  int next(record_t &rec) {
+    const uint8_t *b;
+
+    while ((m_block < m_index.size()) && (m_pos >= count(m_block))) {
+      if (++m_block < m_index.size())
+        m_us = m_index[m_block].us;
+      m_pos = 0;
+    }
+    if (m_block >= m_index.size())
+      return 0;
+
+    b = block(m_block) + BattLog::blkhdr_len;
+    // m_us is the time of the sample at m_pos already
+    rec.no = (unsigned long)(m_index[m_block].no + m_pos);
+    rec.us = m_us;
+    rec.s.dt = BattLog::get32(b + 4 * m_pos);
+    rec.s.mv = (int32_t)BattLog::get32(b + 4 * (m_bsamples + m_pos));
+    rec.s.ma = (int32_t)BattLog::get32(b + 4 * (2 * m_bsamples + m_pos));
+    rec.s.flags = b[12 * m_bsamples + m_pos];
+    rec.s.mode = b[13 * m_bsamples + m_pos];
+    rec.s.reserved = 0;
+
+    if ((++m_pos < count(m_block)))
+      m_us += BattLog::get32(b + 4 * m_pos);
+
+    return 1;
+  }
+
+private:
+  typedef struct {
+    uint64_t us;
+    uint64_t no;
+  } index_t;
+
+  const uint8_t *block(size_t n) { return m_map + m_base + n * m_blen; }
+
+  uint32_t count(size_t n) {
+    uint32_t c = BattLog::get32(block(n));
+    return (c > m_bsamples) ? m_bsamples : c;
+  }
+
+  int parse() {
+    const uint8_t *f = m_map + m_size - BattLog::footer_len;
+    size_t n;
+
+    if (memcmp(m_map, "KP184LOG", 8) != 0)
+      return -EBADMSG;
+    if (BattLog::get16(m_map + 8) != BattLog::version)
+      return -EPROTONOSUPPORT;
+
+    m_base = BattLog::header_len + ((BattLog::get32(m_map + 12) + 7) & ~(size_t)7);
+    m_bsamples = BattLog::get32(m_map + 24);
+    m_blen = BattLog::blkhdr_len + 14 * (size_t)m_bsamples;
+    if ((m_bsamples == 0) || (m_base > m_size))
+      return -EBADMSG;
+
+    m_complete = (m_size >= m_base + BattLog::footer_len) && (memcmp(f + 16, "KP184END", 8) == 0);
+    if (m_complete) {
+      uint64_t off = BattLog::get64(f + 8);
+
+      n = BattLog::get32(f);
+      if ((off != m_base + n * m_blen) || (off + 16 * n + BattLog::footer_len != m_size))
+        return -EBADMSG;
+      m_index.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        m_index[i].us = BattLog::get64(m_map + off + 16 * i);
+        m_index[i].no = BattLog::get64(m_map + off + 16 * i + 8);
+      }
+      return 0;
+    }
+
+    // whole blocks there are, from their headers
+    n = (m_size - m_base) / m_blen;
+    m_index.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      m_index[i].us = BattLog::get64(block(i) + 16);
+      m_index[i].no = BattLog::get64(block(i) + 8);
+    }
+    while (!m_index.empty() && (count(m_index.size() - 1) == 0))
+      m_index.pop_back();
+
+    return 0;
+  }
+
+  const uint8_t *m_map;
+  size_t m_size;
+  size_t m_base;
+  uint32_t m_bsamples;
+  size_t m_blen;
+  bool m_complete;
+  std::vector<index_t> m_index;
+  size_t m_block;        // cursor
+  uint32_t m_pos;
+  uint64_t m_us;         // time of the sample at the cursor
+};
+
+#endif /* _BATTLOG_H */
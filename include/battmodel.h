@@ -0,0 +1,202 @@
+#ifndef _BATTMODEL_H
+#define _BATTMODEL_H
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <vector>
+
+// equivalent circuit battery: open circuit voltage source depending on
+// state of charge, series resistance r0 and one RC pair (r1, tau) for the
+// relaxation, capacity drawn with Peukert's law relative to current iref
+//
+// model file is text, one parameter per line, # starts a comment:
+//   capacity <Ah>
+//   peukert <exponent> <reference current, A>
+//   r0 <Ohm>
+//   r1 <Ohm>
+//   tau <s>
+//   ocv <state of charge 0..1> <V>   (two or more, any order)
+class BatteryModel {
+public:
+  typedef struct {
+    double soc;
+    double voltage;
+  } ocvpoint_t;
+
+  // 12 V 12 Ah lead acid battery, five years old, fitted to data/NP12-12-5yr.csv
+  BatteryModel() :
+    m_capacity(5.395),
+    m_peukert(1.15),
+    m_iref(3.0),
+    m_r0(0.1443),
+    m_r1(0.1010),
+    m_tau(6.12)
+  {
+    static const ocvpoint_t ocv[] = {
+      { 0.00, 11.404 }, { 0.05, 11.903 }, { 0.10, 12.354 }, { 0.20, 12.740 },
+      { 0.30, 12.894 }, { 0.40, 12.989 }, { 0.50, 13.064 }, { 0.60, 13.128 },
+      { 0.70, 13.183 }, { 0.80, 13.230 }, { 0.90, 13.269 }, { 1.00, 13.333 } };
+
+    m_ocv.assign(ocv, ocv + sizeof(ocv) / sizeof(ocv[0]));
+    reset();
+  }
+
+  // fully charged and rested
+  void reset(double soc = 1.0) {
+    m_soc = soc;
+    m_v1 = 0.0;
+  }
+
+  // draws current, A (negative charges) for dt, s
+  void step(double current, double dt) {
+    double k;
+
+    if (dt <= 0.0)
+      return;
+
+    if ((current > 0.0) && (m_iref > 0.0))
+      m_soc -= current * pow(current / m_iref, m_peukert - 1.0) * dt / (m_capacity * 3600.0);
+    else
+      m_soc -= current * dt / (m_capacity * 3600.0);
+    if (m_soc > 1.0)
+      m_soc = 1.0;
+    if (m_soc < -collapse)
+      m_soc = -collapse;
+
+    // exact for the current constant over dt
+    k = (m_tau > 0.0) ? exp(-dt / m_tau) : 0.0;
+    m_v1 = m_v1 * k + current * m_r1 * (1.0 - k);
+  }
+
+  // open circuit voltage at the state of charge, falls to zero
+  // as the battery is drawn past empty
+  double ocv(double soc) const {
+    size_t i;
+
+    if (m_ocv.empty())
+      return 0.0;
+    if (soc < m_ocv[0].soc) {
+      double v = m_ocv[0].voltage * (1.0 + (soc - m_ocv[0].soc) / collapse);
+      return (v > 0.0) ? v : 0.0;
+    }
+    for (i = 1; i < m_ocv.size(); i++)
+      if (soc <= m_ocv[i].soc)
+        break;
+    if (i == m_ocv.size())
+      return m_ocv.back().voltage;
+
+    return m_ocv[i - 1].voltage + (m_ocv[i].voltage - m_ocv[i - 1].voltage) *
+           (soc - m_ocv[i - 1].soc) / (m_ocv[i].soc - m_ocv[i - 1].soc);
+  }
+
+  // source voltage behind r0 right now
+  double emf() const {
+    double v = ocv(m_soc) - m_v1;
+    return (v > 0.0) ? v : 0.0;
+  }
+
+  double terminal(double current) const {
+    double v = emf() - current * m_r0;
+    return (v > 0.0) ? v : 0.0;
+  }
+
+  double resistance() const { return m_r0; }
+
+  double soc() const { return m_soc; }
+
+  double capacity() const { return m_capacity; }
+
+  void setCapacity(double ah) { m_capacity = ah; }
+
+  void setPeukert(double exponent, double iref) { m_peukert = exponent; m_iref = iref; }
+
+  void setResistance(double r0, double r1, double tau) { m_r0 = r0; m_r1 = r1; m_tau = tau; }
+
+  // replaces the curve, points are sorted by state of charge
+  int setOCV(const std::vector<ocvpoint_t> &points) {
+    if (points.size() < 2)
+      return -EINVAL;
+
+    m_ocv = points;
+    for (size_t i = 1; i < m_ocv.size(); i++) // few points, insertion sort
+      for (size_t j = i; (j > 0) && (m_ocv[j].soc < m_ocv[j - 1].soc); j--) {
+        ocvpoint_t p = m_ocv[j];
+        m_ocv[j] = m_ocv[j - 1];
+        m_ocv[j - 1] = p;
+      }
+
+    return 0;
+  }
+
+  int load(const char path[]) {
+    std::vector<ocvpoint_t> points;
+    char line[256];
+    FILE *f;
+    int rc = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+      return -errno;
+
+    while (fgets(line, sizeof(line), f)) {
+      char key[16];
+      double a, b;
+      int n;
+
+      if (strchr(line, '#'))
+        *strchr(line, '#') = '\0';
+      n = sscanf(line, "%15s %lf %lf", key, &a, &b);
+      if (n <= 0)
+        continue;
+      if ((n == 2) && (strcmp(key, "capacity") == 0) && (a > 0.0))
+        m_capacity = a;
+      else if ((n == 3) && (strcmp(key, "peukert") == 0) && (a >= 1.0) && (b > 0.0))
+        m_peukert = a, m_iref = b;
+      else if ((n == 2) && (strcmp(key, "r0") == 0) && (a >= 0.0))
+        m_r0 = a;
+      else if ((n == 2) && (strcmp(key, "r1") == 0) && (a >= 0.0))
+        m_r1 = a;
+      else if ((n == 2) && (strcmp(key, "tau") == 0) && (a >= 0.0))
+        m_tau = a;
+      else if ((n == 3) && (strcmp(key, "ocv") == 0))
+        points.push_back({ a, b });
+      else {
+        rc = -EBADMSG;
+        break;
+      }
+    }
+    fclose(f);
+
+    if ((rc == 0) && !points.empty())
+      rc = setOCV(points);
+    if (rc == 0)
+      reset();
+
+    return rc;
+  }
+
+  void save(FILE *stream) const {
+    fprintf(stream, "capacity %.4f\n", m_capacity);
+    fprintf(stream, "peukert %.3f %.4f\n", m_peukert, m_iref);
+    fprintf(stream, "r0 %.5f\nr1 %.5f\ntau %.2f\n", m_r0, m_r1, m_tau);
+    for (size_t i = 0; i < m_ocv.size(); i++)
+      fprintf(stream, "ocv %.3f %.4f\n", m_ocv[i].soc, m_ocv[i].voltage);
+  }
+
+private:
+  // part of the capacity past the lowest curve point the voltage collapses over
+  static constexpr double collapse = 0.05;
+
+  double m_capacity;  // Ah at iref
+  double m_peukert;
+  double m_iref;
+  double m_r0;
+  double m_r1;
+  double m_tau;
+  std::vector<ocvpoint_t> m_ocv;
+  double m_soc;
+  double m_v1;        // voltage across the RC pair
+};
+
+#endif /* _BATTMODEL_H */
@@ -0,0 +1,220 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+
+// monotonic time, sleeps and timers the battery run and the device driver
+// take their time from, a simulated clock runs them faster than real time
+class Clock {
+public:
+  virtual ~Clock() {}
+
+  virtual void now(struct timespec &ts) = 0;
+
+  // relative, returns 0 or -EINTR if interrupted by a signal
+  virtual int sleep(const struct timespec &ts) = 0;
+
+  int usleep(useconds_t us) {
+    struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000L };
+    return sleep(ts);
+  }
+
+  // returns timer id > 0 or -errno
+  virtual int timerCreate() = 0;
+
+  // relative value and interval, zero value disarms
+  virtual int timerSet(int id, const struct itimerspec &its) = 0;
+
+  virtual void timerDelete(int id) = 0;
+
+  // waits for a timer to expire, returns its id, -EINTR if interrupted
+  // by a signal or -EDEADLK if no timer is armed on a simulated clock
+  virtual int wait() = 0;
+
+  virtual bool simulated() { return false; }
+
+  // the one real clock
+  static Clock &system();
+};
+
+// CLOCK_MONOTONIC and POSIX timers, expiry is signalled with SIGALRM, which
+// is blocked in the thread creating the first timer and waited for by wait()
+class SystemClock : public Clock {
+public:
+  SystemClock() {}
+
+  ~SystemClock() {
+    for (size_t i = 0; i < m_timers.size(); i++)
+      if (m_used[i])
+        timer_delete(m_timers[i]);
+  }
+
+  void now(struct timespec &ts) { clock_gettime(CLOCK_MONOTONIC, &ts); }
+
+  int sleep(const struct timespec &ts) {
+    return (nanosleep(&ts, NULL) == 0) ? 0 : -errno;
+  }
+
+  int timerCreate() {
+    struct sigevent sev = {};
+    sigset_t set;
+    timer_t tid;
+    size_t i;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    for (i = 0; (i < m_used.size()) && m_used[i]; i++);
+    // the id comes back with the signal, timer_t of the first one may be 0
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    sev.sigev_value.sival_int = (int)i + 1;
+    if ((timer_create(CLOCK_MONOTONIC, &sev, &tid) != 0) &&
+        ((errno != EAGAIN) || (timer_create(CLOCK_MONOTONIC, &sev, &tid) != 0)))
+      return -errno;
+
+    if (i == m_used.size()) {
+      m_timers.push_back(tid);
+      m_used.push_back(true);
+    } else {
+      m_timers[i] = tid;
+      m_used[i] = true;
+    }
+
+    return (int)i + 1;
+  }
+
+  int timerSet(int id, const struct itimerspec &its) {
+    if (!valid(id))
+      return -EINVAL;
+    return (timer_settime(m_timers[id - 1], 0, &its, NULL) == 0) ? 0 : -errno;
+  }
+
+  void timerDelete(int id) {
+    if (!valid(id))
+      return;
+    timer_delete(m_timers[id - 1]);
+    m_used[id - 1] = false;
+  }
+
+  int wait() {
+    sigset_t set;
+    siginfo_t info;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    while (true) {
+      if (sigwaitinfo(&set, &info) < 0)
+        return -errno;
+      if ((info.si_code == SI_TIMER) && valid(info.si_value.sival_int))
+        return info.si_value.sival_int;
+    }
+  }
+
+private:
+  bool valid(int id) { return (id > 0) && ((size_t)id <= m_used.size()) && m_used[id - 1]; }
+
+  std::vector<timer_t> m_timers;
+  std::vector<bool> m_used;
+};
+
+inline Clock &Clock::system()
+{
+  static SystemClock clock;
+  return clock;
+}
+
+// virtual time which passes only when slept or waited for, so whatever
+// runs on it takes as long as its computations do
+class SimClock : public Clock {
+public:
+  SimClock(const struct timespec &start = { 0, 0 }) : m_now(start) {}
+
+  void now(struct timespec &ts) { ts = m_now; }
+
+  int sleep(const struct timespec &ts) {
+    add(m_now, ts);
+    return 0;
+  }
+
+  int timerCreate() {
+    m_timers.push_back(simtimer_t());
+    return (int)m_timers.size();
+  }
+
+  int timerSet(int id, const struct itimerspec &its) {
+    if ((id <= 0) || ((size_t)id > m_timers.size()) || !m_timers[id - 1].used)
+      return -EINVAL;
+
+    simtimer_t &t = m_timers[id - 1];
+    t.armed = (its.it_value.tv_sec > 0) || (its.it_value.tv_nsec > 0);
+    t.expiry = m_now;
+    add(t.expiry, its.it_value);
+    t.interval = its.it_interval;
+
+    return 0;
+  }
+
+  void timerDelete(int id) {
+    if ((id > 0) && ((size_t)id <= m_timers.size()))
+      m_timers[id - 1].used = false;
+  }
+
+  // jumps to the earliest expiry
+  int wait() {
+    int id = 0;
+
+    for (size_t i = 0; i < m_timers.size(); i++) {
+      simtimer_t &t = m_timers[i];
+      if (t.used && t.armed && ((id == 0) || before(t.expiry, m_timers[id - 1].expiry)))
+        id = (int)i + 1;
+    }
+    if (id == 0)
+      return -EDEADLK;
+
+    simtimer_t &t = m_timers[id - 1];
+    if (before(m_now, t.expiry))
+      m_now = t.expiry;
+    if ((t.interval.tv_sec > 0) || (t.interval.tv_nsec > 0))
+      add(t.expiry, t.interval);
+    else
+      t.armed = false;
+
+    return id;
+  }
+
+  bool simulated() { return true; }
+
+private:
+  typedef struct simtimer_s {
+    simtimer_s() : used(true), armed(false), expiry({ 0, 0 }), interval({ 0, 0 }) {}
+
+    bool used;
+    bool armed;
+    struct timespec expiry;
+    struct timespec interval;
+  } simtimer_t;
+
+  static void add(struct timespec &ts, const struct timespec &d) {
+    ts.tv_sec += d.tv_sec;
+    ts.tv_nsec += d.tv_nsec;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+  }
+
+  static bool before(const struct timespec &a, const struct timespec &b) {
+    return (a.tv_sec < b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec < b.tv_nsec));
+  }
+
+  struct timespec m_now;
+  std::vector<simtimer_t> m_timers;
+};
+
+#endif /* _CLOCK_H */
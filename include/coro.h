@@ -0,0 +1,405 @@
+#ifndef _CORO_H
+#define _CORO_H
+
+#if __cplusplus < 202002L
+#error "coro.h requires C++20"
+#endif
+
+#include <cstdint>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <coroutine>
+
+#include "KP184.h"
+#include "reactor.h"
+
+// C++20 coroutine interface to KP184 devices
+// a test is written as a coroutine returning Task and awaiting EventLoop
+// operations, e.g.
+//
+//   Task discharge(EventLoop &loop, KP184 &dev) {
+//     if ((rc = co_await loop.setModeValue(dev, KP184::MODE_CC, 1.0)))
+//       co_return rc;
+//     ...
+//     co_await loop.sleep(1000);
+//   }
+//
+//   loop.spawn(discharge(loop, dev));
+//   loop.run();
+//
+// operations return 0 or -errno like their synchronous counterparts,
+// all tasks are run by one thread, devices are added to the loop's reactor
+// on first use and shouldn't be used synchronously from then on
+
+// coroutine returning int, started when awaited or spawned
+class Task {
+public:
+  class promise_type {
+  public:
+    promise_type() : m_rc(0) {}
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // resumes awaiting coroutine, if any
+    class Final {
+    public:
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        std::coroutine_handle<> cont = h.promise().m_cont;
+        return cont ? cont : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+
+    Final final_suspend() noexcept { return {}; }
+
+    void return_value(int rc) { m_rc = rc; }
+
+    void unhandled_exception() { std::terminate(); }
+
+  private:
+    friend class Task;
+
+    int m_rc;
+    std::coroutine_handle<> m_cont;
+  };
+
+  Task(Task &&t) noexcept : m_h(t.m_h) { t.m_h = nullptr; }
+
+  Task &operator=(Task &&t) noexcept {
+    if (this != &t) {
+      if (m_h)
+        m_h.destroy();
+      m_h = t.m_h;
+      t.m_h = nullptr;
+    }
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  ~Task() {
+    if (m_h)
+      m_h.destroy();
+  }
+
+  bool done() { return !m_h || m_h.done(); }
+
+  // co_return'ed value of finished task
+  int result() { return m_h ? m_h.promise().m_rc : -ECHILD; }
+
+  bool await_ready() { return done(); }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) {
+    m_h.promise().m_cont = cont;
+    return m_h;
+  }
+
+  int await_resume() { return result(); }
+
+private:
+  friend class EventLoop;
+
+  explicit Task(std::coroutine_handle<promise_type> h) : m_h(h) {}
+
+  std::coroutine_handle<promise_type> m_h;
+};
+
+// runs tasks, device transactions and timers from a single thread
+class EventLoop {
+public:
+  EventLoop() : m_seq(0) {}
+
+  // device operation, resumes the awaiting task once complete
+  class Op {
+  public:
+    Op(EventLoop &loop, KP184 &dev) : m_loop(loop), m_dev(dev), m_rc(-EINPROGRESS) {}
+
+    virtual ~Op() {}
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+      m_h = h;
+      if ((m_rc = m_loop.attach(m_dev)) == 0)
+        m_rc = start();
+      if (m_rc < 0) // nothing queued, carry on
+        return false;
+      m_rc = -EINPROGRESS;
+      return true;
+    }
+
+    int await_resume() { return (m_rc < 0) ? m_rc : 0; }
+
+  protected:
+    // queues the transaction with done() completion, returns 0 or -errno
+    virtual int start() = 0;
+
+    static void done(KP184 &dev, int rc, void *ctx) {
+      Op *op = (Op *)ctx;
+
+      op->m_rc = rc;
+      op->m_loop.ready(op->m_h);
+    }
+
+    EventLoop &m_loop;
+    KP184 &m_dev;
+    int m_rc;
+    std::coroutine_handle<> m_h;
+  };
+
+  class StatusOp : public Op {
+  public:
+    StatusOp(EventLoop &loop, KP184 &dev, bool &out, KP184::mode_t &mode,
+             double &voltage, double &current) :
+      Op(loop, dev), m_out(out), m_mode(mode), m_voltage(voltage), m_current(current) {}
+
+    int await_resume() {
+      if (m_rc < 0)
+        return m_rc;
+      m_dev.getOutput(m_out, true);
+      m_dev.getMode(m_mode, true);
+      m_dev.getVoltage(m_voltage, true);
+      m_dev.getCurrent(m_current, true);
+      return 0;
+    }
+
+  protected:
+    int start() { return m_dev.getStatusAsync(done, this); }
+
+  private:
+    bool &m_out;
+    KP184::mode_t &m_mode;
+    double &m_voltage;
+    double &m_current;
+  };
+
+  // status as a sample, dt from since, which is moved on to the status time
+  class SampleOp : public Op {
+  public:
+    SampleOp(EventLoop &loop, KP184 &dev, Sample &s, struct timespec &since) :
+      Op(loop, dev), m_s(s), m_since(since) {}
+
+    int await_resume() {
+      if (m_rc < 0)
+        return m_rc;
+      return m_dev.getSample(m_s, m_since, true);
+    }
+
+  protected:
+    int start() { return m_dev.getStatusAsync(done, this); }
+
+  private:
+    Sample &m_s;
+    struct timespec &m_since;
+  };
+
+  class OutputOp : public Op {
+  public:
+    OutputOp(EventLoop &loop, KP184 &dev, bool on) : Op(loop, dev), m_on(on) {}
+
+  protected:
+    int start() { return m_dev.setOutputAsync(m_on, done, this); }
+
+  private:
+    bool m_on;
+  };
+
+  class ModeOp : public Op {
+  public:
+    ModeOp(EventLoop &loop, KP184 &dev, KP184::mode_t mode) : Op(loop, dev), m_mode(mode) {}
+
+  protected:
+    int start() { return m_dev.setModeAsync(m_mode, done, this); }
+
+  private:
+    KP184::mode_t m_mode;
+  };
+
+  class ModeValueOp : public Op {
+  public:
+    ModeValueOp(EventLoop &loop, KP184 &dev, KP184::mode_t mode, double value) :
+      Op(loop, dev), m_mode(mode), m_value(value) {}
+
+  protected:
+    int start() { return m_dev.setModeValueAsync(m_mode, m_value, done, this); }
+
+  private:
+    KP184::mode_t m_mode;
+    double m_value;
+  };
+
+  // resumes the awaiting task at due time (CLOCK_MONOTONIC)
+  class Timer {
+  public:
+    Timer(EventLoop &loop, const struct timespec &due) : m_loop(loop), m_due(due) {}
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) { m_loop.schedule(m_due, h); }
+
+    void await_resume() {}
+
+  private:
+    EventLoop &m_loop;
+    struct timespec m_due;
+  };
+
+  StatusOp getStatus(KP184 &dev, bool &out, KP184::mode_t &mode, double &voltage, double &current) {
+    return StatusOp(*this, dev, out, mode, voltage, current);
+  }
+
+  SampleOp getSample(KP184 &dev, Sample &s, struct timespec &since) {
+    return SampleOp(*this, dev, s, since);
+  }
+
+  OutputOp setOutput(KP184 &dev, bool on) { return OutputOp(*this, dev, on); }
+
+  ModeOp setMode(KP184 &dev, KP184::mode_t mode) { return ModeOp(*this, dev, mode); }
+
+  ModeValueOp setModeValue(KP184 &dev, KP184::mode_t mode, double value) {
+    return ModeValueOp(*this, dev, mode, value);
+  }
+
+  Timer sleep(unsigned int ms) {
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    due.tv_sec += ms / 1000;
+    due.tv_nsec += (ms % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L) {
+      due.tv_sec++;
+      due.tv_nsec -= 1000000000L;
+    }
+
+    return Timer(*this, due);
+  }
+
+  Timer sleepUntil(const struct timespec &due) { return Timer(*this, due); }
+
+  // the loop owns the task from now on, it's started by run()
+  void spawn(Task &&task) {
+    if (task.done())
+      return;
+    ready(task.m_h);
+    m_tasks.push_back(std::move(task));
+  }
+
+  // maximum requests in flight per Modbus TCP connection, see Reactor
+  void setWindow(size_t window) { m_reactor.setWindow(window); }
+
+  // runs until all spawned tasks are finished, returns 0 or -errno
+  int run() {
+    int rc;
+
+    while (true) {
+      resumeReady();
+      reap();
+      if (m_tasks.empty())
+        break;
+
+      if ((rc = m_reactor.runOnce(timeout())) < 0)
+        return rc;
+
+      expire();
+    }
+
+    return 0;
+  }
+
+private:
+  typedef struct {
+    struct timespec due;
+    uint64_t seq; // keeps timers with equal due time in order
+    std::coroutine_handle<> h;
+  } timer_t;
+
+  // heap order, earliest at the front
+  static bool later(const timer_t &a, const timer_t &b) {
+    if (a.due.tv_sec != b.due.tv_sec)
+      return a.due.tv_sec > b.due.tv_sec;
+    if (a.due.tv_nsec != b.due.tv_nsec)
+      return a.due.tv_nsec > b.due.tv_nsec;
+    return a.seq > b.seq;
+  }
+
+  int attach(KP184 &dev) {
+    int rc = m_reactor.add(dev);
+    return (rc == -EEXIST) ? 0 : rc;
+  }
+
+  // completions may come from inside the reactor, resume the task later
+  void ready(std::coroutine_handle<> h) { m_ready.push_back(h); }
+
+  void schedule(const struct timespec &due, std::coroutine_handle<> h) {
+    timer_t t = { due, m_seq++, h };
+
+    m_timers.push_back(t);
+    std::push_heap(m_timers.begin(), m_timers.end(), later);
+  }
+
+  void resumeReady() {
+    while (!m_ready.empty()) {
+      std::vector<std::coroutine_handle<> > ready;
+
+      ready.swap(m_ready);
+      for (size_t i = 0; i < ready.size(); i++)
+        ready[i].resume();
+    }
+  }
+
+  void reap() {
+    for (size_t i = m_tasks.size(); i > 0; i--)
+      if (m_tasks[i - 1].done())
+        m_tasks.erase(m_tasks.begin() + (i - 1));
+  }
+
+  void expire() {
+    struct timespec now;
+    timer_t probe;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    probe.due = now;
+    probe.seq = UINT64_MAX;
+    while (!m_timers.empty() && !later(m_timers.front(), probe)) {
+      ready(m_timers.front().h);
+      std::pop_heap(m_timers.begin(), m_timers.end(), later);
+      m_timers.pop_back();
+    }
+  }
+
+  // ms to wait for I/O, up to the earliest timer
+  int timeout() {
+    struct timespec now;
+    long ms;
+
+    if (!m_ready.empty())
+      return 0;
+    if (m_timers.empty())
+      return 1000;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (m_timers.front().due.tv_sec - now.tv_sec) * 1000L +
+         (m_timers.front().due.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+    if (ms < 0)
+      return 0;
+
+    return (ms > 1000) ? 1000 : (int)ms;
+  }
+
+  Reactor m_reactor;
+  std::vector<Task> m_tasks;
+  std::vector<std::coroutine_handle<> > m_ready;
+  std::vector<timer_t> m_timers;
+  uint64_t m_seq;
+};
+
+#endif /* _CORO_H */
@@ -0,0 +1,220 @@
+#ifndef _CRC16_H
+#define _CRC16_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define CRC16_CLMUL
+#  include <immintrin.h>
+#endif
+
+// lookup tables of reflected CRC-16, t[k][b] is CRC of byte b followed by k zero bytes
+class CRC16Tables {
+public:
+  constexpr CRC16Tables(uint16_t poly) : t() {
+    for (int b = 0; b < 256; b++) {
+      uint16_t crc = (uint16_t)b;
+      for (int i = 0; i < 8; i++)
+        crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ poly) : (uint16_t)(crc >> 1);
+      t[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+      for (int b = 0; b < 256; b++)
+        t[k][b] = (uint16_t)((t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF]);
+  }
+
+  uint16_t t[8][256];
+};
+
+// CRC-16/MODBUS: reflected 0x8005 polynomial, 0xFFFF initial value
+// the tables and folding constants are generated at compile time,
+// the fastest engine for the CPU and the buffer length is picked at runtime
+class CRC16 {
+public:
+  typedef uint16_t (*engine_t)(const uint8_t buf[], size_t len, uint16_t crc);
+
+  typedef enum {
+    ENGINE_AUTO,
+    ENGINE_BITWISE,
+    ENGINE_TABLE,
+    ENGINE_SLICE8,
+    ENGINE_CLMUL
+  } engineid_t;
+
+  static const uint16_t init = 0xFFFF;
+
+  static uint16_t calc(const uint8_t buf[], size_t len, uint16_t crc = init) {
+    if (len < slice8_min)
+      return table(buf, len, crc);
+    if (len < clmul_min)
+      return slice8(buf, len, crc);
+    return large()(buf, len, crc);
+  }
+
+  static const char *engineStr(engineid_t id) {
+    static const char *names[ENGINE_CLMUL + 1] = {
+      "auto", "bitwise", "table", "slice-by-8", "clmul" };
+    if (id > ENGINE_CLMUL) return "N/A";
+    return names[id];
+  }
+
+  // NULL if not supported by the CPU
+  static engine_t engine(engineid_t id) {
+    switch (id) {
+    case ENGINE_AUTO: return calc;
+    case ENGINE_BITWISE: return bitwise;
+    case ENGINE_TABLE: return table;
+    case ENGINE_SLICE8: return slice8;
+    case ENGINE_CLMUL: return haveCLMUL() ? clmulEngine() : NULL;
+    }
+    return NULL;
+  }
+
+  static uint16_t bitwise(const uint8_t buf[], size_t len, uint16_t crc) {
+    while (len--) {
+      crc ^= (uint16_t)*buf++;
+      for (int i = 0; i < 8; i++)
+        crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ poly) : (uint16_t)(crc >> 1);
+    }
+
+    return crc;
+  }
+
+  // constexpr to build fixed frames at compile time
+  static constexpr uint16_t table(const uint8_t buf[], size_t len, uint16_t crc) {
+    while (len--)
+      crc = (uint16_t)((crc >> 8) ^ tables.t[0][(crc ^ *buf++) & 0xFF]);
+
+    return crc;
+  }
+
+  static uint16_t slice8(const uint8_t buf[], size_t len, uint16_t crc) {
+    while (len >= 8) {
+      // crc overlaps the first two bytes
+      uint32_t lo = (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                    (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+      lo ^= crc;
+      crc = (uint16_t)(tables.t[7][lo & 0xFF] ^ tables.t[6][(lo >> 8) & 0xFF] ^
+                       tables.t[5][(lo >> 16) & 0xFF] ^ tables.t[4][lo >> 24] ^
+                       tables.t[3][buf[4]] ^ tables.t[2][buf[5]] ^
+                       tables.t[1][buf[6]] ^ tables.t[0][buf[7]]);
+      buf += 8;
+      len -= 8;
+    }
+
+    return table(buf, len, crc);
+  }
+
+private:
+  static const uint16_t poly = 0xA001;  // reflected 0x8005
+  static const size_t slice8_min = 16;
+  static const size_t clmul_min = 128;
+
+  static constexpr CRC16Tables tables = CRC16Tables(poly);
+
+  // x^n mod P, P = x^16 + x^15 + x^2 + 1, bit i is coefficient of x^i
+  static constexpr uint16_t xpow(unsigned int n) {
+    uint32_t r = 1;
+
+    while (n--) {
+      r <<= 1;
+      if (r & 0x10000)
+        r ^= 0x18005;
+    }
+
+    return (uint16_t)r;
+  }
+
+  static constexpr uint64_t reflect64(uint64_t v) {
+    uint64_t r = 0;
+
+    for (int i = 0; i < 64; i++)
+      if (v & ((uint64_t)1 << i))
+        r |= (uint64_t)1 << (63 - i);
+
+    return r;
+  }
+
+  // folding constant for a 64-bit half which is dist bits ahead of
+  // the block it's folded into: x^(dist + 64 - 1) mod P, reflected
+  static constexpr uint64_t fold(unsigned int dist) {
+    return reflect64(xpow(dist + 64 - 1));
+  }
+
+  static bool haveCLMUL() {
+#ifdef CRC16_CLMUL
+    static const bool have = __builtin_cpu_supports("pclmul") &&
+                             __builtin_cpu_supports("sse4.1");
+    return have;
+#else
+    return false;
+#endif
+  }
+
+  static engine_t large() {
+    static const engine_t eng = haveCLMUL() ? clmulEngine() : slice8;
+    return eng;
+  }
+
+#ifdef CRC16_CLMUL
+  static engine_t clmulEngine() { return clmul; }
+
+  __attribute__((target("pclmul,sse4.1")))
+  static inline __m128i fold128(__m128i a, __m128i b, __m128i k) {
+    // low half is the higher degree one in the reflected domain
+    return _mm_xor_si128(b, _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+                                          _mm_clmulepi64_si128(a, k, 0x11)));
+  }
+
+  // folds 64-byte blocks down to a 16-byte one congruent modulo P, which,
+  // followed by the tail, is then run through the table
+  __attribute__((target("pclmul,sse4.1")))
+  static uint16_t clmul(const uint8_t buf[], size_t len, uint16_t crc) {
+    // lo: K for the lower (higher degree) half, hi: K for the upper one
+    const __m128i k512 = _mm_set_epi64x((long long)fold(512 - 64), (long long)fold(512));
+    const __m128i k128 = _mm_set_epi64x((long long)fold(128 - 64), (long long)fold(128));
+    __m128i x0, x1, x2, x3;
+    uint8_t rest[16];
+
+    if (len < 64)
+      return slice8(buf, len, crc);
+
+    x0 = _mm_loadu_si128((const __m128i *)buf);
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+      x0 = fold128(x0, _mm_loadu_si128((const __m128i *)buf), k512);
+      x1 = fold128(x1, _mm_loadu_si128((const __m128i *)(buf + 16)), k512);
+      x2 = fold128(x2, _mm_loadu_si128((const __m128i *)(buf + 32)), k512);
+      x3 = fold128(x3, _mm_loadu_si128((const __m128i *)(buf + 48)), k512);
+      buf += 64;
+      len -= 64;
+    }
+
+    x1 = fold128(x0, x1, k128);
+    x2 = fold128(x1, x2, k128);
+    x3 = fold128(x2, x3, k128);
+    while (len >= 16) {
+      x3 = fold128(x3, _mm_loadu_si128((const __m128i *)buf), k128);
+      buf += 16;
+      len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)rest, x3);
+    crc = slice8(rest, sizeof(rest), 0);
+
+    return slice8(buf, len, crc);
+  }
+#else
+  static engine_t clmulEngine() { return NULL; }
+#endif
+};
+
+#endif /* _CRC16_H */
@@ -0,0 +1,351 @@
+#ifndef _CSVLOG_H
+#define _CSVLOG_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <charconv>
+#include <thread>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "sample.h"
+
+// battery CSV written by a thread of its own (link with -pthread), so the
+// sampling loop never waits for the disk: samples are handed over in a
+// lock-free single producer ring, formatted without stdio and written in
+// batches, synced to the disk every sync interval and when closed
+//
+//   No.;time;voltage;unit;current;unit
+//   1;0.000138;12;V;0;A
+class CSVLog {
+public:
+  CSVLog() :
+    m_fd(-1),
+    m_evfd(-1),
+    m_owned(false),
+    m_syncms(0),
+    m_head(0),
+    m_tail(0),
+    m_stop(false),
+    m_error(0),
+    m_stalls(0)
+  {
+  }
+
+  ~CSVLog() {
+    close();
+  }
+
+  // path NULL writes to stdout, the header is written unless appending
+  // to a file which has some already
+  int open(const char path[], bool append) {
+    struct stat st = {};
+    int rc;
+
+    if (m_fd >= 0)
+      return -EALREADY;
+
+    if (path) {
+      if ((stat(path, &st) == 0) && (S_ISDIR(st.st_mode) || S_ISBLK(st.st_mode)))
+        return -EISDIR;
+      m_fd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+      if (m_fd < 0)
+        return -errno;
+      m_owned = true;
+      if (fstat(m_fd, &st) < 0)
+        st.st_size = 0;
+    } else {
+      m_fd = STDOUT_FILENO;
+      m_owned = false;
+      st.st_size = 0;
+    }
+
+    if ((m_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+      rc = -errno;
+      closeFile();
+      return rc;
+    }
+
+    m_len = 0;
+    if (!append || (st.st_size == 0)) {
+      static const char header[] = "No.;time;voltage;unit;current;unit\n";
+      memcpy(m_buf, header, sizeof(header) - 1);
+      m_len = sizeof(header) - 1;
+    }
+
+    m_head.store(0, std::memory_order_relaxed);
+    m_tail.store(0, std::memory_order_relaxed);
+    m_stop.store(false, std::memory_order_relaxed);
+    m_error.store(0, std::memory_order_relaxed);
+    m_stalls = 0;
+    m_thread = std::thread(&CSVLog::writer, this);
+
+    return 0;
+  }
+
+  // drains the ring, writes everything out and syncs, returns 0 or
+  // the first write error
+  int close() {
+    if (m_fd < 0)
+      return 0;
+
+    m_stop.store(true, std::memory_order_release);
+    wake();
+    m_thread.join();
+    ::close(m_evfd);
+    m_evfd = -1;
+    closeFile();
+
+    return m_error.load(std::memory_order_relaxed);
+  }
+
+  bool isOpen() { return m_fd >= 0; }
+
+  // number of the last sample a CSV file has, 0 if none, a line torn by
+  // a crash is cut off so appending goes on from the last whole one
+  static int last(const char path[], unsigned long &no) {
+    char buf[4 * max_line];
+    struct stat st;
+    ssize_t len;
+    off_t off;
+    int fd, rc = 0;
+
+    no = 0;
+    if ((fd = ::open(path, O_RDWR | O_CLOEXEC)) < 0)
+      return -errno;
+    if (fstat(fd, &st) < 0) {
+      rc = -errno;
+      ::close(fd);
+      return rc;
+    }
+    off = (st.st_size > (off_t)sizeof(buf)) ? st.st_size - (off_t)sizeof(buf) : 0;
+    if ((len = pread(fd, buf, (size_t)(st.st_size - off), off)) < 0) {
+      rc = -errno;
+      ::close(fd);
+      return rc;
+    }
+
+    while ((len > 0) && (buf[len - 1] != '\n'))
+      len--;
+    if ((off + len < st.st_size) && (ftruncate(fd, off + len) < 0))
+      rc = -errno;
+    ::close(fd);
+
+    // the line before the last newline, the header's number is 0
+    if (len > 0) {
+      ssize_t b = len - 1;
+
+      while ((b > 0) && (buf[b - 1] != '\n'))
+        b--;
+      std::from_chars(buf + b, buf + len, no);
+    }
+
+    return rc;
+  }
+
+  // fdatasync cadence, ms, 0 syncs only when closed
+  void setSync(unsigned int ms) { m_syncms.store(ms, std::memory_order_relaxed); }
+
+  unsigned int getSync() { return m_syncms.load(std::memory_order_relaxed); }
+
+  // first write error of the writer, 0 if none
+  int error() { return m_error.load(std::memory_order_relaxed); }
+
+  // times the producer found the ring full and waited for the disk
+  unsigned long stalls() { return m_stalls; }
+
+  // single producer, us is the time of the sample since the start,
+  // waits only if the writer is ring_size samples behind
+  void push(unsigned long no, uint64_t us, const Sample &s) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+
+    if (head - m_tail.load(std::memory_order_acquire) == ring_size) {
+      m_stalls++;
+      wake();
+      while (head - m_tail.load(std::memory_order_acquire) == ring_size)
+        usleep(1000);
+    }
+
+    entry_t &e = m_ring[head & (ring_size - 1)];
+    e.no = no;
+    e.us = us;
+    e.mv = s.mv;
+    e.ma = s.ma;
+    m_head.store(head + 1, std::memory_order_release);
+
+    // the writer looks at the ring every flush_ms anyway
+    if ((head + 1 - m_tail.load(std::memory_order_relaxed)) % batch == 0)
+      wake();
+  }
+
+private:
+  static const size_t ring_size = 4096;   // power of 2
+  static const size_t batch = 256;        // samples the writer is woken for
+  static const size_t buf_size = 64 * 1024;
+  static const size_t max_line = 80;
+  static const int flush_ms = 1000;
+
+  typedef struct {
+    uint64_t no;
+    uint64_t us;
+    int32_t mv;
+    int32_t ma;
+  } entry_t;
+
+  void wake() {
+    uint64_t one = 1;
+    ssize_t rc = write(m_evfd, &one, sizeof(one));
+    (void)rc; // counter overflow means it's signaled anyway
+  }
+
+  void closeFile() {
+    if (m_owned)
+      ::close(m_fd);
+    m_fd = -1;
+    m_owned = false;
+  }
+
+  // milli-units as %g prints them, up to 6 digits
+  static char *milli(char *p, char *end, int32_t v) {
+    uint32_t u;
+
+    if (v < 0) {
+      *p++ = '-';
+      u = (uint32_t)0 - (uint32_t)v;
+    } else
+      u = (uint32_t)v;
+
+    p = std::to_chars(p, end, u / 1000).ptr;
+    if ((u %= 1000) != 0) {
+      *p++ = '.';
+      *p++ = (char)('0' + u / 100);
+      if ((u %= 100) != 0) {
+        *p++ = (char)('0' + u / 10);
+        if ((u %= 10) != 0)
+          *p++ = (char)('0' + u);
+      }
+    }
+
+    return p;
+  }
+
+  // appends the CSV line of the entry to the buffer
+  void format(const entry_t &e) {
+    char *p = m_buf + m_len, *end = m_buf + sizeof(m_buf);
+    uint32_t us = (uint32_t)(e.us % 1000000);
+
+    p = std::to_chars(p, end, e.no).ptr;
+    *p++ = ';';
+    p = std::to_chars(p, end, e.us / 1000000).ptr;
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--, us /= 10)
+      p[i] = (char)('0' + us % 10);
+    p += 6;
+    *p++ = ';';
+    p = milli(p, end, e.mv);
+    memcpy(p, ";V;", 3);
+    p += 3;
+    p = milli(p, end, e.ma);
+    memcpy(p, ";A\n", 3);
+    p += 3;
+
+    m_len = (size_t)(p - m_buf);
+  }
+
+  void flush() {
+    const char *p = m_buf;
+
+    while (m_len > 0) {
+      ssize_t rc = write(m_fd, p, m_len);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        if (m_error.load(std::memory_order_relaxed) == 0)
+          m_error.store(-errno, std::memory_order_relaxed);
+        break;
+      }
+      p += rc;
+      m_len -= (size_t)rc;
+    }
+    m_len = 0;
+  }
+
+  // pipes and terminals can't be synced, nothing to report then
+  void sync() {
+    if (m_owned && (fdatasync(m_fd) < 0) && (errno != EINVAL) &&
+        (m_error.load(std::memory_order_relaxed) == 0))
+      m_error.store(-errno, std::memory_order_relaxed);
+  }
+
+  static int64_t ms(const struct timespec &from, const struct timespec &to) {
+    return (int64_t)(to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+  }
+
+  void writer() {
+    struct pollfd pfd = { m_evfd, POLLIN, 0 };
+    struct timespec synced, now;
+    bool dirty = false;
+    sigset_t all;
+
+    // signals, timer ones in particular, are for the threads waiting for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &synced);
+    while (true) {
+      bool stop = m_stop.load(std::memory_order_acquire);
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      size_t head = m_head.load(std::memory_order_acquire);
+      unsigned int syncms = m_syncms.load(std::memory_order_relaxed);
+      uint64_t cnt;
+
+      for (; tail != head; tail++) {
+        if (m_len + max_line > sizeof(m_buf))
+          flush();
+        format(m_ring[tail & (ring_size - 1)]);
+        // the producer may go on as soon as the line is formatted
+        m_tail.store(tail + 1, std::memory_order_release);
+      }
+      if (m_len > 0) {
+        flush();
+        dirty = true;
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (dirty && (stop || ((syncms > 0) && (ms(synced, now) >= syncms)))) {
+        sync();
+        synced = now;
+        dirty = false;
+      }
+      if (stop)
+        break;
+
+      if ((poll(&pfd, 1, flush_ms) > 0) &&
+          (read(m_evfd, &cnt, sizeof(cnt)) < 0) && (errno != EAGAIN))
+        break;
+    }
+  }
+
+  int m_fd;
+  int m_evfd;
+  bool m_owned;                     // closed when done, not stdout
+  std::atomic<unsigned int> m_syncms;
+  entry_t m_ring[ring_size];
+  alignas(64) std::atomic<size_t> m_head; // next to push
+  alignas(64) std::atomic<size_t> m_tail; // next to format
+  std::atomic<bool> m_stop;
+  std::atomic<int> m_error;
+  unsigned long m_stalls;           // producer's own
+  char m_buf[buf_size];             // writer's own
+  size_t m_len;
+  std::thread m_thread;
+};
+
+#endif /* _CSVLOG_H */
@@ -0,0 +1,202 @@
+#ifndef _FAULTLINK_H
+#define _FAULTLINK_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+
+#include "link.h"
+
+// link of any device, L derives from Link, which fails frames at random
+// to see how the device driver and its users get over line glitches
+//
+// faults, each drawn per frame with its own probability:
+//   drop:     request is not sent, the reply times out
+//   delay:    reply comes late, past the receive timeout it times out
+//   truncate: reply loses its tail
+//   corrupt:  a bit of the reply flips, CRC fails on RTU links
+//   reset:    connection is lost, every frame fails with -ECONNRESET until reOpen()
+template <class L>
+class FaultLink : public L {
+public:
+  typedef enum {
+    FAULT_DROP = 0,
+    FAULT_DELAY,
+    FAULT_TRUNCATE,
+    FAULT_CORRUPT,
+    FAULT_RESET,
+    FAULT_MAX = FAULT_RESET
+  } fault_t;
+
+  FaultLink() : m_delay(0), m_down(false), m_seed(1) {
+    clearFaults();
+    resetFaultStats();
+  }
+
+  static const char *faultStr(fault_t fault) {
+    static const char *faultstr[FAULT_MAX + 1] = { "drop", "delay", "truncate", "corrupt", "reset" };
+    if (fault > FAULT_MAX) return "N/A";
+    return faultstr[fault];
+  }
+
+  // probability 0 .. 1 per frame
+  int setFault(fault_t fault, double rate) {
+    if ((fault > FAULT_MAX) || (rate < 0.0) || (rate > 1.0))
+      return -EINVAL;
+
+    m_rate[fault] = rate;
+    return 0;
+  }
+
+  double getFault(fault_t fault) { return (fault > FAULT_MAX) ? 0.0 : m_rate[fault]; }
+
+  // how late delayed replies come, usecs
+  void setFaultDelay(useconds_t delay) { m_delay = delay; }
+
+  // faults stop, a lost connection stays lost until reOpen()
+  void clearFaults() {
+    for (int i = 0; i <= FAULT_MAX; i++)
+      m_rate[i] = 0.0;
+  }
+
+  // comma separated fault=percent list, delay takes :ms after the percentage,
+  // e.g. "drop=1,delay=2:300,corrupt=0.5"
+  int setFaults(const char spec[]) {
+    std::string s(spec);
+    size_t pos = 0;
+
+    while (pos < s.size()) {
+      size_t end = s.find(',', pos), eq;
+      std::string item, name;
+      const char *val;
+      char *eptr;
+      double pct;
+      int i;
+
+      if (end == std::string::npos)
+        end = s.size();
+      item = s.substr(pos, end - pos);
+      pos = end + 1;
+
+      if ((eq = item.find('=')) == std::string::npos)
+        return -EINVAL;
+      name = item.substr(0, eq);
+      for (i = 0; i <= FAULT_MAX; i++)
+        if (name == faultStr((fault_t)i))
+          break;
+      if (i > FAULT_MAX)
+        return -EINVAL;
+
+      val = item.c_str() + eq + 1;
+      pct = strtod(val, &eptr);
+      if ((eptr == val) || (pct < 0.0) || (pct > 100.0))
+        return -EINVAL;
+      if ((*eptr == ':') && (i == FAULT_DELAY)) {
+        unsigned long ms = strtoul(eptr + 1, &eptr, 10);
+        m_delay = (useconds_t)ms * 1000;
+      }
+      if (*eptr != '\0')
+        return -EINVAL;
+
+      m_rate[i] = pct / 100.0;
+    }
+
+    return 0;
+  }
+
+  // fixed seed gives the same faults for the same traffic
+  void setSeed(uint64_t seed) { m_seed = seed ? seed : 1; }
+
+  // faults injected so far
+  unsigned long getFaultCount(fault_t fault) { return (fault > FAULT_MAX) ? 0 : m_count[fault]; }
+
+  unsigned long getFaultCount() {
+    unsigned long n = 0;
+    for (int i = 0; i <= FAULT_MAX; i++)
+      n += m_count[i];
+    return n;
+  }
+
+  void resetFaultStats() {
+    for (int i = 0; i <= FAULT_MAX; i++)
+      m_count[i] = 0;
+  }
+
+  virtual ssize_t send(const uint8_t buf[], size_t len) {
+    if (m_down)
+      return -ECONNRESET;
+    if (inject(FAULT_RESET)) {
+      m_down = true;
+      return -ECONNRESET;
+    }
+    if (inject(FAULT_DROP))
+      return (ssize_t)len;
+
+    return L::send(buf, len);
+  }
+
+  virtual ssize_t recvFrame(uint8_t buf[], size_t size, size_t expect, useconds_t gap) {
+    ssize_t ret;
+
+    if (m_down)
+      return -ECONNRESET;
+    if ((ret = L::recvFrame(buf, size, expect, gap)) <= 0)
+      return ret;
+
+    if ((m_delay > 0) && inject(FAULT_DELAY)) {
+      useconds_t timeout = (useconds_t)L::getTimeout(Link::TIMEOUT_RECV) * 1000;
+
+      // the late reply is drained by the flush before the next request
+      if (m_delay >= timeout) {
+        ::usleep(timeout);
+        return -ETIMEDOUT;
+      }
+      ::usleep(m_delay);
+    }
+    if ((ret > 1) && inject(FAULT_TRUNCATE))
+      ret = 1 + (ssize_t)(draw() % (uint64_t)(ret - 1));
+    if (inject(FAULT_CORRUPT))
+      buf[draw() % (uint64_t)ret] ^= (uint8_t)(1 << (draw() % 8));
+
+    return ret;
+  }
+
+  virtual int reOpen() {
+    m_down = false;
+    return L::reOpen();
+  }
+
+  virtual int close() {
+    m_down = false;
+    return L::close();
+  }
+
+private:
+  // xorshift64*, the process wide rand() state is left alone
+  uint64_t draw() {
+    m_seed ^= m_seed >> 12;
+    m_seed ^= m_seed << 25;
+    m_seed ^= m_seed >> 27;
+    return m_seed * 0x2545F4914F6CDD1DULL;
+  }
+
+  bool inject(fault_t fault) {
+    if ((m_rate[fault] <= 0.0) ||
+        ((double)(draw() >> 11) / (double)(1ULL << 53) >= m_rate[fault]))
+      return false;
+
+    m_count[fault]++;
+    return true;
+  }
+
+  double m_rate[FAULT_MAX + 1];
+  unsigned long m_count[FAULT_MAX + 1];
+  useconds_t m_delay;
+  bool m_down;
+  uint64_t m_seed;
+};
+
+#endif /* _FAULTLINK_H */
@@ -0,0 +1,160 @@
+#ifndef _IOSTATS_H
+#define _IOSTATS_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+// log-linear histogram of values, HDR style: 16 sub-buckets per power of two
+// keep relative error under ~3% from 32 up to 2^32, values below are exact
+class Histogram {
+public:
+  Histogram() { reset(); }
+
+  void reset() {
+    memset(m_counts, 0, sizeof(m_counts));
+    m_count = 0;
+    m_sum = 0;
+    m_min = UINT32_MAX;
+    m_max = 0;
+  }
+
+  void record(uint32_t val) {
+    m_counts[index(val)]++;
+    m_count++;
+    m_sum += val;
+    if (val < m_min) m_min = val;
+    if (val > m_max) m_max = val;
+  }
+
+  void merge(const Histogram &h) {
+    for (size_t i = 0; i < buckets; i++)
+      m_counts[i] += h.m_counts[i];
+    m_count += h.m_count;
+    m_sum += h.m_sum;
+    if (h.m_min < m_min) m_min = h.m_min;
+    if (h.m_max > m_max) m_max = h.m_max;
+  }
+
+  uint64_t count() const { return m_count; }
+  uint32_t min() const { return m_count ? m_min : 0; }
+  uint32_t max() const { return m_max; }
+  double mean() const { return m_count ? (double)m_sum / m_count : 0.0; }
+
+  // value below which pct percent of the records are, 0 .. 100
+  uint32_t percentile(double pct) const {
+    uint64_t rank, seen = 0;
+
+    if (m_count == 0)
+      return 0;
+    rank = (uint64_t)(pct / 100.0 * m_count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > m_count) rank = m_count;
+
+    for (size_t i = 0; i < buckets; i++) {
+      seen += m_counts[i];
+      if (seen >= rank) {
+        uint32_t val = highest(i);
+        return (val > m_max) ? m_max : val;
+      }
+    }
+
+    return m_max;
+  }
+
+private:
+  static const unsigned int sub_bits = 5;
+  static const uint32_t sub_count = 1 << sub_bits;
+  static const uint32_t sub_half = sub_count / 2;
+  static const size_t buckets = (32 - sub_bits + 1) * sub_half + sub_count;
+
+  static size_t index(uint32_t val) {
+    unsigned int shift;
+
+    if (val < sub_count)
+      return val;
+    shift = (31 - __builtin_clz(val)) - (sub_bits - 1);
+
+    return shift * sub_half + (val >> shift);
+  }
+
+  // highest value which falls into the bucket
+  static uint32_t highest(size_t idx) {
+    unsigned int shift;
+
+    if (idx < sub_count)
+      return (uint32_t)idx;
+    shift = (unsigned int)(idx / sub_half - 1);
+
+    return (uint32_t)((((uint64_t)(idx % sub_half + sub_half) + 1) << shift) - 1);
+  }
+
+  uint32_t m_counts[buckets];
+  uint64_t m_count;
+  uint64_t m_sum;
+  uint32_t m_min;
+  uint32_t m_max;
+};
+
+// per device transaction timing and error counters, times are in us
+// send: writing the request, turnaround: request written to first reply byte,
+// receive: first to last reply byte, total: request written to reply complete
+class IOStats {
+public:
+  IOStats() { reset(); }
+
+  void reset() {
+    send.reset();
+    turnaround.reset();
+    receive.reset();
+    total.reset();
+    transactions = 0;
+    crcerrors = 0;
+    timeouts = 0;
+    errors = 0;
+    retries = 0;
+    reopens = 0;
+  }
+
+  static uint32_t elapsed(const struct timespec &from, const struct timespec &to) {
+    int64_t us = (int64_t)(to.tv_sec - from.tv_sec) * 1000000 +
+                 (to.tv_nsec - from.tv_nsec) / 1000;
+    return (us < 0) ? 0 : (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+  }
+
+  void print(FILE *stream, const char *prefix = "") const {
+    fprintf(stream, "%stransactions %llu timeouts %llu CRC errors %llu errors %llu"
+                    " retries %llu reopens %llu\n", prefix,
+            (unsigned long long)transactions, (unsigned long long)timeouts,
+            (unsigned long long)crcerrors, (unsigned long long)errors,
+            (unsigned long long)retries, (unsigned long long)reopens);
+    fprintf(stream, "%s%-10s %8s %8s %8s %8s %8s %8s %8s %8s\n", prefix, "us",
+            "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+    printHistogram(stream, prefix, "send", send);
+    printHistogram(stream, prefix, "turnaround", turnaround);
+    printHistogram(stream, prefix, "receive", receive);
+    printHistogram(stream, prefix, "total", total);
+  }
+
+  Histogram send;
+  Histogram turnaround;
+  Histogram receive;
+  Histogram total;
+  uint64_t transactions; // completed, successfully or not
+  uint64_t crcerrors;
+  uint64_t timeouts;
+  uint64_t errors;       // other failed transactions
+  uint64_t retries;
+  uint64_t reopens;
+
+private:
+  static void printHistogram(FILE *stream, const char *prefix, const char *name,
+                             const Histogram &h) {
+    fprintf(stream, "%s%-10s %8llu %8u %8.0f %8u %8u %8u %8u %8u\n", prefix, name,
+            (unsigned long long)h.count(), h.min(), h.mean(), h.percentile(50.0),
+            h.percentile(90.0), h.percentile(99.0), h.percentile(99.9), h.max());
+  }
+};
+
+#endif /* _IOSTATS_H */
@@ -0,0 +1,154 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc16.h"
+
+// state of a run in a mapped file, so it outlives the process and, once
+// synced, the host: the state goes to the older of two slots, each with a
+// sequence number and a CRC, a slot torn by a crash fails the CRC and the
+// other one, one commit older, is loaded instead
+//
+//   magic[8] "KP184JNL", version u16, state size u16, reserved u32,
+//   slots: seq u64, state, crc u16 over both, padded to 8 bytes
+// native byte order, the journal is read back on the host which wrote it
+template <typename T>
+class Journal {
+  static_assert(std::is_trivially_copyable<T>::value, "state is copied as bytes");
+
+public:
+  static const uint16_t version = 1;
+
+  Journal() : m_map(NULL), m_seq(0) {}
+
+  ~Journal() {
+    close();
+  }
+
+  // maps the journal, create starts it anew, otherwise it must exist
+  int open(const char path[], bool create) {
+    int fd, rc;
+
+    if (m_map)
+      return -EALREADY;
+    if ((fd = ::open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644)) < 0)
+      return -errno;
+    if (create && (ftruncate(fd, (off_t)file_len) < 0)) {
+      rc = -errno;
+      ::close(fd);
+      return rc;
+    }
+    m_map = (uint8_t *)mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    rc = -errno;
+    ::close(fd);
+    if (m_map == MAP_FAILED) {
+      m_map = NULL;
+      return rc;
+    }
+
+    m_seq = 0;
+    if (create) {
+      uint16_t size = sizeof(T);
+
+      memcpy(m_map, "KP184JNL", 8);
+      memcpy(m_map + 8, &version, 2);
+      memcpy(m_map + 10, &size, 2);
+    } else if ((memcmp(m_map, "KP184JNL", 8) != 0) || (get16(m_map + 8) != version) ||
+               (get16(m_map + 10) != sizeof(T))) {
+      close();
+      return -EBADMSG;
+    } else
+      for (int i = 0; i < 2; i++)
+        if (valid(i) && (seq(i) > m_seq))
+          m_seq = seq(i);
+
+    return 0;
+  }
+
+  // syncs what's committed
+  void close() {
+    if (m_map == NULL)
+      return;
+    msync(m_map, file_len, MS_SYNC);
+    munmap(m_map, file_len);
+    m_map = NULL;
+  }
+
+  bool isOpen() { return m_map != NULL; }
+
+  // the last state committed, -ENOENT if there's none which is whole
+  int load(T &state) {
+    int last = -1;
+
+    if (m_map == NULL)
+      return -EBADF;
+    for (int i = 0; i < 2; i++)
+      if (valid(i) && ((last < 0) || (seq(i) > seq(last))))
+        last = i;
+    if (last < 0)
+      return -ENOENT;
+    memcpy(&state, slot(last) + 8, sizeof(T));
+
+    return 0;
+  }
+
+  // replaces the state, the previous one stays whole until this one is,
+  // sync waits for the disk, otherwise the kernel writes it back in time
+  int commit(const T &state, bool sync) {
+    uint8_t *s;
+    uint16_t crc;
+
+    if (m_map == NULL)
+      return -EBADF;
+
+    s = slot((int)(++m_seq & 1));
+    memcpy(s, &m_seq, 8);
+    memcpy(s + 8, &state, sizeof(T));
+    crc = CRC16::calc(s, 8 + sizeof(T));
+    memcpy(s + 8 + sizeof(T), &crc, 2);
+
+    if (msync(m_map, file_len, sync ? MS_SYNC : MS_ASYNC) < 0)
+      return -errno;
+
+    return 0;
+  }
+
+private:
+  static const size_t header_len = 16;
+  static const size_t slot_len = (8 + sizeof(T) + 2 + 7) & ~(size_t)7;
+  static const size_t file_len = header_len + 2 * slot_len;
+
+  static uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+
+    memcpy(&v, p, 2);
+    return v;
+  }
+
+  uint8_t *slot(int i) { return m_map + header_len + i * slot_len; }
+
+  uint64_t seq(int i) {
+    uint64_t v;
+
+    memcpy(&v, slot(i), 8);
+    return v;
+  }
+
+  bool valid(int i) {
+    return (seq(i) != 0) &&
+           (CRC16::calc(slot(i), 8 + sizeof(T)) == get16(slot(i) + 8 + sizeof(T)));
+  }
+
+  uint8_t *m_map;
+  uint64_t m_seq;   // of the last commit
+};
+
+#endif /* _JOURNAL_H */
@@ -9,6 +9,7 @@
 #include <ctime>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <sys/socket.h>
@@ -25,7 +26,8 @@ public:
   typedef enum {
     NONE = 0,
     SERIAL,
-    SOCKET
+    SOCKET,
+    MBTCP
   } linktype_t;
 
   typedef enum {
@@ -41,17 +43,20 @@ public:
 
   Link() :
     m_fd(-1)
+  , m_owner(true)
   , m_type(NONE)
   , m_timeout_send({ 2, 0 })
-  , m_timeout_recv({ 0, 500000L }) {
+  , m_timeout_recv({ 0, 500000L })
+  , m_chartime(0)
+  , m_rxstart({ 0, 0 }) {
   }
 
-  ~Link() {
+  virtual ~Link() {
     close();
   }
 
-  virtual int openSocket(const char addr[]) {
-    const char *service = "8899";
+  // service is used when addr has no port
+  virtual int openSocket(const char addr[], const char service[] = "8899") {
     char *maddr, *host;
     sock_t sockfd;
     int rc;
@@ -127,13 +132,15 @@ public:
       return rc;
     }
 
-    if (m_fd >= 0)
+    if ((m_fd >= 0) && m_owner)
       ::close(m_fd);
 
     m_fd = sockfd;
+    m_owner = true;
     m_type = SOCKET;
     m_addrstr = addr;
     m_confstr.clear();
+    m_chartime = 0;
 
     return 0;
   }
@@ -238,6 +245,8 @@ public:
     int serfd, rc = -EINVAL;
     struct termios sattr;
     speed_t cbaud = B115200;
+    long baud = 115200;
+    unsigned int charbits;
 
     serfd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (serfd == -1) {
@@ -280,6 +289,7 @@ public:
         goto serfail;
       }
       cbaud = asSbaud_table[i].icode;
+      baud = ibaud;
 
       if (*eptr == '\0') break;
       if (*eptr++ != ',' || *eptr == '\0') {
@@ -359,14 +369,31 @@ public:
       goto serfail;
     }
 
-    if (m_fd >= 0)
+    if ((m_fd >= 0) && m_owner)
       ::close(m_fd);
 
+    // start + data + parity + stop bits
+    switch (sattr.c_cflag & CSIZE) {
+#ifdef CS5
+    case CS5: charbits = 5; break;
+#endif
+#ifdef CS6
+    case CS6: charbits = 6; break;
+#endif
+#ifdef CS7
+    case CS7: charbits = 7; break;
+#endif
+    default: charbits = 8; break;
+    }
+    charbits += 1 + ((sattr.c_cflag & PARENB) ? 1 : 0) + ((sattr.c_cflag & CSTOPB) ? 2 : 1);
+
     m_fd = serfd;
+    m_owner = true;
     m_type = SERIAL;
     m_addrstr = path;
     if (config && *config) m_confstr = config;
     else m_confstr.clear();
+    m_chartime = (useconds_t)((charbits * 1000000L + baud - 1) / baud);
 
     return 0;
 
@@ -381,27 +408,58 @@ serfail:
     switch(type) {
       case SERIAL: return openSerial(link, config);
       case SOCKET: return openSocket(link);
+      case MBTCP: {
+        int rc = openSocket(link, "502");
+        if (rc == 0)
+          m_type = MBTCP;
+        return rc;
+      }
       default: break;
     }
     return -EINVAL;
   }
 
+  // shares the connection of another opened link, e.g. to reach several
+  // unit addresses behind one gateway, the connection stays owned by that link
+  virtual int attach(Link &link) {
+    if (link.m_fd < 0)
+      return -ENXIO;
+
+    if ((m_fd >= 0) && m_owner)
+      ::close(m_fd);
+
+    m_fd = link.m_fd;
+    m_owner = false;
+    m_type = link.m_type;
+    m_addrstr = link.m_addrstr;
+    m_confstr = link.m_confstr;
+    m_chartime = link.m_chartime;
+
+    return 0;
+  }
+
   virtual int reOpen() {
+    if (!m_owner)
+      return -EPERM;
+
     ::close(m_fd), m_fd = -1;
     return open(m_type, m_addrstr.c_str(), m_confstr.c_str());
   }
 
   virtual int close() {
-    int rc;
+    int rc = 0;
     if (m_fd == -1)
       return 0;
 
-    rc = ::close(m_fd);
+    if (m_owner)
+      rc = ::close(m_fd);
     if (rc == 0) {
       m_fd = -1;
+      m_owner = true;
       m_type = NONE;
       m_addrstr.clear();
       m_confstr.clear();
+      m_chartime = 0;
     }
 
     return rc;
@@ -413,8 +471,14 @@ serfail:
     if (m_fd < 0)
       return -ENXIO;
 
-    if (m_type != SERIAL)
+    if (m_type != SERIAL) {
+      // drain late replies so they can't be taken for the next one
+      if (queue & QUEUE_IN) {
+        uint8_t buf[64];
+        while (read(m_fd, buf, sizeof(buf)) > 0);
+      }
       return 0;
+    }
 
     switch (queue) {
     case QUEUE_IN: tcqsel = TCIFLUSH; break;
@@ -431,23 +495,23 @@ serfail:
   }
 
   virtual ssize_t send(const uint8_t buf[], size_t len) {
-    fd_set write_fd;
-    struct timeval timeout;
-    ssize_t rc = -EFAULT;
+    struct pollfd pfd;
+    ssize_t rc;
 
     if (m_fd < 0)
       return -ENXIO;
 
-    memcpy(&timeout, &m_timeout_send, sizeof(timeout));
+    // poll() is not limited by FD_SETSIZE
     do {
-      FD_ZERO (&write_fd);
-      FD_SET (m_fd, &write_fd);
+      pfd.fd = m_fd;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
 
-      if ((rc = select (m_fd + 1, NULL, &write_fd, NULL, &timeout)) < 0) {
+      if ((rc = poll(&pfd, 1, tv2ms(m_timeout_send))) < 0) {
         rc = -errno;
         if (errno == EINTR)
           continue;
-        perror ("select");
+        perror ("poll");
         return rc;
       } else if (rc == 0) { // timeout
         rc = -ETIMEDOUT;
@@ -457,29 +521,28 @@ serfail:
           return -errno;
         }
       }
-    }  while(0);
+    }  while(rc == -EINTR);
 
     return rc;
   }
 
   virtual ssize_t recv(uint8_t buf[], size_t size) {
-    fd_set read_fd;
-    struct timeval timeout;
-    ssize_t rc = -EFAULT;
+    struct pollfd pfd;
+    ssize_t rc;
 
     if (m_fd < 0)
       return -ENXIO;
 
-    memcpy(&timeout, &m_timeout_recv, sizeof(timeout));
     do {
-      FD_ZERO (&read_fd);
-      FD_SET (m_fd, &read_fd);
+      pfd.fd = m_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
 
-      if ((rc = select (m_fd + 1, &read_fd, NULL, NULL, &timeout)) < 0) {
+      if ((rc = poll(&pfd, 1, tv2ms(m_timeout_recv))) < 0) {
+        rc = -errno;
         if (errno == EINTR)
           continue;
-        rc = -errno;
-        perror ("select");
+        perror ("poll");
         return rc;
       } else if (rc == 0) { // timeout
         rc = -ETIMEDOUT;
@@ -488,11 +551,97 @@ serfail:
         if (rc < 0)
           return -errno;
       }
-    }  while(0);
+    }  while(rc == -EINTR);
 
     return rc;
   }
 
+  // returns total length of the frame at the head of the buffer,
+  // 0 if it can't be told (yet) from the bytes received so far
+  // expect is the length hint passed to recvFrame()
+  virtual size_t frameLength(const uint8_t buf[], size_t len, size_t expect) {
+    return expect;
+  }
+
+  // receives a frame: waits for the first byte within receive timeout,
+  // then gathers bytes until the frame is complete. While frameLength()
+  // knows the frame length, fragments are reassembled until the receive
+  // timeout expires; otherwise the frame ends when the buffer is full or
+  // the line stays silent for gap usecs
+  // returns received length or -errno
+  virtual ssize_t recvFrame(uint8_t buf[], size_t size, size_t expect, useconds_t gap) {
+    struct pollfd pfd;
+    struct timespec timeout, now, deadline;
+    size_t len = 0, flen = 0;
+    ssize_t rc;
+
+    if (m_fd < 0)
+      return -ENXIO;
+    if (size == 0)
+      return -ENOBUFS;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += m_timeout_recv.tv_sec;
+    deadline.tv_nsec += m_timeout_recv.tv_usec * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (len < size) {
+      if ((len > 0) && (flen == 0)) { // unknown length, wait for silence
+        timeout.tv_sec = gap / 1000000;
+        timeout.tv_nsec = (long)(gap % 1000000) * 1000L;
+      } else { // wait until the deadline
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+        timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (timeout.tv_nsec < 0) {
+          timeout.tv_sec--;
+          timeout.tv_nsec += 1000000000L;
+        }
+        if (timeout.tv_sec < 0)
+          break;
+      }
+
+      pfd.fd = m_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if ((rc = ppoll(&pfd, 1, &timeout, NULL)) < 0) {
+        if (errno == EINTR)
+          continue;
+        rc = -errno;
+        perror ("ppoll");
+        return rc;
+      } else if (rc == 0) { // timeout or silence
+        break;
+      }
+
+      rc = read(m_fd, buf + len, size - len);
+      if (rc < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        return -errno;
+      } else if (rc == 0) { // peer closed
+        if (len == 0)
+          return -ECONNRESET;
+        break;
+      }
+      if (len == 0)
+        clock_gettime(CLOCK_MONOTONIC, &m_rxstart);
+      len += rc;
+
+      flen = frameLength(buf, len, expect);
+      if (flen && len >= flen)
+        break;
+    }
+
+    if (len == 0)
+      return -ETIMEDOUT;
+
+    return len;
+  }
+
   virtual void setTimeout(int ms, timeout_t sel) {
     struct timeval tv;
     tv.tv_sec = (time_t)ms / 1000;
@@ -504,15 +653,30 @@ serfail:
       memcpy(&m_timeout_recv, &tv, sizeof(m_timeout_recv));
   }
 
+  virtual int getTimeout(timeout_t sel) {
+    return tv2ms((sel & TIMEOUT_SEND) ? m_timeout_send : m_timeout_recv);
+  }
+
   virtual linktype_t getLinkType() { return m_type; }
 
+  // single character transmission time for serial links, usecs
+  // 0 if the link has no character timing
+  virtual useconds_t getCharTime() { return m_chartime; }
+
+  // CLOCK_MONOTONIC time the first byte of the last frame was recv'd
+  virtual void getRecvStart(struct timespec &ts) { ts = m_rxstart; }
+
   static const char *linkTypeStr(linktype_t type) {
-    const char* linktypestr[SOCKET + 1] = { "none", "serial", "socket" };
-    if (type > SOCKET) return "N/A";
+    const char* linktypestr[MBTCP + 1] = { "none", "serial", "socket", "modbus-tcp" };
+    if (type > MBTCP) return "N/A";
     return linktypestr[type];
   }
 
 private:
+  static int tv2ms(const struct timeval &tv) {
+    return (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+  }
+
   // following code parts are from apcupsd software
   /*
    * Creates socket of specified address family and makes it non-blocking
@@ -598,11 +762,14 @@ private:
   // apcupsd code parts ends here
 
   int m_fd;
+  bool m_owner;
   linktype_t m_type;
   std::string m_addrstr;
   std::string m_confstr;
   struct timeval m_timeout_send;
   struct timeval m_timeout_recv;
+  useconds_t m_chartime;
+  struct timespec m_rxstart;
 };
 
 #endif /* _LINK_H */
@@ -4,12 +4,18 @@
 #include <cstdint>
 #include <cstring>
 #include <cerrno>
+#include <ctime>
+#include <deque>
 #include <unistd.h>
 
 #ifdef MBDEBUG
 #  include "util.h"
 #endif
 #include "link.h"
+#include "clock.h"
+#include "crc16.h"
+#include "iostats.h"
+#include "trace.h"
 
 typedef uint8_t devaddr_t;
 typedef uint16_t regaddr_t;
@@ -22,12 +28,201 @@ class mbRTU : public Link {
 public:
   mbRTU():  m_devaddr(def_devaddr)
           , m_recvdelay(10000)
+          , m_tid(0)
+          , m_trace(NULL)
+          , m_clock(&Clock::system())
+          , m_retry(defRetry())
 #ifdef MBDEBUG
           , m_debug(false)
 #endif
   {
   }
 
+  virtual ~mbRTU() {
+    while (!m_queue.empty()) {
+      delete m_queue.front();
+      m_queue.pop_front();
+    }
+  }
+
+  // asynchronous transaction, queued on the link and run in order
+  class Xfer {
+  public:
+    Xfer() : slen(0), expect(0), tid(0), sent(false), framed(false), idempotent(true),
+             sendt({ 0, 0 }), rxstart({ 0, 0 }) {}
+
+    virtual ~Xfer() {}
+
+    // len is recv'd payload length (excl. CRC), returns the result
+    virtual int reply(uint8_t rbuf[], size_t len) { return (int)len; }
+
+    // called once with the result or -errno, then the transaction is deleted
+    virtual void complete(int rc) = 0;
+
+    uint8_t sbuf[max_msglen_val]; // request payload, room for CRC
+    size_t slen;                  // request payload length (excl. CRC)
+    size_t expect;                // reply payload length (excl. CRC), 0 if unknown
+    uint16_t tid;
+    bool sent;
+    bool framed;                  // sbuf has CRC already
+    bool idempotent;              // may be sent again if it fails
+    struct timespec deadline;     // device clock
+    struct timespec sendt;        // request written
+    struct timespec rxstart;      // first reply byte recv'd, zero if unknown
+  };
+
+  // queues the transaction which is owned by the link from now on
+  virtual int submit(Xfer *x) {
+    if ((x->slen == 0) || (x->slen + 2 > max_msglen)) {
+      delete x;
+      return -EMSGSIZE;
+    }
+
+    m_queue.push_back(x);
+
+    return 0;
+  }
+
+  virtual size_t queued() { return m_queue.size(); }
+
+  // transaction at the head of the queue, NULL if none
+  virtual Xfer *ioHead() { return m_queue.empty() ? NULL : m_queue.front(); }
+
+  // sends head transaction, reply is due within receive timeout
+  virtual ssize_t ioStart(uint16_t tid) {
+    Xfer *x = ioHead();
+    struct timespec t0;
+    ssize_t ret;
+    int ms;
+
+    if (x == NULL)
+      return -ENOENT;
+
+    x->tid = tid;
+    m_clock->now(t0);
+    if ((ret = sendRequest(x->sbuf, x->slen, tid, x->framed)) < 0)
+      return ret;
+    m_clock->now(x->sendt);
+    m_stats.send.record(IOStats::elapsed(t0, x->sendt));
+
+    ms = getTimeout(Link::TIMEOUT_RECV);
+    x->deadline = x->sendt;
+    x->deadline.tv_sec += ms / 1000;
+    x->deadline.tv_nsec += ms % 1000 * 1000000L;
+    if (x->deadline.tv_nsec >= 1000000000L) {
+      x->deadline.tv_sec++;
+      x->deadline.tv_nsec -= 1000000000L;
+    }
+    x->sent = true;
+
+    return ret;
+  }
+
+  // completes head transaction with recv'd frame of len bytes,
+  // or with -errno in len when frame is NULL
+  virtual void ioFinish(uint8_t frame[], ssize_t len) {
+    Xfer *x = ioHead();
+    uint64_t crcerrors = m_stats.crcerrors;
+    int rc;
+
+    if (x == NULL)
+      return;
+    m_queue.pop_front();
+
+    rc = ioResult(x, frame, len);
+    ioAccount(x, frame != NULL, rc, crcerrors);
+
+    x->complete(rc);
+    delete x;
+  }
+
+  // runs head transaction on own link, blocks until it's complete,
+  // failed attempts of idempotent transactions are retried, see setRetry()
+  // returns number of completed transactions
+  virtual int runIO() {
+    uint8_t fbuf[max_msglen + mbap_len];
+    Xfer *x = ioHead();
+    retry_t used = { 0, 0, 0, 0 };
+    useconds_t backoff = m_retry.backoff;
+    uint64_t crcerrors;
+    size_t expect;
+    ssize_t ret;
+    int rc;
+
+    if (x == NULL)
+      return 0;
+
+    expect = x->expect;
+    if (expect)
+      expect += (getLinkType() == Link::MBTCP) ? mbap_len : 2;
+
+    while (true) {
+      crcerrors = m_stats.crcerrors;
+      ret = transfer(x, fbuf, sizeof(fbuf), expect);
+      rc = ioResult(x, (ret >= 0) ? fbuf : NULL, ret);
+      if ((rc >= 0) || !x->idempotent || !shouldRetry(rc, used, backoff))
+        break;
+
+      // failed attempt counts as a transaction of its own
+      ioAccount(x, ret >= 0, rc, crcerrors);
+      x->sent = false;
+      x->rxstart.tv_sec = x->rxstart.tv_nsec = 0;
+      m_stats.retries++;
+    }
+
+    m_queue.pop_front();
+    ioAccount(x, ret >= 0, rc, crcerrors);
+    x->complete(rc);
+    delete x;
+
+    return 1;
+  }
+
+  virtual int reOpen() {
+    m_stats.reopens++;
+    return Link::reOpen();
+  }
+
+  // retries of a failed blocking transaction by the kind of error:
+  // CRC errors and short or malformed replies are sent again at once,
+  // timeouts after a pause doubling each time. A dead link, or one still
+  // failing when those are used up, is reopened before the last tries.
+  // Transactions run by Reactor are not retried
+  typedef struct {
+    unsigned int resends;  // sent again at once
+    unsigned int backoffs; // sent again after a pause
+    useconds_t backoff;    // first pause, usecs
+    unsigned int reopens;  // link reopened, then sent again
+  } retry_t;
+
+  virtual void setRetry(const retry_t &retry) { m_retry = retry; }
+
+  virtual const retry_t &getRetry() { return m_retry; }
+
+  static const retry_t &defRetry() {
+    static const retry_t retry = { 2, 2, 20000, 1 };
+    return retry;
+  }
+
+  // transaction statistics of the device
+  virtual const IOStats &getStats() { return m_stats; }
+
+  virtual void resetStats() { m_stats.reset(); }
+
+  // frames are recorded to the opened trace, NULL stops recording
+  virtual void setTrace(Trace *trace) { m_trace = trace; }
+
+  virtual Trace *getTrace() { return m_trace; }
+
+  // time source of the transaction timing, the system clock by default,
+  // Reactor needs the system clock for the deadlines
+  virtual void setClock(Clock &clock) { m_clock = &clock; }
+
+  virtual Clock &getClock() { return *m_clock; }
+
+  // the caller retried a failed operation
+  virtual void countRetry() { m_stats.retries++; }
+
   virtual int setAddress(devaddr_t devaddr) {
     if ((devaddr < min_devaddr) || (devaddr > max_devaddr))
       return -EINVAL;
@@ -39,8 +234,21 @@ public:
 
   virtual devaddr_t getAddress() { return m_devaddr; }
 
+  // silence gap which terminates a reply on links without character timing
   virtual void setRecvDelay(useconds_t delay) { m_recvdelay = delay; }
 
+  // inter-frame silence which terminates a reply, usecs
+  virtual useconds_t frameGap() {
+    useconds_t chartime = getCharTime();
+
+    if (chartime == 0)
+      return m_recvdelay;
+
+    // 3.5 characters, fixed 1.75 ms above 19200 baud
+    chartime = chartime * 35 / 10;
+    return (chartime < 1750) ? 1750 : chartime;
+  }
+
 #ifdef MBDEBUG
   virtual void setDebug(bool on) { m_debug = on; }
 
@@ -51,37 +259,25 @@ public:
   // if -EPROTO is returned, first byte in the buffer would be recv'd modbus error
   virtual ssize_t readHoldingRegisters(regaddr_t firstreg, uint16_t cnt,
                                     uint8_t buf[], size_t size) {
-    ssize_t ret;
-    size_t slen;
-    uint8_t sbuf[8], rbuf[max_msglen];
+    uint8_t sbuf[8];
 
     if (size == 0)
       return -ENOBUFS;
 
-    slen = IOheader(sbuf, OP_READAO, firstreg, (int16_t)cnt);
-    ret = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf));
-    if (ret < 0)
-      return ret;
-    if (ret < 3)
-      return -ENODATA;
-    if (rbuf[0] != m_devaddr)
-      return -EFAULT;
-    if (rbuf[1] == ERR_READAO) {
-      buf[0] = rbuf[2];
-      return -EPROTO;
-    }
-    if (rbuf[1] != OP_READAO)
-      return -ENOMSG;
-    slen = (size_t)ret;
-    ret = (ssize_t)rbuf[2];
-    if ((size_t)(ret + 3) != slen)
-      return -ENODATA;
-    if ((size_t)ret > size)
-      return -ENOBUFS;
+    return readReply(sbuf, IOheader(sbuf, OP_READAO, firstreg, (int16_t)cnt),
+                     cnt, buf, size);
+  }
 
-    memcpy(buf, rbuf + 3, ret);
+  // same as readHoldingRegisters() for input registers
+  virtual ssize_t readInputRegisters(regaddr_t firstreg, uint16_t cnt,
+                                     uint8_t buf[], size_t size) {
+    uint8_t sbuf[8];
 
-    return ret;
+    if (size == 0)
+      return -ENOBUFS;
+
+    return readReply(sbuf, IOheader(sbuf, OP_READAI, firstreg, (int16_t)cnt),
+                     cnt, buf, size);
   }
 
   // returns 0 on success, -protocol error or +modbus error
@@ -91,7 +287,7 @@ public:
     uint8_t sbuf[8], rbuf[8];
 
     slen = IOheader(sbuf, OP_WRITE1AO, reg, val);
-    rc = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf));
+    rc = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf), 6);
     if (rc < 0)
       return rc;
     if (rc < 3)
@@ -108,28 +304,69 @@ public:
     return 0;
   }
 
+  // vals are cnt big-endian register values
+  // returns 0 on success, -protocol error or +modbus error
+  virtual int presetMultipleRegisters(regaddr_t firstreg, uint16_t cnt, const uint8_t vals[]) {
+    int rc;
+    size_t slen;
+    uint8_t sbuf[max_msglen], rbuf[8];
+
+    if ((cnt == 0) || (cnt > max_writecnt) || (7 + 2 * (size_t)cnt + 2 > max_msglen))
+      return -EMSGSIZE;
+
+    slen = IOheader(sbuf, OP_WRITEAO, firstreg, (int16_t)cnt);
+    sbuf[slen++] = (uint8_t)(2 * cnt);
+    memcpy(sbuf + slen, vals, 2 * (size_t)cnt);
+    slen += 2 * (size_t)cnt;
+
+    rc = (int)doIO(sbuf, slen, rbuf, sizeof(rbuf), 6);
+    if (rc < 0)
+      return rc;
+    if (rc < 3)
+      return -ENODATA;
+    if (rbuf[0] != m_devaddr)
+      return -EFAULT;
+    if (rbuf[1] == ERR_WRITEAO)
+      return (int)rbuf[2];
+    if (rbuf[1] != OP_WRITEAO)
+      return -ENOMSG;
+    if ((rc != 6) || memcmp(rbuf + 2, sbuf + 2, 4) != 0) // addr + code + reg[2] + cnt[2]
+      return -ENODATA;
+
+    return 0;
+  }
+
+  // writes wcnt registers from vals, then reads rcnt registers to buf,
+  // in one transaction, returns as readHoldingRegisters()
+  virtual ssize_t readWriteMultipleRegisters(regaddr_t rreg, uint16_t rcnt,
+                                             regaddr_t wreg, uint16_t wcnt, const uint8_t vals[],
+                                             uint8_t buf[], size_t size) {
+    uint8_t sbuf[max_msglen];
+    size_t slen;
+
+    if (size == 0)
+      return -ENOBUFS;
+    if ((wcnt == 0) || (wcnt > max_rwcnt) || (11 + 2 * (size_t)wcnt + 2 > max_msglen))
+      return -EMSGSIZE;
+
+    slen = IOheader(sbuf, OP_RWAO, rreg, (int16_t)rcnt);
+    sbuf[slen++] = (uint8_t)((wreg >> 8) & 0xFF); sbuf[slen++] = (uint8_t)(wreg & 0xFF);
+    sbuf[slen++] = (uint8_t)((wcnt >> 8) & 0xFF); sbuf[slen++] = (uint8_t)(wcnt & 0xFF);
+    sbuf[slen++] = (uint8_t)(2 * wcnt);
+    memcpy(sbuf + slen, vals, 2 * (size_t)wcnt);
+    slen += 2 * (size_t)wcnt;
+
+    return readReply(sbuf, slen, rcnt, buf, size);
+  }
+
   static devaddr_t defAddress() { return def_devaddr; }
   static devaddr_t minAddress() { return min_devaddr; }
   static devaddr_t maxAddress() { return max_devaddr; }
   static uint16_t CRC16(const uint8_t buf[], size_t len) {
-    uint16_t crc = 0xFFFF;
-
     if(len == 0)
       return 0;
 
-    while (len--) {
-      crc ^= (uint16_t)*buf;
-      for(int i = 0; i < 8; i++) {
-        if (crc & 1) {
-          crc >>= 1;
-          crc ^= 0xA001;
-        } else
-          crc >>= 1;
-      }
-      buf++;
-    }
-
-    return crc;
+    return ::CRC16::calc(buf, len);
   }
 
   // len is length of payload in the frame (excl. CRC)
@@ -141,6 +378,44 @@ public:
     return len;
   }
 
+  // returns total reply frame length, from MBAP header on Modbus TCP links
+  virtual size_t frameLength(const uint8_t buf[], size_t len, size_t expect) {
+    if (getLinkType() == Link::MBTCP) {
+      if (len < mbap_len)
+        return 0;
+      return mbap_len + ((size_t)buf[4] << 8 | buf[5]);
+    }
+
+    return replyLength(buf, len, expect);
+  }
+
+  // returns total RTU reply frame length (inc. CRC) from function code and byte count,
+  // expect is used for replies which can't be told by their header
+  virtual size_t replyLength(const uint8_t buf[], size_t len, size_t expect) {
+    if (len < 2)
+      return 0;
+    if (buf[1] & 0x80) // exception: addr + code + error
+      return 3 + 2;
+    if (expect)
+      return expect;
+
+    switch (buf[1]) {
+    case OP_READAO: // addr + code + count + data
+    case OP_READAI:
+    case OP_RWAO:
+      if (len < 3)
+        return 0;
+      return 3 + buf[2] + 2;
+    case OP_WRITE1AO: // addr + code + reg[2] + val[2]
+    case OP_WRITEAO:  // addr + code + reg[2] + cnt[2]
+      return 6 + 2;
+    default:
+      break;
+    }
+
+    return 0;
+  }
+
   // len is full length of the frame (inc. CRC)
   // returns payload length on match (excl. CRC), -1 if no match
   static ssize_t checkCRC(const uint8_t buf[], size_t len) {
@@ -160,11 +435,23 @@ protected:
   typedef enum {
     OP_READAO = 0x03,
     ERR_READAO = OP_READAO | 0x80,
+    OP_READAI = 0x04,
+    ERR_READAI = OP_READAI | 0x80,
     OP_WRITE1AO = 0x06,
-    ERR_WRITE1AO = OP_WRITE1AO | 0x80
+    ERR_WRITE1AO = OP_WRITE1AO | 0x80,
+    OP_WRITEAO = 0x10,
+    ERR_WRITEAO = OP_WRITEAO | 0x80,
+    OP_RWAO = 0x17,
+    ERR_RWAO = OP_RWAO | 0x80
   } opcode_t;
 
+  // register counts the standard allows per request
+  static const uint16_t max_writecnt = 123;
+  static const uint16_t max_rwcnt = 121;
+
   static const size_t max_msglen = max_msglen_val;
+  // Modbus TCP header: transaction[2] + protocol[2] + length[2]
+  static const size_t mbap_len = 6;
   static const devaddr_t def_devaddr = def_devaddr_val;
   static const devaddr_t min_devaddr = min_devaddr_val;
   static const devaddr_t max_devaddr = max_devaddr_val;
@@ -179,44 +466,295 @@ protected:
     return (ptr - buf);
   }
 
+  // runs queued transactions until rc, set by the completion,
+  // is no longer -EINPROGRESS, qrc is the result of queuing
+  virtual int wait(int qrc, int &rc) {
+    if (qrc < 0)
+      return qrc;
+
+    while ((rc == -EINPROGRESS) && runIO());
+
+    return rc;
+  }
+
   // len is total send payload length (excl. CRC)
+  // expect is expected reply payload length (excl. CRC), 0 if unknown
   // returns recv'd payload length (excl. CRC)
-  virtual ssize_t doIO(uint8_t sbuf[], size_t len, uint8_t rbuf[], size_t size) {
+  virtual ssize_t doIO(uint8_t sbuf[], size_t len, uint8_t rbuf[], size_t size,
+                       size_t expect = 0) {
+    CopyXfer *x;
+    int rc = -EINPROGRESS;
+
+    if (len + 2 > max_msglen)
+      return -EMSGSIZE;
+
+    x = new CopyXfer(rbuf, size, rc);
+    memcpy(x->sbuf, sbuf, len);
+    x->slen = len;
+    x->expect = expect;
+
+    return wait(submit(x), rc);
+  }
+
+  // runs read request of cnt registers, any of the read function codes,
+  // and copies the data of the reply, see readHoldingRegisters()
+  ssize_t readReply(uint8_t sbuf[], size_t slen, uint16_t cnt, uint8_t buf[], size_t size) {
+    uint8_t rbuf[max_msglen];
+    ssize_t ret;
+
+    ret = doIO(sbuf, slen, rbuf, sizeof(rbuf), 3 + 2 * (size_t)cnt);
+    if (ret < 0)
+      return ret;
+    if (ret < 3)
+      return -ENODATA;
+    if (rbuf[0] != m_devaddr)
+      return -EFAULT;
+    if (rbuf[1] == (sbuf[1] | 0x80)) {
+      buf[0] = rbuf[2];
+      return -EPROTO;
+    }
+    if (rbuf[1] != sbuf[1])
+      return -ENOMSG;
+    slen = (size_t)ret;
+    ret = (ssize_t)rbuf[2];
+    if ((size_t)(ret + 3) != slen)
+      return -ENODATA;
+    if ((size_t)ret > size)
+      return -ENOBUFS;
+
+    memcpy(buf, rbuf + 3, ret);
+
+    return ret;
+  }
+
+public:
+  // transaction halves for event driven I/O
+  // requests may be pipelined on Modbus TCP links, replies are matched by tid
+  // which is ignored on RTU links
+
+  // sbuf should have room for CRC, len is send payload length (excl. CRC)
+  // framed is set if CRC is in sbuf already
+  // returns sent frame length
+  virtual ssize_t sendRequest(uint8_t sbuf[], size_t len, uint16_t tid = 0, bool framed = false) {
+    uint8_t tbuf[max_msglen + mbap_len];
+    uint8_t *fbuf = sbuf;
     ssize_t ret;
 
     if (len == 0)
       return -EINVAL;
 
-    len = addCRC(sbuf, len);
+    if (getLinkType() == Link::MBTCP) {
+      if (len > max_msglen)
+        return -EMSGSIZE;
+      fbuf = tbuf;
+      tbuf[0] = (uint8_t)(tid >> 8); tbuf[1] = (uint8_t)(tid & 0xFF);
+      tbuf[2] = tbuf[3] = 0; // Modbus protocol
+      tbuf[4] = (uint8_t)(len >> 8); tbuf[5] = (uint8_t)(len & 0xFF);
+      memcpy(tbuf + mbap_len, sbuf, len);
+      len += mbap_len;
+    } else if (framed)
+      len += 2;
+    else
+      len = addCRC(sbuf, len);
 #ifdef MBDEBUG
     if (m_debug)
-      Util::printbuf(sbuf, len, "sent");
+      Util::printbuf(fbuf, len, "sent");
 #endif
 
-    flush(Link::QUEUE_IN);
-    ret = send(sbuf, len);
-    if (ret < 0)
-      return ret;
-    if ((size_t)ret == len) {
-      usleep(m_recvdelay);
-      if ((ret = recv(rbuf, size)) >= 0) {
+    ret = send(fbuf, len);
+    if ((ret >= 0) && ((size_t)ret != len))
+      return -EIO;
+    if (m_trace && (ret >= 0))
+      m_trace->record(Trace::REC_TX, fbuf, len);
+
+    return ret;
+  }
+
+  // len is full length of recv'd frame (inc. CRC or MBAP header)
+  // frame is stripped down to RTU payload in place
+  // returns payload length (excl. CRC), -ESTALE on transaction id mismatch
+  virtual ssize_t checkReply(uint8_t rbuf[], size_t len, uint16_t tid = 0) {
+    ssize_t ret;
+
+    if (m_trace)
+      m_trace->record(Trace::REC_RX, rbuf, len);
 #ifdef MBDEBUG
-        if (m_debug)
-          Util::printbuf(rbuf, ret, "recv'd");
+    if (m_debug)
+      Util::printbuf(rbuf, len, "recv'd");
 #endif
-        if (ret > 2)
-          ret = checkCRC(rbuf, ret);
-        else
-          ret = -ENODATA;
-      }
+    if (getLinkType() == Link::MBTCP) {
+      if (len < mbap_len + 2)
+        return -ENODATA;
+      if ((rbuf[2] != 0) || (rbuf[3] != 0) ||
+          (((size_t)rbuf[4] << 8 | rbuf[5]) != len - mbap_len))
+        return -EBADMSG;
+      if (frameTID(rbuf) != tid)
+        return -ESTALE;
+      len -= mbap_len;
+      memmove(rbuf, rbuf + mbap_len, len);
+      return len;
     }
 
+    if (len <= 2)
+      return -ENODATA;
+
+    if ((ret = checkCRC(rbuf, len)) < 0)
+      m_stats.crcerrors++;
+
     return ret;
   }
 
+  // transaction id of Modbus TCP frame
+  static uint16_t frameTID(const uint8_t buf[]) {
+    return (uint16_t)((uint16_t)buf[0] << 8 | buf[1]);
+  }
+
+protected:
+  typedef enum {
+    RETRY_NONE = 0,
+    RETRY_RESEND,
+    RETRY_BACKOFF,
+    RETRY_REOPEN
+  } retryclass_t;
+
+  // how a failed transaction is retried
+  virtual retryclass_t retryClass(int rc) {
+    switch (rc) {
+    case -EIO:       // CRC
+    case -ENODATA:   // short reply
+    case -EBADMSG:   // malformed MBAP header
+    case -ESTALE:
+      return RETRY_RESEND;
+    case -ETIMEDOUT:
+      return RETRY_BACKOFF;
+    case -EBADF:
+    case -ENXIO:     // closed by a failed reopen
+    case -EPIPE:
+    case -ECONNRESET:
+    case -ENOTCONN:
+      return RETRY_REOPEN;
+    default:
+      break;
+    }
+
+    return RETRY_NONE;
+  }
+
 private:
+  // sends head transaction and receives its reply into fbuf
+  // returns recv'd frame length or -errno
+  ssize_t transfer(Xfer *x, uint8_t fbuf[], size_t size, size_t expect) {
+    ssize_t ret;
+
+    flush(Link::QUEUE_IN);
+    if ((ret = ioStart(++m_tid)) < 0)
+      return ret;
+
+    do { // skip replies to timed out transactions
+      if ((ret = recvFrame(fbuf, size, expect, frameGap())) < 0)
+        return ret;
+      getRecvStart(x->rxstart);
+    } while ((getLinkType() == Link::MBTCP) && (ret >= 2) && (frameTID(fbuf) != x->tid));
+
+    return ret;
+  }
+
+  // result of the transaction from recv'd frame, or -errno in len when frame is NULL
+  int ioResult(Xfer *x, uint8_t frame[], ssize_t len) {
+    int rc = (int)len;
+
+    if (frame) {
+      rc = (int)checkReply(frame, len, x->tid);
+      if (rc >= 0)
+        rc = x->reply(frame, rc);
+    }
+
+    return rc;
+  }
+
+  // records attempt of the transaction, crcerrors is the count before it
+  void ioAccount(Xfer *x, bool framed, int rc, uint64_t crcerrors) {
+    struct timespec now;
+
+    if (x->sent) {
+      if (m_trace && !framed)
+        m_trace->recordError(rc);
+      m_clock->now(now);
+      m_stats.transactions++;
+      if (framed) {
+        // first byte is stamped by the link in real time
+        if ((x->rxstart.tv_sec || x->rxstart.tv_nsec) && !m_clock->simulated()) {
+          m_stats.turnaround.record(IOStats::elapsed(x->sendt, x->rxstart));
+          m_stats.receive.record(IOStats::elapsed(x->rxstart, now));
+        }
+        m_stats.total.record(IOStats::elapsed(x->sendt, now));
+      }
+    }
+    if (rc == -ETIMEDOUT)
+      m_stats.timeouts++;
+    else if ((rc < 0) && (m_stats.crcerrors == crcerrors))
+      m_stats.errors++;
+  }
+
+  // uses up the retry the error calls for, escalating to reopen
+  // returns true if the transaction is to be sent again
+  bool shouldRetry(int rc, retry_t &used, useconds_t &backoff) {
+    switch (retryClass(rc)) {
+    case RETRY_RESEND:
+      if (used.resends < m_retry.resends) {
+        used.resends++;
+        return true;
+      }
+      break;
+    case RETRY_BACKOFF:
+      if (used.backoffs < m_retry.backoffs) {
+        used.backoffs++;
+        m_clock->usleep(backoff);
+        backoff *= 2;
+        return true;
+      }
+      break;
+    case RETRY_REOPEN:
+      break;
+    default:
+      return false;
+    }
+
+    if (used.reopens >= m_retry.reopens)
+      return false;
+    used.reopens++;
+
+    return reOpen() == 0;
+  }
+
+  // copies reply payload to the caller's buffer
+  class CopyXfer : public Xfer {
+  public:
+    CopyXfer(uint8_t buf[], size_t size, int &rc) : m_buf(buf), m_size(size), m_rc(rc) {}
+
+    int reply(uint8_t rbuf[], size_t len) {
+      if (len > m_size)
+        return -ENOBUFS;
+      memcpy(m_buf, rbuf, len);
+      return (int)len;
+    }
+
+    void complete(int rc) { m_rc = rc; }
+
+  private:
+    uint8_t *m_buf;
+    size_t m_size;
+    int &m_rc;
+  };
+
+  std::deque<Xfer *> m_queue;
+  IOStats m_stats;
   devaddr_t m_devaddr;
   useconds_t m_recvdelay;
+  uint16_t m_tid;
+  Trace *m_trace;
+  Clock *m_clock;
+  retry_t m_retry;
 #ifdef MBDEBUG
   bool m_debug;
 #endif
@@ -0,0 +1,404 @@
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "KP184.h"
+
+// runs queued transactions of many opened KP184 devices from a single thread
+// and optionally polls their status: completions are delivered via callbacks
+// and the status is then available from the device cache:
+// getOutput(out, true), getVoltage(voltage, true) etc.
+// asynchronous operations (KP184::*Async) of added devices are run as well,
+// synchronous ones shouldn't be used on them
+// devices attached to one connection (see Link::attach) share a channel,
+// requests are serialized on RTU links and pipelined on Modbus TCP links
+// a device should be removed and added again after it's reopened
+class Reactor {
+public:
+  // rc is status length or -errno
+  typedef void (*callback_t)(KP184 &dev, int rc, void *ctx);
+
+  Reactor() :
+    m_epfd(epoll_create1(EPOLL_CLOEXEC)),
+    m_window(8)
+  {
+  }
+
+  ~Reactor() {
+    for (size_t i = 0; i < m_devs.size(); i++)
+      delete m_devs[i];
+    for (size_t i = 0; i < m_chans.size(); i++)
+      delete m_chans[i];
+    if (m_epfd >= 0)
+      ::close(m_epfd);
+  }
+
+  // runs asynchronous operations of the device
+  int add(KP184 &dev) {
+    return add(dev, { 0, 0 }, NULL, NULL);
+  }
+
+  // polls the device status every interval, zero polls back to back
+  int add(KP184 &dev, const struct timespec &interval, callback_t cb, void *ctx) {
+    channel_t *ch;
+    device_t *d;
+    int fd = dev.getHandle();
+
+    if (m_epfd < 0)
+      return -EBADF;
+    if (fd < 0)
+      return -ENXIO;
+    if (find(dev) >= 0)
+      return -EEXIST;
+
+    if ((ch = channel(fd)) == NULL) {
+      struct epoll_event ev;
+
+      ch = new channel_t();
+      ch->fd = fd;
+      ch->mbtcp = (dev.getLinkType() == Link::MBTCP);
+      ch->hup = false;
+      ch->tid = 0;
+      ch->inflight = 0;
+      ch->rlen = 0;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = ch;
+      if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        int rc = -errno;
+        delete ch;
+        return rc;
+      }
+      m_chans.push_back(ch);
+    }
+
+    d = new device_t();
+    d->dev = &dev;
+    d->ch = ch;
+    d->interval = interval;
+    d->cb = cb;
+    d->ctx = ctx;
+    d->busy = false;
+    d->polling = false;
+    clock_gettime(CLOCK_MONOTONIC, &d->due);
+
+    ch->devs.push_back(d);
+    m_devs.push_back(d);
+
+    return 0;
+  }
+
+  // queued transactions of the device are failed with -ECANCELED
+  int remove(KP184 &dev) {
+    int idx = find(dev);
+    device_t *d;
+    channel_t *ch;
+
+    if (idx < 0)
+      return -ENOENT;
+
+    d = m_devs[idx];
+    ch = d->ch;
+    if (d->busy)
+      ch->inflight--;
+    while (dev.ioHead()) // polling transaction refers to d
+      dev.ioFinish(NULL, -ECANCELED);
+    for (size_t i = 0; i < ch->devs.size(); i++) {
+      if (ch->devs[i] == d) {
+        ch->devs.erase(ch->devs.begin() + i);
+        break;
+      }
+    }
+    if (ch->devs.empty()) {
+      for (size_t i = 0; i < m_chans.size(); i++) {
+        if (m_chans[i] == ch) {
+          m_chans.erase(m_chans.begin() + i);
+          break;
+        }
+      }
+      if (!ch->hup)
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, ch->fd, NULL);
+      delete ch;
+    }
+    delete d;
+    m_devs.erase(m_devs.begin() + idx);
+
+    return 0;
+  }
+
+  size_t count() { return m_devs.size(); }
+
+  // maximum requests in flight per Modbus TCP connection
+  void setWindow(size_t window) { m_window = window ? window : 1; }
+
+  // starts due requests and waits up to timeout ms for replies
+  // returns number of completed transactions or -errno
+  int runOnce(int timeout) {
+    struct epoll_event events[max_events];
+    struct timespec now, wake;
+    int n, done = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wake.tv_sec = now.tv_sec + timeout / 1000;
+    wake.tv_nsec = now.tv_nsec + timeout % 1000 * 1000000L;
+    normalize(wake);
+
+    for (size_t i = 0; i < m_devs.size(); i++) {
+      device_t *d = m_devs[i];
+
+      if (d->busy && (cmp(d->dev->ioHead()->deadline, now) <= 0)) {
+        finish(d, NULL, -ETIMEDOUT);
+        if (!d->ch->mbtcp) // drop partial reply
+          d->ch->rlen = 0;
+        done++;
+      }
+      if (d->cb && !d->polling && (cmp(d->due, now) <= 0))
+        poll(d, now);
+      if (!d->busy && d->dev->ioHead() && idle(d->ch))
+        done += start(d);
+
+      if (d->busy) {
+        if (cmp(d->dev->ioHead()->deadline, wake) < 0)
+          wake = d->dev->ioHead()->deadline;
+      } else if (d->dev->ioHead() && idle(d->ch)) {
+        wake = now;
+      } else if (d->cb && !d->polling && (cmp(d->due, wake) < 0)) {
+        wake = d->due;
+      }
+    }
+
+    timeout = (int)((wake.tv_sec - now.tv_sec) * 1000 +
+                    (wake.tv_nsec - now.tv_nsec + 999999L) / 1000000L);
+    if (timeout < 0)
+      timeout = 0;
+
+    n = epoll_wait(m_epfd, events, max_events, timeout);
+    if (n < 0)
+      return (errno == EINTR) ? done : -errno;
+
+    for (int i = 0; i < n; i++)
+      done += input((channel_t *)events[i].data.ptr);
+
+    return done;
+  }
+
+  // runs until stop is set
+  int run(volatile int &stop) {
+    int rc = 0;
+
+    while (!stop && (rc >= 0))
+      rc = runOnce(1000);
+
+    return (rc < 0) ? rc : 0;
+  }
+
+private:
+  static const int max_events = 64;
+
+  struct device_t;
+
+  typedef struct {
+    int fd;
+    bool mbtcp;
+    bool hup;
+    uint16_t tid;
+    size_t inflight;
+    std::vector<struct device_t *> devs;
+    size_t rlen;
+    uint8_t rbuf[512];
+  } channel_t;
+
+  struct device_t {
+    KP184 *dev;
+    channel_t *ch;
+    struct timespec interval;
+    struct timespec due;
+    callback_t cb;
+    void *ctx;
+    bool busy;    // head transaction is sent
+    bool polling; // status request is queued
+  };
+
+  int find(KP184 &dev) {
+    for (size_t i = 0; i < m_devs.size(); i++)
+      if (m_devs[i]->dev == &dev)
+        return (int)i;
+    return -1;
+  }
+
+  channel_t *channel(int fd) {
+    for (size_t i = 0; i < m_chans.size(); i++)
+      if (m_chans[i]->fd == fd)
+        return m_chans[i];
+    return NULL;
+  }
+
+  // channel can take one more request
+  bool idle(channel_t *ch) {
+    return ch->inflight < (ch->mbtcp ? m_window : 1);
+  }
+
+  static void normalize(struct timespec &ts) {
+    while (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+  }
+
+  static int cmp(const struct timespec &a, const struct timespec &b) {
+    if (a.tv_sec != b.tv_sec)
+      return (a.tv_sec > b.tv_sec) ? 1 : -1;
+    if (a.tv_nsec != b.tv_nsec)
+      return (a.tv_nsec > b.tv_nsec) ? 1 : -1;
+    return 0;
+  }
+
+  // completes transaction in flight
+  void finish(device_t *d, uint8_t frame[], ssize_t len) {
+    d->busy = false;
+    d->ch->inflight--;
+    d->dev->ioFinish(frame, len);
+  }
+
+  static void polled(KP184 &dev, int rc, void *ctx) {
+    device_t *d = (device_t *)ctx;
+
+    d->polling = false;
+    d->cb(dev, rc, d->ctx);
+  }
+
+  void poll(device_t *d, const struct timespec &now) {
+    // next due time, skip missed periods
+    d->due.tv_sec += d->interval.tv_sec;
+    d->due.tv_nsec += d->interval.tv_nsec;
+    normalize(d->due);
+    if (cmp(d->due, now) < 0)
+      d->due = now;
+
+    d->polling = (d->dev->getStatusAsync(polled, d) == 0);
+  }
+
+  // sends head transaction, returns number of failed ones
+  int start(device_t *d) {
+    channel_t *ch = d->ch;
+    ssize_t rc;
+
+    if (ch->hup) {
+      d->dev->ioFinish(NULL, -ECONNRESET);
+      return 1;
+    }
+
+    if (!ch->mbtcp) // nothing else is expected
+      ch->rlen = 0;
+
+    if ((rc = d->dev->ioStart(++ch->tid)) < 0) {
+      d->dev->ioFinish(NULL, rc);
+      return 1;
+    }
+
+    d->busy = true;
+    ch->inflight++;
+
+    return 0;
+  }
+
+  // stops watching the link which is gone, fails transactions in flight
+  int hangup(channel_t *ch) {
+    int done = 0;
+
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, ch->fd, NULL);
+    ch->hup = true;
+    ch->rlen = 0;
+    for (size_t i = 0; i < ch->devs.size(); i++) {
+      if (ch->devs[i]->busy) {
+        finish(ch->devs[i], NULL, -ECONNRESET);
+        done++;
+      }
+    }
+
+    return done;
+  }
+
+  // returns device the frame at the head of channel buffer is for
+  device_t *owner(channel_t *ch) {
+    for (size_t i = 0; i < ch->devs.size(); i++) {
+      device_t *d = ch->devs[i];
+      if (d->busy && (!ch->mbtcp || (d->dev->ioHead()->tid == KP184::frameTID(ch->rbuf))))
+        return d;
+    }
+    return NULL;
+  }
+
+  // expected reply frame length of transaction in flight
+  size_t expect(device_t *d) {
+    size_t len = d->dev->ioHead()->expect;
+
+    if (len == 0)
+      return 0;
+    return len + (d->ch->mbtcp ? 6 : 2);
+  }
+
+  // returns number of completed transactions
+  int input(channel_t *ch) {
+    struct timespec rxtime;
+    int done = 0;
+    ssize_t rc;
+
+    rc = read(ch->fd, ch->rbuf + ch->rlen, sizeof(ch->rbuf) - ch->rlen);
+    clock_gettime(CLOCK_MONOTONIC, &rxtime);
+    if (rc < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN))
+        return 0;
+      return hangup(ch);
+    } else if (rc == 0) {
+      return hangup(ch);
+    }
+    ch->rlen += rc;
+
+    while (ch->rlen > 0) {
+      device_t *d;
+      size_t flen;
+
+      if (ch->mbtcp && (ch->rlen < 6)) // need transaction id
+        break;
+      d = owner(ch);
+      if (d && !(d->dev->ioHead()->rxstart.tv_sec || d->dev->ioHead()->rxstart.tv_nsec))
+        d->dev->ioHead()->rxstart = rxtime;
+      flen = ch->devs[0]->dev->frameLength(ch->rbuf, ch->rlen, d ? expect(d) : 0);
+      if ((flen == 0) && (d == NULL)) { // stray bytes
+        ch->rlen = 0;
+        break;
+      }
+      if ((flen == 0) || (ch->rlen < flen)) {
+        if (ch->rlen == sizeof(ch->rbuf)) // garbage
+          ch->rlen = 0;
+        break;
+      }
+
+      if (d) {
+        finish(d, ch->rbuf, flen);
+        done++;
+      }
+
+      memmove(ch->rbuf, ch->rbuf + flen, ch->rlen - flen);
+      ch->rlen -= flen;
+    }
+
+    return done;
+  }
+
+  int m_epfd;
+  size_t m_window;
+  std::vector<device_t *> m_devs;
+  std::vector<channel_t *> m_chans;
+};
+
+#endif /* _REACTOR_H */
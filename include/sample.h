@@ -0,0 +1,99 @@
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <cstdint>
+#include <ctime>
+#include <type_traits>
+
+// one measurement in the fixed point the device reports it in, small and
+// trivially copyable so buffers of long runs stay compact, converted to
+// double only to be shown
+struct Sample {
+  typedef enum {
+    FLAG_OUT = 0x01,  // load was on
+    FLAG_GAP = 0x02   // samples were lost before this one
+  } flag_t;
+
+  uint32_t dt;        // us since the previous sample
+  int32_t mv;
+  int32_t ma;
+  uint8_t flags;
+  uint8_t mode;       // KP184::mode_t
+  uint16_t reserved;
+
+  double volts() const { return (double)mv / 1000.0; }
+  double amps() const { return (double)ma / 1000.0; }
+  double watts() const { return (double)mv * (double)ma / 1e6; }
+  bool out() const { return (flags & FLAG_OUT) != 0; }
+
+  // us from one time to another, saturated to fit dt
+  static uint32_t delta(const struct timespec &from, const struct timespec &to) {
+    int64_t us = (int64_t)(to.tv_sec - from.tv_sec) * 1000000 +
+                 (to.tv_nsec - from.tv_nsec) / 1000;
+    return (us < 0) ? 0 : (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+  }
+};
+
+static_assert(std::is_trivially_copyable<Sample>::value, "Sample is copied as bytes");
+static_assert(sizeof(Sample) == 16, "Sample layout");
+
+// charge and energy of a sample stream, trapezoidal between samples
+// charge is summed exactly in 2 mA us, energy in 4 mA mV us
+class SampleIntegrator {
+public:
+  // what's summed so far, to carry it over to another run
+  typedef struct {
+    int64_t charge;
+    double energy;
+    uint64_t time;
+  } state_t;
+
+  SampleIntegrator() { reset(); }
+
+  void reset() {
+    m_charge = 0;
+    m_energy = 0.0;
+    m_time = 0;
+    m_started = false;
+  }
+
+  // integrates from the previous sample, the first one only starts
+  void add(const Sample &s) {
+    if (m_started) {
+      int64_t ma = (int64_t)s.ma + m_prev.ma;
+
+      m_charge += ma * s.dt;
+      m_energy += (double)(ma * ((int64_t)s.mv + m_prev.mv)) * s.dt;
+      m_time += s.dt;
+    }
+    m_prev = s;
+    m_started = true;
+  }
+
+  double ah() const { return (double)m_charge / 2.0 / 3.6e12; }
+
+  double wh() const { return m_energy / 4.0 / 3.6e15; }
+
+  // us integrated over
+  uint64_t time() const { return m_time; }
+
+  state_t getState() const { return { m_charge, m_energy, m_time }; }
+
+  // goes on from the state, the next sample only starts again,
+  // nothing is integrated over the time between the runs
+  void setState(const state_t &st) {
+    m_charge = st.charge;
+    m_energy = st.energy;
+    m_time = st.time;
+    m_started = false;
+  }
+
+private:
+  Sample m_prev;
+  int64_t m_charge;
+  double m_energy;
+  uint64_t m_time;
+  bool m_started;
+};
+
+#endif /* _SAMPLE_H */
@@ -0,0 +1,356 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// binary wire trace (link with -pthread)
+//
+// file header, little endian:
+//   magic[8] "KP184TRC", version u16, link type u8, reserved u8,
+//   reserved u32, start time u64 (CLOCK_REALTIME, us)
+// records:
+//   type u8, length u16, time delta u32 (us since the previous record), data
+// REC_ERR data is -errno as s32, REC_TIME data is absolute time u64 (us since start)
+// and is only written when the delta doesn't fit
+
+class Trace {
+public:
+  typedef enum {
+    REC_TX = 0,   // request frame as sent
+    REC_RX = 1,   // reply frame as recv'd
+    REC_ERR = 2,  // transaction failed without a frame
+    REC_TIME = 3
+  } rectype_t;
+
+  static const size_t header_len = 24;
+  static const size_t rechdr_len = 7;
+
+  Trace() :
+    m_fd(-1),
+    m_active(0),
+    m_busy(false),
+    m_stop(false),
+    m_dropped(0),
+    m_last(0)
+  {
+  }
+
+  ~Trace() {
+    close();
+  }
+
+  // creates the trace file and starts the flusher
+  int open(const char path[], uint8_t linktype) {
+    uint8_t hdr[header_len];
+    struct timespec ts;
+    int rc;
+
+    if (m_fd >= 0)
+      return -EALREADY;
+
+    if ((m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+      return -errno;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "KP184TRC", 8);
+    put16(hdr + 8, version);
+    hdr[10] = linktype;
+    put64(hdr + 16, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    if ((rc = writeAll(hdr, sizeof(hdr))) < 0) {
+      ::close(m_fd);
+      m_fd = -1;
+      return rc;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &m_start);
+    m_path = path;
+    m_last = 0;
+    m_dropped = 0;
+    m_active = 0;
+    m_busy = false;
+    m_stop = false;
+    for (int i = 0; i < 2; i++) {
+      m_buf[i].reserve(buf_size);
+      m_buf[i].clear();
+    }
+    m_thread = std::thread(&Trace::flusher, this);
+
+    return 0;
+  }
+
+  // writes out whatever is buffered
+  void close() {
+    if (m_fd < 0)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_stop = true;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+    ::close(m_fd);
+    m_fd = -1;
+    m_path.clear();
+  }
+
+  bool isOpen() { return m_fd >= 0; }
+
+  const char *getPath() { return m_path.c_str(); }
+
+  // records lost because the disk didn't keep up
+  uint64_t dropped() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_dropped;
+  }
+
+  // never blocks on the disk, drops the record if both buffers are full
+  void record(rectype_t type, const uint8_t data[], size_t len) {
+    struct timespec now;
+    uint64_t us, delta;
+    uint8_t hdr[rechdr_len + 8];
+
+    if (len > UINT16_MAX)
+      return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (uint64_t)(now.tv_sec - m_start.tv_sec) * 1000000 +
+         (now.tv_nsec - m_start.tv_nsec) / 1000;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (m_fd < 0)
+      return;
+
+    delta = us - m_last;
+    if (delta > UINT32_MAX) {
+      hdr[0] = REC_TIME;
+      put16(hdr + 1, 8);
+      put32(hdr + 3, 0);
+      put64(hdr + 7, us);
+      if (!append(hdr, rechdr_len + 8, NULL, 0))
+        return;
+      delta = 0;
+    }
+
+    hdr[0] = (uint8_t)type;
+    put16(hdr + 1, (uint16_t)len);
+    put32(hdr + 3, (uint32_t)delta);
+    if (append(hdr, rechdr_len, data, len))
+      m_last = us;
+  }
+
+  void recordError(int rc) {
+    uint8_t data[4];
+
+    put32(data, (uint32_t)rc);
+    record(REC_ERR, data, sizeof(data));
+  }
+
+  static void put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+  static void put32(uint8_t *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+  static void put64(uint8_t *p, uint64_t v) { put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32)); }
+  static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+  static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+  static uint64_t get64(const uint8_t *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+
+  static const uint16_t version = 1;
+
+private:
+  static const size_t buf_size = 64 * 1024;
+  static constexpr int flush_ms = 1000;
+
+  // lock is held
+  bool append(const uint8_t hdr[], size_t hlen, const uint8_t data[], size_t len) {
+    std::vector<uint8_t> *buf = &m_buf[m_active];
+
+    if (buf->size() + hlen + len > buf_size) {
+      if (m_busy) { // both are full
+        m_dropped++;
+        return false;
+      }
+      m_active ^= 1;
+      m_busy = true;
+      m_cond.notify_one();
+      buf = &m_buf[m_active];
+    }
+
+    buf->insert(buf->end(), hdr, hdr + hlen);
+    if (len)
+      buf->insert(buf->end(), data, data + len);
+
+    return true;
+  }
+
+  int writeAll(const uint8_t buf[], size_t len) {
+    while (len > 0) {
+      ssize_t rc = write(m_fd, buf, len);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        return -errno;
+      }
+      buf += rc;
+      len -= (size_t)rc;
+    }
+
+    return 0;
+  }
+
+  // writes full buffers out as they come, the partial one every flush_ms
+  void flusher() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    sigset_t all;
+
+    // signals, timer ones in particular, are for the threads waiting for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (true) {
+      std::vector<uint8_t> *buf;
+      bool stop;
+
+      if (!m_busy && !m_stop)
+        m_cond.wait_for(lock, std::chrono::milliseconds(flush_ms));
+      stop = m_stop;
+
+      if (!m_busy) { // take the partial one
+        if (m_buf[m_active].empty()) {
+          if (stop)
+            break;
+          continue;
+        }
+        m_active ^= 1;
+        m_busy = true;
+      }
+      buf = &m_buf[m_active ^ 1];
+
+      lock.unlock();
+      writeAll(buf->data(), buf->size());
+      buf->clear();
+      lock.lock();
+      m_busy = false;
+    }
+  }
+
+  int m_fd;
+  std::string m_path;
+  struct timespec m_start;
+  std::vector<uint8_t> m_buf[2]; // active one is being filled, the other written
+  int m_active;
+  bool m_busy;                   // the other buffer is waiting to be written
+  bool m_stop;
+  uint64_t m_dropped;
+  uint64_t m_last;               // time of the last record, us since start
+  std::mutex m_lock;
+  std::condition_variable m_cond;
+  std::thread m_thread;
+};
+
+// sequential reader of trace files
+class TraceReader {
+public:
+  typedef struct {
+    Trace::rectype_t type;
+    uint64_t time;      // us since start of the trace
+    const uint8_t *data;
+    size_t len;
+  } record_t;
+
+  TraceReader() : m_pos(0), m_time(0), m_linktype(0), m_start(0) {}
+
+  int open(const char path[]) {
+    uint8_t chunk[65536];
+    ssize_t rc;
+    int fd;
+
+    if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return -errno;
+
+    m_data.clear();
+    while ((rc = read(fd, chunk, sizeof(chunk))) != 0) {
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        rc = -errno;
+        ::close(fd);
+        return (int)rc;
+      }
+      m_data.insert(m_data.end(), chunk, chunk + rc);
+    }
+    ::close(fd);
+
+    if ((m_data.size() < Trace::header_len) || (memcmp(m_data.data(), "KP184TRC", 8) != 0))
+      return -EBADMSG;
+    if (Trace::get16(&m_data[8]) != Trace::version)
+      return -EPROTONOSUPPORT;
+    m_linktype = m_data[10];
+    m_start = Trace::get64(&m_data[16]);
+    rewind();
+
+    return 0;
+  }
+
+  void rewind() {
+    m_pos = Trace::header_len;
+    m_time = 0;
+  }
+
+  uint8_t getLinkType() { return m_linktype; }
+
+  // CLOCK_REALTIME the trace was started at, us
+  uint64_t getStartTime() { return m_start; }
+
+  // 1 if rec is filled, 0 at the end, -EBADMSG on truncated record
+  int next(record_t &rec) {
+    while (true) {
+      size_t len;
+
+      if (m_pos == m_data.size())
+        return 0;
+      if (m_pos + Trace::rechdr_len > m_data.size())
+        return -EBADMSG;
+
+      len = Trace::get16(&m_data[m_pos + 1]);
+      if (m_pos + Trace::rechdr_len + len > m_data.size())
+        return -EBADMSG;
+
+      rec.type = (Trace::rectype_t)m_data[m_pos];
+      rec.data = &m_data[m_pos + Trace::rechdr_len];
+      rec.len = len;
+      m_time += Trace::get32(&m_data[m_pos + 3]);
+      m_pos += Trace::rechdr_len + len;
+
+      if (rec.type == Trace::REC_TIME) {
+        if (len == 8)
+          m_time = Trace::get64(rec.data);
+        continue;
+      }
+      rec.time = m_time;
+
+      return 1;
+    }
+  }
+
+private:
+  std::vector<uint8_t> m_data;
+  size_t m_pos;
+  uint64_t m_time;
+  uint8_t m_linktype;
+  uint64_t m_start;
+};
+
+#endif /* _TRACE_H */
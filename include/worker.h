@@ -0,0 +1,395 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "KP184.h"
+
+// dedicated I/O thread owning an opened KP184 device (link with -pthread)
+// any thread may submit commands, they are queued lock-free and run
+// by the worker in order; the worker polls the status every interval
+// and publishes the latest one as a snapshot readers never block on
+// the device shouldn't be used directly while the worker is running
+class KP184Worker {
+public:
+  typedef struct {
+    uint32_t seq;          // number of the sample, 0 if none yet
+    int rc;                // 0 or -errno of the last status read
+    bool out;
+    KP184::mode_t mode;
+    double voltage;
+    double current;
+    struct timespec time;  // device clock time the values were read at
+  } status_t;
+
+  // called from the worker thread with 0 or -errno
+  typedef void (*done_t)(int rc, void *ctx);
+
+  KP184Worker(KP184 &dev) :
+    m_dev(dev),
+    m_evfd(-1),
+    m_running(false),
+    m_stop(false),
+    m_interval(250),
+    m_head(&m_stub),
+    m_tail(&m_stub),
+    m_seq(0),
+    m_samples(0)
+  {
+    m_stub.next.store(NULL, std::memory_order_relaxed);
+    for (size_t i = 0; i < snap_words; i++)
+      m_snap[i].store(0, std::memory_order_relaxed);
+  }
+
+  ~KP184Worker() {
+    stop();
+  }
+
+  // status poll interval, ms, 0 to poll on demand only
+  void setInterval(unsigned int ms) { m_interval.store(ms, std::memory_order_relaxed); }
+
+  int start() {
+    if (m_running.load(std::memory_order_relaxed))
+      return -EALREADY;
+    if ((m_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+      return -errno;
+
+    m_stop.store(false, std::memory_order_relaxed);
+    m_running.store(true, std::memory_order_release);
+    m_thread = std::thread(&KP184Worker::run, this);
+
+    return 0;
+  }
+
+  // waits for the command in progress, queued ones are failed with -ECANCELED
+  // producers should be done by now, commands are refused from now on
+  void stop() {
+    if (!m_running.load(std::memory_order_relaxed))
+      return;
+
+    m_running.store(false, std::memory_order_release);
+    m_stop.store(true, std::memory_order_release);
+    wake();
+    m_thread.join();
+    ::close(m_evfd);
+    m_evfd = -1;
+  }
+
+  // asynchronous commands, return 0 if queued or -errno, done may be NULL
+  int setOutputAsync(bool on, done_t done, void *ctx) {
+    cmd_t *c = command(CMD_OUTPUT, done, ctx);
+    c->on = on;
+    return push(c);
+  }
+
+  int setModeAsync(KP184::mode_t mode, done_t done, void *ctx) {
+    cmd_t *c = command(CMD_MODE, done, ctx);
+    c->mode = mode;
+    return push(c);
+  }
+
+  int setModeValueAsync(KP184::mode_t mode, double value, done_t done, void *ctx) {
+    cmd_t *c = command(CMD_MODEVALUE, done, ctx);
+    c->mode = mode;
+    c->value = value;
+    return push(c);
+  }
+
+  // reads the status out of poll interval
+  int refreshAsync(done_t done, void *ctx) {
+    return push(command(CMD_STATUS, done, ctx));
+  }
+
+  // synchronous commands, block the calling thread until run by the worker
+  int setOutput(bool on) {
+    Waiter w;
+    return w.wait(setOutputAsync(on, Waiter::done, &w));
+  }
+
+  int setMode(KP184::mode_t mode) {
+    Waiter w;
+    return w.wait(setModeAsync(mode, Waiter::done, &w));
+  }
+
+  int setModeValue(KP184::mode_t mode, double value) {
+    Waiter w;
+    return w.wait(setModeValueAsync(mode, value, Waiter::done, &w));
+  }
+
+  int refresh() {
+    Waiter w;
+    return w.wait(refreshAsync(Waiter::done, &w));
+  }
+
+  // latest status snapshot, wait-free for the worker, readers retry while
+  // it's being updated; seq tells whether the sample is new
+  void getStatus(status_t &st) {
+    uint64_t buf[snap_words];
+    uint32_t s1, s2;
+
+    do {
+      s1 = m_seq.load(std::memory_order_acquire);
+      if (s1 & 1) { // update in progress
+        std::this_thread::yield();
+        continue;
+      }
+      for (size_t i = 0; i < snap_words; i++)
+        buf[i] = m_snap[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s2 = m_seq.load(std::memory_order_relaxed);
+    } while ((s1 & 1) || (s1 != s2));
+
+    memcpy(&st, buf, sizeof(st));
+  }
+
+private:
+  typedef enum {
+    CMD_OUTPUT,
+    CMD_MODE,
+    CMD_MODEVALUE,
+    CMD_STATUS
+  } cmdtype_t;
+
+  typedef struct cmd {
+    std::atomic<struct cmd *> next;
+    cmdtype_t type;
+    bool on;
+    KP184::mode_t mode;
+    double value;
+    done_t done;
+    void *ctx;
+  } cmd_t;
+
+  // completion of synchronous commands
+  class Waiter {
+  public:
+    Waiter() : m_rc(0) { sem_init(&m_sem, 0, 0); }
+
+    ~Waiter() { sem_destroy(&m_sem); }
+
+    int wait(int qrc) {
+      if (qrc < 0)
+        return qrc;
+      while ((sem_wait(&m_sem) < 0) && (errno == EINTR));
+      return m_rc;
+    }
+
+    static void done(int rc, void *ctx) {
+      Waiter *w = (Waiter *)ctx;
+
+      w->m_rc = rc;
+      sem_post(&w->m_sem);
+    }
+
+  private:
+    sem_t m_sem;
+    int m_rc;
+  };
+
+  static const size_t snap_words = (sizeof(status_t) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  cmd_t *command(cmdtype_t type, done_t done, void *ctx) {
+    cmd_t *c = new cmd_t();
+
+    c->type = type;
+    c->done = done;
+    c->ctx = ctx;
+
+    return c;
+  }
+
+  void wake() {
+    uint64_t one = 1;
+    ssize_t rc = write(m_evfd, &one, sizeof(one));
+    (void)rc; // counter overflow means it's signaled anyway
+  }
+
+  // multiple producers: Vyukov's intrusive MPSC queue
+  int push(cmd_t *c) {
+    if (!m_running.load(std::memory_order_acquire)) {
+      delete c;
+      return -ESRCH;
+    }
+
+    enqueue(c);
+    wake();
+
+    return 0;
+  }
+
+  void enqueue(cmd_t *c) {
+    cmd_t *prev;
+
+    c->next.store(NULL, std::memory_order_relaxed);
+    prev = m_head.exchange(c, std::memory_order_acq_rel);
+    prev->next.store(c, std::memory_order_release);
+  }
+
+  // single consumer, NULL if empty or a producer is mid-push
+  cmd_t *pop() {
+    cmd_t *tail = m_tail;
+    cmd_t *next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &m_stub) {
+      if (next == NULL)
+        return NULL;
+      m_tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      m_tail = next;
+      return tail;
+    }
+    if (tail != m_head.load(std::memory_order_acquire))
+      return NULL; // the producer wakes us once linked
+
+    enqueue(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+      m_tail = next;
+      return tail;
+    }
+
+    return NULL;
+  }
+
+  // single writer seqlock
+  void publish(const status_t &st) {
+    uint64_t buf[snap_words] = {};
+    uint32_t seq = m_seq.load(std::memory_order_relaxed);
+
+    memcpy(buf, &st, sizeof(st));
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < snap_words; i++)
+      m_snap[i].store(buf[i], std::memory_order_relaxed);
+    m_seq.store(seq + 2, std::memory_order_release);
+  }
+
+  int sample() {
+    status_t st;
+
+    memset(&st, 0, sizeof(st));
+    getStatus(st); // keep the last good values on error
+    // a read of its own, the getters would reuse a status within the TTL
+    if ((st.rc = m_dev.refreshStatus(0)) == 0) {
+      m_dev.getOutput(st.out, true);
+      m_dev.getMode(st.mode, true);
+      m_dev.getVoltage(st.voltage, true);
+      m_dev.getCurrent(st.current, true);
+      m_dev.getStatusTime(st.time);
+      st.seq = ++m_samples;
+    }
+    publish(st);
+
+    return st.rc;
+  }
+
+  int execute(cmd_t *c) {
+    switch (c->type) {
+    case CMD_OUTPUT: return m_dev.setOutput(c->on);
+    case CMD_MODE: return m_dev.setMode(c->mode);
+    case CMD_MODEVALUE: return m_dev.setModeValue(c->mode, c->value);
+    case CMD_STATUS: return sample();
+    }
+
+    return -EINVAL;
+  }
+
+  static bool tsless(const struct timespec &a, const struct timespec &b) {
+    return (a.tv_sec < b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec < b.tv_nsec));
+  }
+
+  static void tsadd(struct timespec &ts, unsigned int ms) {
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+  }
+
+  void run() {
+    struct pollfd pfd = { m_evfd, POLLIN, 0 };
+    struct timespec due, now;
+    uint64_t cnt;
+    cmd_t *c;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    while (!m_stop.load(std::memory_order_acquire)) {
+      unsigned int interval = m_interval.load(std::memory_order_relaxed);
+      bool pending = false;
+      int timeout = -1;
+
+      while ((c = pop()) != NULL) {
+        int rc = execute(c);
+        if (c->done)
+          c->done(rc, c->ctx);
+        delete c;
+        if (m_stop.load(std::memory_order_acquire))
+          break;
+        // don't let a command flood starve the status
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (interval && !tsless(now, due)) {
+          pending = true;
+          break;
+        }
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (interval) {
+        if (!tsless(now, due)) {
+          sample();
+          // next due time, skip missed periods
+          tsadd(due, interval);
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          if (tsless(due, now))
+            due = now;
+        }
+        timeout = (int)((due.tv_sec - now.tv_sec) * 1000 +
+                        (due.tv_nsec - now.tv_nsec + 999999L) / 1000000L);
+        if (timeout < 0)
+          timeout = 0;
+      }
+
+      if (pending)
+        timeout = 0;
+      if (::poll(&pfd, 1, timeout) > 0) {
+        ssize_t rc = read(m_evfd, &cnt, sizeof(cnt));
+        (void)rc;
+      }
+    }
+
+    // whatever is left is either queued or being pushed right now
+    while ((c = pop()) != NULL) {
+      if (c->done)
+        c->done(-ECANCELED, c->ctx);
+      delete c;
+    }
+  }
+
+  KP184 &m_dev;
+  int m_evfd;
+  std::atomic<bool> m_running;
+  std::atomic<bool> m_stop;
+  std::atomic<unsigned int> m_interval;
+  std::thread m_thread;
+  cmd_t m_stub;
+  std::atomic<cmd_t *> m_head; // producers
+  cmd_t *m_tail;               // consumer
+  std::atomic<uint32_t> m_seq;
+  std::atomic<uint64_t> m_snap[snap_words];
+  uint32_t m_samples;
+};
+
+#endif /* _WORKER_H */
@@ -0,0 +1,264 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <vector>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "battmodel.h"
+#include "util.h"
+
+// fits BatteryModel to a discharge log written by battery and checks
+// the fit by running the logged currents through the model
+
+using namespace std;
+
+static const double defconf_peukert = 1.15;
+static const double transient_max = 300.0; // s of the load start the relaxation is fitted to
+static const double ocv_window = 0.02;     // state of charge averaged around curve points
+
+typedef struct {
+  double time;
+  double voltage;
+  double current;
+} sample_t;
+
+static const double ocv_grid[] = {
+  0.0, 0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9 };
+
+// No.;time;voltage;unit;current;unit
+static int readLog(const char path[], vector<sample_t> &log)
+{
+  char line[256];
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return -errno;
+
+  while (fgets(line, sizeof(line), f)) {
+    sample_t s;
+    unsigned long no;
+
+    if (sscanf(line, "%lu;%lf;%lf;V;%lf;A", &no, &s.time, &s.voltage, &s.current) == 4)
+      log.push_back(s);
+  }
+  fclose(f);
+
+  return log.empty() ? -ENODATA : 0;
+}
+
+// least squares fit of y = c0 + c1 * x1 + c2 * x2, returns residual sum of squares
+static double regress3(const vector<double> &y, const vector<double> &x1,
+                       const vector<double> &x2, double c[3])
+{
+  double a[3][4] = {};
+  double rss = 0.0;
+
+  for (size_t i = 0; i < y.size(); i++) {
+    double x[3] = { 1.0, x1[i], x2[i] };
+    for (int r = 0; r < 3; r++) {
+      for (int k = 0; k < 3; k++)
+        a[r][k] += x[r] * x[k];
+      a[r][3] += x[r] * y[i];
+    }
+  }
+
+  // Gauss-Jordan with partial pivoting
+  for (int p = 0; p < 3; p++) {
+    int best = p;
+    for (int r = p + 1; r < 3; r++)
+      if (fabs(a[r][p]) > fabs(a[best][p]))
+        best = r;
+    for (int k = 0; k < 4; k++) {
+      double t = a[p][k];
+      a[p][k] = a[best][k];
+      a[best][k] = t;
+    }
+    if (fabs(a[p][p]) < 1e-12)
+      return INFINITY;
+    for (int r = 0; r < 3; r++) {
+      double f;
+      if (r == p)
+        continue;
+      f = a[r][p] / a[p][p];
+      for (int k = p; k < 4; k++)
+        a[r][k] -= f * a[p][k];
+    }
+  }
+  for (int r = 0; r < 3; r++)
+    c[r] = a[r][3] / a[r][r];
+
+  for (size_t i = 0; i < y.size(); i++) {
+    double e = y[i] - (c[0] + c[1] * x1[i] + c[2] * x2[i]);
+    rss += e * e;
+  }
+
+  return rss;
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-k exponent] [-o model] <log.csv>\n", prog);
+  printf(" -k: Peukert exponent, can't be told from a single rate [%g]\n", defconf_peukert);
+  printf(" -o: write model to the file [stdout]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *outpath = NULL;
+  double peukert = defconf_peukert;
+  vector<sample_t> log;
+  vector<BatteryModel::ocvpoint_t> ocv;
+  vector<double> soc, emf;
+  BatteryModel model;
+  size_t first, last;
+  double iref = 0.0, loadtime = 0.0, capacity = 0.0;
+  double r0, r1 = 0.0, tau = 0.0, q, v1, bestrss = INFINITY;
+  double err, rss = 0.0, maxerr = 0.0;
+  FILE *out = stdout;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "k:o:")) != -1) {
+    switch(op) {
+    case 'k':
+      if (Util::str2d(optarg, peukert) || (peukert < 1.0)) {
+        fprintf(stderr, "ERR Malformed exponent value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'o': outpath = optarg; break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc < 1) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  if ((rc = readLog(argv[0], log)) != 0) {
+    fprintf(stderr, "ERR Can't read %s: %s\n", argv[0], strerror(-rc));
+    return rc;
+  }
+
+  // load is on from the first sample with current to the last one
+  // the battery still gave voltage at, it might have been cut off after
+  for (first = 0; (first < log.size()) && (log[first].current <= 0.0); first++);
+  for (last = log.size(); (last > first) && ((log[last - 1].current <= 0.0) ||
+                                             (log[last - 1].voltage <= 0.0)); last--);
+  if ((first == 0) || (last - first < 10)) {
+    fprintf(stderr, "ERR Log needs rest samples followed by a discharge\n");
+    return -ENODATA;
+  }
+  last--;
+
+  for (size_t i = first + 1; i <= last; i++) {
+    double dt = log[i].time - log[i - 1].time;
+    iref += (log[i].current + log[i - 1].current) / 2.0 * dt;
+    loadtime += dt;
+  }
+  iref /= loadtime;
+
+  // relaxation: start of the load is V = a - b t - I r1 (1 - exp(-t / tau)),
+  // tau is searched, the rest is linear
+  for (double t = 1.0; t <= transient_max / 2.0; t *= 1.1) {
+    vector<double> y, x1, x2;
+    double c[3], s;
+
+    for (size_t i = first; (i <= last) && (log[i].time - log[first].time <= transient_max); i++) {
+      double dt = log[i].time - log[first].time;
+      y.push_back(log[i].voltage);
+      x1.push_back(dt);
+      x2.push_back(log[first].current * (1.0 - exp(-dt / t)));
+    }
+    if (y.size() < 4)
+      break;
+    s = regress3(y, x1, x2, c);
+    if ((s < bestrss) && (c[2] < 0.0)) {
+      bestrss = s;
+      tau = t;
+      r1 = -c[2];
+    }
+  }
+
+  // step from the rested battery to the first loaded sample
+  r0 = (log[0].voltage - log[first].voltage) / log[first].current;
+  if (r0 < 0.0)
+    r0 = 0.0;
+
+  // coulomb count with Peukert, open circuit voltage is what's left after
+  // taking back the drop over r0 and the RC pair
+  q = 0.0;
+  v1 = 0.0;
+  for (size_t i = first; i <= last; i++) {
+    if (i > first) {
+      double dt = log[i].time - log[i - 1].time;
+      double cur = (log[i].current + log[i - 1].current) / 2.0;
+      double k = (tau > 0.0) ? exp(-dt / tau) : 0.0;
+
+      q += cur * pow(cur / iref, peukert - 1.0) * dt / 3600.0;
+      v1 = v1 * k + cur * r1 * (1.0 - k);
+    }
+    soc.push_back(q);
+    emf.push_back(log[i].voltage + log[i].current * r0 + v1);
+  }
+  capacity = q;
+  for (size_t i = 0; i < soc.size(); i++)
+    soc[i] = 1.0 - soc[i] / capacity;
+
+  for (size_t g = 0; g < sizeof(ocv_grid) / sizeof(ocv_grid[0]); g++) {
+    double sum = 0.0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < soc.size(); i++)
+      if (fabs(soc[i] - ocv_grid[g]) <= ocv_window) {
+        sum += emf[i];
+        n++;
+      }
+    if (n)
+      ocv.push_back({ ocv_grid[g], sum / n });
+  }
+  ocv.push_back({ 1.0, log[0].voltage });
+
+  model.setCapacity(capacity);
+  model.setPeukert(peukert, iref);
+  model.setResistance(r0, r1, tau);
+  if ((rc = model.setOCV(ocv)) != 0) {
+    fprintf(stderr, "ERR Not enough data for the voltage curve\n");
+    return rc;
+  }
+
+  // logged currents through the model
+  model.reset();
+  for (size_t i = first; i <= last; i++) {
+    if (i > first)
+      model.step((log[i].current + log[i - 1].current) / 2.0, log[i].time - log[i - 1].time);
+    err = model.terminal(log[i].current) - log[i].voltage;
+    rss += err * err;
+    if (fabs(err) > fabs(maxerr))
+      maxerr = err;
+  }
+
+  if (outpath && ((out = fopen(outpath, "w")) == NULL)) {
+    fprintf(stderr, "ERR Can't write %s: %s\n", outpath, strerror(errno));
+    return -errno;
+  }
+  fprintf(out, "# fitted to %s, %.0f s at %.3f A mean\n", basename(argv[0]), loadtime, iref);
+  model.save(out);
+  if (out != stdout)
+    fclose(out);
+
+  fprintf(stderr, "samples %zu capacity %.3f Ah r0 %.4f Ohm r1 %.4f Ohm tau %.1f s\n",
+          last - first + 1, capacity, r0, r1, tau);
+  fprintf(stderr, "replayed voltage error rms %.4f V max %.4f V\n",
+          sqrt(rss / (last - first + 1)), maxerr);
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "battlog.h"
+#include "csvlog.h"
+#include "util.h"
+
+// converts binary logs of battery -b to the CSV battery writes otherwise,
+// whole or the part of the run between two times
+
+using namespace std;
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-m] [-f from] [-t to] [-o path] log\n", prog);
+  printf(" -m: print the start time and the settings of the run instead of samples\n");
+  printf(" -f: first sample at or after the time since the start, s [0]\n");
+  printf(" -t: last sample before the time since the start, s [end]\n");
+  printf(" -o: output CSV file name [stdout]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *outfile = NULL;
+  double from = 0.0, to = -1.0;
+  bool meta = false;
+  BattLogReader log;
+  BattLogReader::record_t rec;
+  CSVLog csv;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "mf:t:o:")) != -1) {
+    switch(op) {
+    case 'm': meta = true; break;
+    case 'f':
+      if (Util::str2d(optarg, from) || (from < 0.0)) {
+        fprintf(stderr, "ERR Malformed from time value\n");
+        return -EINVAL;
+      }
+      break;
+    case 't':
+      if (Util::str2d(optarg, to) || (to < 0.0)) {
+        fprintf(stderr, "ERR Malformed to time value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'o': outfile = optarg; break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  if ((rc = log.open(argv[optind])) != 0) {
+    fprintf(stderr, "ERR Can't read %s: %s\n", argv[optind], strerror(-rc));
+    return rc;
+  }
+  if (!log.complete())
+    fprintf(stderr, "%s wasn't closed, read up to the last block written\n", argv[optind]);
+
+  if (meta) {
+    time_t start = (time_t)(log.getStartTime() / 1000000);
+    char buf[32];
+
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("start=%s\nsamples=%llu\nblocks=%zu\n%s", buf,
+           (unsigned long long)log.samples(), log.blocks(), log.getMetadata().c_str());
+    return 0;
+  }
+
+  if ((rc = csv.open(outfile, false)) != 0) {
+    fprintf(stderr, "ERR Opening %s: %s\n", outfile ? outfile : "stdout", strerror(-rc));
+    return rc;
+  }
+  csv.setSync(0);
+
+  log.seek((uint64_t)(from * 1e6));
+  while (log.next(rec) > 0) {
+    if ((to >= 0.0) && (rec.us >= (uint64_t)(to * 1e6)))
+      break;
+    csv.push(rec.no, rec.us, rec.s);
+  }
+
+  if ((rc = csv.close()) != 0)
+    fprintf(stderr, "ERR Writing %s: %s\n", outfile ? outfile : "stdout", strerror(-rc));
+
+  return rc;
+}
@@ -0,0 +1,214 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "coro.h"
+#include "util.h"
+
+// discharges batteries on several devices concurrently,
+// each test is a straight-line coroutine run by one thread
+
+using namespace std;
+
+static const char *defconf_serial = "115200,8,N,1";
+static const unsigned int defconf_interval = 1000; // ms
+static const unsigned int defconf_retries = 5;
+
+typedef struct {
+  int no;
+  KP184 dev;
+  SampleIntegrator integ;
+} unit_t;
+
+typedef struct {
+  KP184::mode_t mode;
+  double load;
+  double vthres;
+  unsigned int interval;
+} params_t;
+
+static Task discharge(EventLoop &loop, unit_t &u, const params_t &p)
+{
+  struct timespec tstart, tsamp, tstat;
+  Sample smp;
+  int32_t vthres = (int32_t)(p.vthres * 1000.0 + 0.5); // mV
+  uint64_t t = 0; // us
+  unsigned int fails = 0;
+  int rc;
+
+  if ((rc = co_await loop.setOutput(u.dev, false)) ||
+      (rc = co_await loop.setMode(u.dev, p.mode)) ||
+      (rc = co_await loop.setModeValue(u.dev, p.mode, p.load)) ||
+      (rc = co_await loop.setOutput(u.dev, true))) {
+    fprintf(stderr, "%d: ERR setup failed: %s\n", u.no, strerror(-rc));
+    co_return rc;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &tstart);
+  tsamp = tstat = tstart;
+  while (true) {
+    // fixed cadence regardless of transaction time
+    tsamp.tv_sec += p.interval / 1000;
+    tsamp.tv_nsec += (p.interval % 1000) * 1000000L;
+    if (tsamp.tv_nsec >= 1000000000L) {
+      tsamp.tv_sec++;
+      tsamp.tv_nsec -= 1000000000L;
+    }
+    co_await loop.sleepUntil(tsamp);
+
+    if ((rc = co_await loop.getSample(u.dev, smp, tstat))) {
+      if (++fails < defconf_retries)
+        continue;
+      fprintf(stderr, "%d: ERR %s\n", u.no, strerror(-rc));
+      break;
+    }
+    fails = 0;
+
+    t += smp.dt;
+    u.integ.add(smp);
+    printf("%d,%.3f,%.3f,%.3f,%.4f,%.4f\n", u.no, t / 1e6, smp.volts(), smp.amps(),
+           u.integ.ah(), u.integ.wh());
+
+    if (!smp.out()) {
+      fprintf(stderr, "%d: load is off\n", u.no);
+      break;
+    }
+    if (smp.mv < vthres)
+      break;
+  }
+
+  if ((rc = co_await loop.setOutput(u.dev, false)))
+    fprintf(stderr, "%d: ERR failed to turn the load off: %s\n", u.no, strerror(-rc));
+
+  co_return rc;
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s <-l load> <-v Volt> [-B conf] [-i interval] <t|s|m>:link[@addr]...\n", prog);
+  printf(" -l: load mode and value: val[m]<A|R|W>\n");
+  printf(" -v: voltage threshold, V\n");
+  printf(" -B: serial configuration string [%s]\n", defconf_serial);
+  printf(" -i: sample interval, ms [%u]\n", defconf_interval);
+  printf(" device link is a TTY (t), socket (s) or Modbus TCP gateway (m)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *lconf = defconf_serial;
+  const char *sload = NULL, *svthres = NULL;
+  params_t p = { KP184::MODE_CC, 0.0, 0.0, defconf_interval };
+  vector<unit_t *> units;
+  EventLoop loop;
+  unsigned long ul;
+  int rc = 0, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "l:v:B:i:")) != -1) {
+    switch(op) {
+    case 'l': sload = optarg; break;
+    case 'v': svthres = optarg; break;
+    case 'B': lconf = optarg; break;
+    case 'i':
+      if ((Util::str2ul(optarg, ul) != 0) || (ul == 0)) {
+        fprintf(stderr, "ERR Malformed interval value\n");
+        return -EINVAL;
+      }
+      p.interval = (unsigned int)ul;
+      break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if ((sload == NULL) || (svthres == NULL) || (argc == 0)) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  Util::str2du(sload, p.load, sload);
+  if (strcasecmp(sload, "A") == 0)
+    p.mode = KP184::MODE_CC;
+  else if ((strcasecmp(sload, "R") == 0) ||
+           (strcasecmp(sload, "Ohm") == 0))
+    p.mode = KP184::MODE_CR;
+  else if (strcasecmp(sload, "W") == 0)
+    p.mode = KP184::MODE_CP;
+  else {
+    fprintf(stderr, "ERR Malformed load value\n");
+    return -EINVAL;
+  }
+
+  Util::str2du(svthres, p.vthres, svthres);
+  if ((*svthres != '\0') && (strcasecmp(svthres, "V") != 0)) {
+    fprintf(stderr, "ERR Malformed voltage threshold value\n");
+    return -EINVAL;
+  }
+
+  for (int i = 0; i < argc; i++) {
+    Link::linktype_t ltype;
+    char spec[256], *link, *addr;
+    unit_t *u;
+
+    strncpy(spec, argv[i], sizeof(spec) - 1);
+    spec[sizeof(spec) - 1] = '\0';
+    if ((strlen(spec) < 3) || (spec[1] != ':')) {
+      fprintf(stderr, "ERR Malformed device %s\n", argv[i]);
+      rc = -EINVAL;
+      break;
+    }
+    switch (spec[0]) {
+    case 't': ltype = Link::SERIAL; break;
+    case 's': ltype = Link::SOCKET; break;
+    case 'm': ltype = Link::MBTCP; break;
+    default:
+      fprintf(stderr, "ERR Unknown link type of %s\n", argv[i]);
+      rc = -EINVAL;
+      break;
+    }
+    if (rc)
+      break;
+    link = spec + 2;
+
+    u = new unit_t();
+    u->no = i;
+    units.push_back(u);
+    if ((addr = strrchr(link, '@')) != NULL) {
+      *addr++ = '\0';
+      if ((Util::str2ul(addr, ul) != 0) || (u->dev.setAddress((devaddr_t)ul) != 0)) {
+        fprintf(stderr, "ERR Device address range is %hhu .. %hhu\n",
+          u->dev.minAddress(), u->dev.maxAddress());
+        rc = -EINVAL;
+        break;
+      }
+    }
+    if ((rc = u->dev.open(ltype, link, lconf)) != 0) {
+      fprintf(stderr, "ERR Failed to open %s: %s\n", argv[i], strerror(-rc));
+      break;
+    }
+  }
+
+  if (rc == 0) {
+    printf("device,time,voltage,current,capacity,energy\n");
+    for (size_t i = 0; i < units.size(); i++)
+      loop.spawn(discharge(loop, *units[i], p));
+    if ((rc = loop.run()) < 0)
+      fprintf(stderr, "ERR Event loop failed: %s\n", strerror(-rc));
+    for (size_t i = 0; i < units.size(); i++)
+      fprintf(stderr, "%d: %.4f Ah %.4f Wh\n", units[i]->no, units[i]->integ.ah(), units[i]->integ.wh());
+  }
+
+  for (size_t i = 0; i < units.size(); i++)
+    delete units[i];
+
+  return rc;
+}
@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "crc16.h"
+#include "KP184.h"
+#include "util.h"
+
+// compares CRC16 engines on a large buffer and fixed request frame builds
+
+using namespace std;
+
+static const unsigned long defconf_size = 1 << 20;
+static const unsigned long defconf_rounds = 64;
+static const unsigned long frame_rounds = 10000000;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-s size] [-n rounds]\n", prog);
+  printf(" -s: buffer size, bytes [%lu]\n", defconf_size);
+  printf(" -n: rounds over the buffer [%lu]\n", defconf_rounds);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]);
+  unsigned long size = defconf_size, rounds = defconf_rounds;
+  vector<uint8_t> buf;
+  uint16_t ref, crc = 0;
+  volatile uint16_t sink = 0;
+  double t;
+  int op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "s:n:")) != -1) {
+    switch(op) {
+    case 's':
+      if ((Util::str2ul(optarg, size) != 0) || (size == 0)) {
+        fprintf(stderr, "ERR Malformed size value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'n':
+      if ((Util::str2ul(optarg, rounds) != 0) || (rounds == 0)) {
+        fprintf(stderr, "ERR Malformed rounds value\n");
+        return -EINVAL;
+      }
+      break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+
+  buf.resize(size);
+  srand(1);
+  for (size_t i = 0; i < size; i++)
+    buf[i] = (uint8_t)rand();
+  ref = CRC16::bitwise(buf.data(), size, CRC16::init);
+
+  printf("buffer %lu bytes, %lu rounds\n", size, rounds);
+  for (int id = CRC16::ENGINE_AUTO; id <= CRC16::ENGINE_CLMUL; id++) {
+    CRC16::engine_t eng = CRC16::engine((CRC16::engineid_t)id);
+    unsigned long n = rounds;
+
+    if (eng == NULL) {
+      printf("%-12s not supported\n", CRC16::engineStr((CRC16::engineid_t)id));
+      continue;
+    }
+    if (id == CRC16::ENGINE_BITWISE) // way too slow
+      n = (rounds + 7) / 8;
+
+    t = now();
+    for (unsigned long r = 0; r < n; r++)
+      crc = eng(buf.data(), size, CRC16::init);
+    t = now() - t;
+
+    printf("%-12s %04X %s %9.1f MB/s\n", CRC16::engineStr((CRC16::engineid_t)id),
+           crc, (crc == ref) ? "ok " : "BAD", (double)size * n / t / 1e6);
+  }
+
+  // status request of every poll: built and CRC'd vs precomputed
+  t = now();
+  for (unsigned long r = 0; r < frame_rounds; r++) {
+    uint8_t frame[8] = { (uint8_t)(r & 0x7F), 0x03, 0x03, 0x00, 0x00, 0x00 };
+    KP184::addCRC(frame, 6);
+    sink ^= frame[7];
+  }
+  t = now() - t;
+  printf("%-12s %9.1f ns/frame\n", "frame build", t / frame_rounds * 1e9);
+
+  t = now();
+  for (unsigned long r = 0; r < frame_rounds; r++) {
+    static constexpr KP184Frames frames = KP184Frames(0x03, 0x0300);
+    uint8_t frame[8];
+    memcpy(frame, frames.f[r & 0x7F], sizeof(frame));
+    sink ^= frame[7];
+  }
+  t = now() - t;
+  printf("%-12s %9.1f ns/frame\n", "frame copy", t / frame_rounds * 1e9);
+
+  return 0;
+}
@@ -0,0 +1,259 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "iostats.h"
+#include "util.h"
+
+// transaction throughput and latency of a link to a real or emulated device,
+// swept over baud rates and timeouts; replies are of known length, so they
+// end when complete and the receive timeout is what bounds the wait
+
+using namespace std;
+
+static const char *defconf_serial = "19200,8,N,1";
+static const unsigned long defconf_time = 5;
+static const unsigned long defconf_writes = 10;
+static const unsigned long unset = ULONG_MAX; // leave the driver default
+
+typedef enum {
+  WL_STATUS,
+  WL_WRITE,
+  WL_MIXED,
+  WL_MAX = WL_MIXED
+} workload_t;
+
+static const char *wlnames[WL_MAX + 1] = { "status", "write", "mixed" };
+
+typedef struct {
+  unsigned long ok;
+  unsigned long failed;
+  Histogram latency; // us, successful transactions
+} result_t;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// comma separated list of numbers
+static int str2list(const char str[], vector<unsigned long> &list)
+{
+  string s(str);
+  size_t pos = 0;
+
+  list.clear();
+  while (pos <= s.size()) {
+    size_t end = s.find(',', pos);
+    unsigned long val;
+
+    if (end == string::npos)
+      end = s.size();
+    if (Util::str2ul(s.substr(pos, end - pos).c_str(), val) != 0)
+      return -EINVAL;
+    list.push_back(val);
+    pos = end + 1;
+  }
+
+  return list.empty() ? -EINVAL : 0;
+}
+
+// serial configuration with baud rate replaced
+static string withBaud(const char conf[], unsigned long baud)
+{
+  const char *rest = strchr(conf, ',');
+
+  if (baud == unset)
+    return conf;
+  return to_string(baud) + (rest ? rest : "");
+}
+
+static void run(KP184 &dev, workload_t wl, unsigned long pct, double seconds, result_t &res)
+{
+  double start = now(), t0, t1 = start;
+  unsigned long n = 0, writes = 0;
+  bool out;
+  KP184::mode_t mode;
+  double voltage, current;
+
+  res.ok = res.failed = 0;
+  res.latency.reset();
+
+  do {
+    bool write = (wl == WL_WRITE) ||
+                 ((wl == WL_MIXED) && ((n + 1) * pct / 100 != n * pct / 100));
+    int rc;
+
+    t0 = t1;
+    if (write) // small CC setpoints, each write differs from the last
+      rc = dev.setModeValue(KP184::MODE_CC, (writes++ & 1) ? 0.2 : 0.1);
+    else
+      rc = dev.getStatus(out, mode, voltage, current);
+    t1 = now();
+
+    if (rc < 0)
+      res.failed++;
+    else {
+      res.ok++;
+      res.latency.record((uint32_t)((t1 - t0) * 1e6));
+    }
+    n++;
+  } while (t1 - start < seconds);
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s <-t tty|-s host[:port]|-m host[:port]> [-B conf] [-a addr] [-T time]"
+         " [-w workloads] [-r percent] [-b bauds] [-o timeouts]\n", prog);
+  printf(" -t: communicate via TTY port\n");
+  printf(" -s: communicate via socket\n");
+  printf(" -m: communicate via Modbus TCP gateway\n");
+  printf(" -B: serial configuration string [%s]\n", defconf_serial);
+  printf(" -a: device address [%hhu]\n", KP184::defAddress());
+  printf(" -T: time of each run, s [%lu]\n", defconf_time);
+  printf(" -w: workloads, status,write,mixed [all]\n");
+  printf(" -r: writes in mixed workload, %% [%lu]\n", defconf_writes);
+  printf(" -b: baud rates to sweep, serial only [from conf]\n");
+  printf(" -o: timeouts to sweep, ms [driver default]\n");
+  printf("lists are comma separated, every combination is run\n");
+  printf("write workloads set CC mode with 0.1/0.2 A, output is not switched\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *lpath = NULL, *lconf = defconf_serial;
+  Link::linktype_t ltype = Link::NONE;
+  unsigned long addr = KP184::defAddress(), seconds = defconf_time, pct = defconf_writes;
+  vector<unsigned long> bauds(1, unset), timeouts(1, unset);
+  bool wls[WL_MAX + 1] = { true, true, true };
+  KP184 dev;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "t:s:m:B:a:T:w:r:b:o:")) != -1) {
+    switch(op) {
+    case 't': ltype = Link::SERIAL; lpath = optarg; break;
+    case 's': ltype = Link::SOCKET; lpath = optarg; break;
+    case 'm': ltype = Link::MBTCP; lpath = optarg; break;
+    case 'B': lconf = optarg; break;
+    case 'a':
+      if (Util::str2ul(optarg, addr) || (addr > 255)) {
+        fprintf(stderr, "ERR Malformed address value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'T':
+      if (Util::str2ul(optarg, seconds) || (seconds == 0)) {
+        fprintf(stderr, "ERR Malformed time value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'w': {
+      string s(optarg);
+      for (int i = 0; i <= WL_MAX; i++)
+        wls[i] = false;
+      for (size_t pos = 0; pos <= s.size();) {
+        size_t end = s.find(',', pos);
+        int i;
+        if (end == string::npos)
+          end = s.size();
+        for (i = 0; i <= WL_MAX; i++)
+          if (s.compare(pos, end - pos, wlnames[i]) == 0)
+            break;
+        if (i > WL_MAX) {
+          fprintf(stderr, "ERR Unknown workload\n");
+          return -EINVAL;
+        }
+        wls[i] = true;
+        pos = end + 1;
+      }
+      break;
+    }
+    case 'r':
+      if (Util::str2ul(optarg, pct) || (pct > 100)) {
+        fprintf(stderr, "ERR Malformed percent value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'b':
+      if (str2list(optarg, bauds)) {
+        fprintf(stderr, "ERR Malformed baud list\n");
+        return -EINVAL;
+      }
+      break;
+    case 'o':
+      if (str2list(optarg, timeouts)) {
+        fprintf(stderr, "ERR Malformed timeout list\n");
+        return -EINVAL;
+      }
+      break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  if (lpath == NULL) {
+    usage(prog);
+    return -EINVAL;
+  }
+  if ((ltype != Link::SERIAL) && ((bauds.size() > 1) || (bauds[0] != unset))) {
+    fprintf(stderr, "ERR Baud rate sweep needs serial link\n");
+    return -EINVAL;
+  }
+
+  printf("%-7s %7s %5s %9s %8s %8s %8s %8s %7s %8s %6s\n", "load", "baud", "tmo", "tx/s",
+         "p50 us", "p99 us", "p999 us", "max us", "err %", "timeouts", "crc");
+  for (size_t b = 0; b < bauds.size(); b++) {
+    string conf = withBaud(lconf, bauds[b]);
+
+    for (size_t o = 0; o < timeouts.size(); o++)
+      for (int w = 0; w <= WL_MAX; w++) {
+        result_t res;
+        const IOStats *st;
+        unsigned long total;
+
+        if (!wls[w])
+          continue;
+
+        // fresh link for each run, nothing is left over from the previous one
+        if ((rc = dev.open(ltype, lpath, conf.c_str())) != 0) {
+          fprintf(stderr, "ERR Can't open %s (%s): %s\n", lpath, conf.c_str(), strerror(-rc));
+          return rc;
+        }
+        dev.setAddress((devaddr_t)addr);
+        // every write of the mixed workload goes to the device
+        dev.setShadow(false);
+        if (timeouts[o] != unset)
+          dev.setTimeout((int)timeouts[o], (Link::timeout_t)(Link::TIMEOUT_SEND | Link::TIMEOUT_RECV));
+        dev.flush(Link::QUEUE_INOUT);
+        dev.resetStats();
+
+        run(dev, (workload_t)w, pct, (double)seconds, res);
+        st = &dev.getStats();
+        total = res.ok + res.failed;
+
+        printf("%-7s %7s %5d %9.1f %8u %8u %8u %8u %7.3f %8llu %6llu\n", wlnames[w],
+               (ltype == Link::SERIAL) ? conf.substr(0, conf.find(',')).c_str() : "-",
+               dev.getTimeout(Link::TIMEOUT_RECV), res.ok / (double)seconds,
+               res.latency.percentile(50.0), res.latency.percentile(99.0),
+               res.latency.percentile(99.9), res.latency.max(),
+               total ? 100.0 * res.failed / total : 0.0,
+               (unsigned long long)st->timeouts, (unsigned long long)st->crcerrors);
+        fflush(stdout);
+        dev.close();
+      }
+  }
+
+  return 0;
+}
@@ -0,0 +1,544 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <vector>
+#include <deque>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <pty.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "KP184-emu.h"
+#include "battmodel.h"
+#include "util.h"
+
+// standalone KP184 emulator: serves the same units on a pseudo-terminal,
+// raw TCP as the serial to WiFi adapters do, and Modbus TCP
+
+using namespace std;
+
+static const unsigned long defconf_units = 1;
+static const unsigned long defconf_address = 1;
+static const double defconf_voltage = 12.0;
+static const double defconf_resistance = 0.05;
+static const double defconf_speed = 1000.0;
+static const unsigned long resync_gap = 20000; // us, without baud pacing
+
+static volatile sig_atomic_t term = 0;
+
+static void sig_handler(int signum, siginfo_t *info, void *ptr)
+{
+  term = 1;
+}
+
+typedef enum {
+  PORT_PTY,
+  PORT_LISTEN,
+  PORT_RTU,    // raw RTU frames over TCP connection
+  PORT_MBTCP   // Modbus TCP connection
+} porttype_t;
+
+typedef struct {
+  struct timespec due;
+  size_t len;
+  uint8_t data[32];
+} reply_t;
+
+typedef struct port_s {
+  porttype_t type;
+  int fd;
+  bool mbtcp;            // listening port accepts Modbus TCP
+  size_t len;
+  uint8_t req[64];
+  deque<reply_t> replies;
+  struct timespec busy;  // previous reply is on the wire until then
+  struct timespec last;  // last byte received
+} port_t;
+
+typedef struct {
+  unsigned long requests;
+  unsigned long replies;
+  unsigned long silent;   // bad CRC, other address or broadcast
+  unsigned long garbage;  // bytes dropped
+} counters_t;
+
+static void ts_addus(struct timespec &ts, unsigned long us)
+{
+  ts.tv_nsec += (long)(us % 1000000) * 1000L;
+  ts.tv_sec += us / 1000000 + ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+}
+
+static bool ts_before(const struct timespec &a, const struct timespec &b)
+{
+  return (a.tv_sec < b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec < b.tv_nsec));
+}
+
+static int listenPort(unsigned long port)
+{
+  struct sockaddr_in sa;
+  int fd, on = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+    return -errno;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  sa.sin_port = htons((uint16_t)port);
+  if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(fd, 16) < 0)) {
+    int rc = -errno;
+    ::close(fd);
+    return rc;
+  }
+
+  return fd;
+}
+
+class Emulator {
+public:
+  Emulator(vector<KP184Emu> &units, unsigned long latency, useconds_t chartime, bool verbose) :
+    m_units(units),
+    m_latency(latency),
+    m_chartime(chartime),
+    m_gap(chartime ? 4 * chartime : resync_gap),
+    m_verbose(verbose),
+    m_epfd(-1)
+  {
+    memset(&m_cnt, 0, sizeof(m_cnt));
+  }
+
+  ~Emulator() {
+    for (size_t i = 0; i < m_ports.size(); i++) {
+      ::close(m_ports[i]->fd);
+      delete m_ports[i];
+    }
+    if (m_epfd >= 0)
+      ::close(m_epfd);
+  }
+
+  int init() {
+    if ((m_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      return -errno;
+    return 0;
+  }
+
+  int add(porttype_t type, int fd, bool mbtcp = false) {
+    struct epoll_event ev;
+    port_t *p = new port_t();
+
+    p->type = type;
+    p->fd = fd;
+    p->mbtcp = mbtcp;
+    p->len = 0;
+    p->busy.tv_sec = 0;
+    p->busy.tv_nsec = 0;
+    p->last = p->busy;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      int rc = -errno;
+      delete p;
+      return rc;
+    }
+    m_ports.push_back(p);
+
+    return 0;
+  }
+
+  // serves until signalled
+  int run() {
+    struct epoll_event events[64];
+    sigset_t set, orig;
+
+    // termination signals get through only while waiting,
+    // one coming before the wait would be missed otherwise
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &orig);
+
+    while (!term) {
+      int n, timeout = flushReplies();
+
+      n = epoll_pwait(m_epfd, events, 64, timeout, &orig);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        n = -errno;
+        sigprocmask(SIG_SETMASK, &orig, NULL);
+        return n;
+      }
+      for (int i = 0; i < n; i++) {
+        port_t *p = (port_t *)events[i].data.ptr;
+
+        if (p->type == PORT_LISTEN)
+          accept(p);
+        else if (input(p) < 0)
+          drop(p);
+      }
+    }
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+
+    return 0;
+  }
+
+  const counters_t &counters() { return m_cnt; }
+
+private:
+  void accept(port_t *lp) {
+    int fd, on = 1;
+
+    if ((fd = accept4(lp->fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+      return;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (add(lp->mbtcp ? PORT_MBTCP : PORT_RTU, fd) < 0)
+      ::close(fd);
+    else if (m_verbose)
+      printf("client connected (%s)\n", lp->mbtcp ? "Modbus TCP" : "RTU");
+  }
+
+  void drop(port_t *p) {
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    ::close(p->fd);
+    for (size_t i = 0; i < m_ports.size(); i++)
+      if (m_ports[i] == p) {
+        m_ports.erase(m_ports.begin() + i);
+        break;
+      }
+    if (m_verbose)
+      printf("client disconnected\n");
+    delete p;
+  }
+
+  // writes replies which are due, returns epoll timeout till the next one
+  int flushReplies() {
+    struct timespec now;
+    int timeout = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < m_ports.size(); i++) {
+      port_t *p = m_ports[i];
+
+      while (!p->replies.empty()) {
+        reply_t &r = p->replies.front();
+
+        if (ts_before(now, r.due)) {
+          long left = (r.due.tv_sec - now.tv_sec) * 1000L +
+                      (r.due.tv_nsec - now.tv_nsec) / 1000000L + 1;
+          if ((timeout < 0) || (left < timeout))
+            timeout = (int)left;
+          break;
+        }
+        if (write(p->fd, r.data, r.len) < 0) {}
+        p->replies.pop_front();
+      }
+    }
+
+    return timeout;
+  }
+
+  int input(port_t *p) {
+    struct timespec now, gap;
+    ssize_t rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((p->type == PORT_PTY) && (p->len > 0)) {
+      // the device drops a request interrupted by silence
+      gap = p->last;
+      ts_addus(gap, m_gap);
+      if (ts_before(gap, now)) {
+        m_cnt.garbage += p->len;
+        p->len = 0;
+      }
+    }
+
+    rc = read(p->fd, p->req + p->len, sizeof(p->req) - p->len);
+    if (rc == 0)
+      return -ECONNRESET;
+    if (rc < 0)
+      return ((errno == EAGAIN) || (errno == EINTR) || (errno == EIO)) ? 0 : -errno;
+    p->len += rc;
+    p->last = now;
+
+    while (true) {
+      bool mbap = (p->type == PORT_MBTCP);
+      size_t flen = mbap ? KP184Emu::requestLengthTCP(p->req, p->len) :
+                           KP184Emu::requestLength(p->req, p->len);
+      reply_t r;
+
+      if ((flen == 0) || (p->len < flen))
+        break;
+      if (flen > sizeof(p->req)) { // can't be ours
+        m_cnt.garbage += p->len;
+        p->len = 0;
+        break;
+      }
+
+      m_cnt.requests++;
+      if (m_verbose)
+        Util::printbuf(p->req, flen, "<");
+      r.len = 0;
+      for (size_t u = 0; (u < m_units.size()) && (r.len == 0); u++) {
+        rc = mbap ? m_units[u].processTCP(p->req, flen, r.data, sizeof(r.data)) :
+                    m_units[u].process(p->req, flen, r.data, sizeof(r.data));
+        if (rc > 0)
+          r.len = (size_t)rc;
+      }
+      memmove(p->req, p->req + flen, p->len - flen);
+      p->len -= flen;
+
+      if (r.len == 0) {
+        m_cnt.silent++;
+        continue;
+      }
+      m_cnt.replies++;
+      if (m_verbose)
+        Util::printbuf(r.data, r.len, ">");
+
+      // device starts answering after the latency, once the previous reply is out,
+      // and the reply takes its time on the wire
+      r.due = now;
+      ts_addus(r.due, m_latency);
+      if (ts_before(r.due, p->busy))
+        r.due = p->busy;
+      ts_addus(r.due, (unsigned long)m_chartime * r.len);
+      p->busy = r.due;
+
+      if (ts_before(now, r.due) || !p->replies.empty())
+        p->replies.push_back(r);
+      else if (write(p->fd, r.data, r.len) < 0) {}
+    }
+    if (p->len >= sizeof(p->req)) { // no frame in a full buffer
+      m_cnt.garbage += p->len;
+      p->len = 0;
+    }
+
+    return 0;
+  }
+
+  vector<KP184Emu> &m_units;
+  unsigned long m_latency;   // us
+  useconds_t m_chartime;     // us per byte on the wire, 0 for none
+  unsigned long m_gap;       // us of silence ending a partial request
+  bool m_verbose;
+  int m_epfd;
+  vector<port_t *> m_ports;
+  counters_t m_cnt;
+};
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-L link] [-s port] [-m port] [-a addr] [-u units] [-l latency]"
+         " [-b baud] [-V voltage] [-R resistance] [-M model] [-X speed] [-F] [-n] [-v]\n", prog);
+  printf(" -L: symlink to the pseudo-terminal, removed on exit\n");
+  printf(" -s: listen for raw RTU frames on TCP port, like the WiFi adapter (8899)\n");
+  printf(" -m: listen for Modbus TCP on port (502)\n");
+  printf(" -a: address of the first unit [%lu]\n", defconf_address);
+  printf(" -u: number of units with consecutive addresses [%lu]\n", defconf_units);
+  printf(" -l: response latency, us [0]\n");
+  printf(" -b: send replies at the pace of the baud rate, 8N1 [0, at once]\n");
+  printf(" -V: open circuit voltage of the source, V [%.1f]\n", defconf_voltage);
+  printf(" -R: internal resistance of the source, Ohm [%.3f]\n", defconf_resistance);
+  printf(" -M: battery instead of the fixed source, model file or \"default\"\n");
+  printf(" -X: battery time runs faster than real time [%g]\n", defconf_speed);
+  printf(" -F: take function codes 0x04, 0x10 and 0x17 besides 0x03 and 0x06\n");
+  printf(" -n: no pseudo-terminal, TCP only\n");
+  printf(" -v: print frames\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *link = NULL;
+  unsigned long rtuport = 0, mbport = 0, addr = defconf_address, units = defconf_units;
+  unsigned long latency = 0, baud = 0;
+  double voltage = defconf_voltage, resistance = defconf_resistance, speed = defconf_speed;
+  const char *model = NULL;
+  BatteryModel batt;
+  bool nopty = false, verbose = false, multi = false;
+  vector<KP184Emu> emus;
+  struct sigaction sigact;
+  char name[64];
+  int rc, op, master = -1, slave = -1;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "L:s:m:a:u:l:b:V:R:M:X:Fnv")) != -1) {
+    switch(op) {
+    case 'L': link = optarg; break;
+    case 's':
+      if (Util::str2ul(optarg, rtuport) || (rtuport == 0) || (rtuport > 65535)) {
+        fprintf(stderr, "ERR Malformed port value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'm':
+      if (Util::str2ul(optarg, mbport) || (mbport == 0) || (mbport > 65535)) {
+        fprintf(stderr, "ERR Malformed port value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'a':
+      if (Util::str2ul(optarg, addr) || (addr == 0) || (addr > 255)) {
+        fprintf(stderr, "ERR Malformed address value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'u':
+      if (Util::str2ul(optarg, units) || (units == 0) || (units > 255)) {
+        fprintf(stderr, "ERR Malformed units value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'l':
+      if (Util::str2ul(optarg, latency)) {
+        fprintf(stderr, "ERR Malformed latency value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'b':
+      if (Util::str2ul(optarg, baud)) {
+        fprintf(stderr, "ERR Malformed baud value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'V':
+      if (Util::str2d(optarg, voltage) || (voltage < 0.0)) {
+        fprintf(stderr, "ERR Malformed voltage value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'R':
+      if (Util::str2d(optarg, resistance) || (resistance < 0.0)) {
+        fprintf(stderr, "ERR Malformed resistance value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'M': model = optarg; break;
+    case 'X':
+      if (Util::str2d(optarg, speed) || (speed <= 0.0)) {
+        fprintf(stderr, "ERR Malformed speed value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'F': multi = true; break;
+    case 'n': nopty = true; break;
+    case 'v': verbose = true; break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  if (nopty && !rtuport && !mbport) {
+    fprintf(stderr, "ERR Nothing to serve\n");
+    return -EINVAL;
+  }
+  if (addr + units - 1 > 255) {
+    fprintf(stderr, "ERR Units don't fit the address space\n");
+    return -EINVAL;
+  }
+
+  if (model && (strcmp(model, "default") != 0) && ((rc = batt.load(model)) != 0)) {
+    fprintf(stderr, "ERR Can't load battery model %s: %s\n", model, strerror(-rc));
+    return rc;
+  }
+
+  for (unsigned long i = 0; i < units; i++) {
+    emus.push_back(KP184Emu((devaddr_t)(addr + i)));
+    emus.back().setSource(voltage, resistance);
+    emus.back().setMulti(multi);
+    if (model)
+      emus.back().setBattery(batt, speed);
+  }
+
+  Emulator emu(emus, latency, baud ? (useconds_t)((10 * 1000000UL + baud - 1) / baud) : 0,
+               verbose);
+  if ((rc = emu.init()) < 0) {
+    fprintf(stderr, "ERR epoll: %s\n", strerror(-rc));
+    return rc;
+  }
+
+  if (!nopty) {
+    struct termios tattr;
+
+    if (openpty(&master, &slave, name, NULL, NULL) < 0) {
+      perror("ERR openpty");
+      return -errno;
+    }
+    // slave is kept open, so the master doesn't hang up between clients
+    tcgetattr(slave, &tattr);
+    cfmakeraw(&tattr);
+    tcsetattr(slave, TCSANOW, &tattr);
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    fcntl(slave, F_SETFD, FD_CLOEXEC);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    if ((rc = emu.add(PORT_PTY, master)) < 0) {
+      fprintf(stderr, "ERR epoll: %s\n", strerror(-rc));
+      return rc;
+    }
+    if (link) {
+      unlink(link);
+      if (symlink(name, link) < 0) {
+        fprintf(stderr, "ERR Can't link %s: %s\n", link, strerror(errno));
+        return -errno;
+      }
+    }
+    printf("tty %s%s%s\n", name, link ? " -> " : "", link ? link : "");
+  }
+
+  for (int i = 0; i < 2; i++) {
+    unsigned long port = i ? mbport : rtuport;
+    int fd;
+
+    if (port == 0)
+      continue;
+    if ((fd = listenPort(port)) < 0) {
+      fprintf(stderr, "ERR Can't listen on %lu: %s\n", port, strerror(-fd));
+      return fd;
+    }
+    if ((rc = emu.add(PORT_LISTEN, fd, i != 0)) < 0) {
+      fprintf(stderr, "ERR epoll: %s\n", strerror(-rc));
+      return rc;
+    }
+    printf("%s port %lu\n", i ? "Modbus TCP" : "RTU over TCP", port);
+  }
+  printf("units %lu-%lu latency %lu us baud %lu\n", addr, addr + units - 1, latency, baud);
+  if (model)
+    printf("battery %s %.3f Ah at %gx time\n", model, batt.capacity(), speed);
+  fflush(stdout);
+
+  memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_sigaction = sig_handler;
+  sigact.sa_flags = SA_SIGINFO;
+  sigaction(SIGTERM, &sigact, NULL);
+  sigaction(SIGINT, &sigact, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  rc = emu.run();
+  if (rc < 0)
+    fprintf(stderr, "ERR epoll: %s\n", strerror(-rc));
+
+  if (link)
+    unlink(link);
+  if (slave >= 0)
+    ::close(slave);
+
+  const counters_t &cnt = emu.counters();
+  printf("requests %lu replies %lu silent %lu garbage bytes %lu\n",
+         cnt.requests, cnt.replies, cnt.silent, cnt.garbage);
+  for (size_t i = 0; model && (i < emus.size()); i++)
+    printf("unit %hhu battery state of charge %.1f %%\n", emus[i].getAddress(),
+           emus[i].getBattery().soc() * 100.0);
+
+  return rc;
+}
@@ -0,0 +1,310 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+#include <termios.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "KP184-emu.h"
+#include "reactor.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned long defconf_devices = 100;
+static const unsigned long defconf_time = 5;
+static const char *defconf_serial = "115200,8,N,1";
+static const unsigned long defconf_units = 8;
+static const unsigned long defconf_window = 8;
+
+typedef struct {
+  unsigned long ok;
+  unsigned long timeouts;
+  unsigned long errors;
+} counters_t;
+
+static void completion(KP184 &dev, int rc, void *ctx)
+{
+  counters_t *cnt = (counters_t *)ctx;
+
+  if (rc >= 0)
+    cnt->ok++;
+  else if (rc == -ETIMEDOUT)
+    cnt->timeouts++;
+  else if (rc != -ECANCELED) // pending on removal
+    cnt->errors++;
+}
+
+typedef struct {
+  struct timespec due;
+  size_t len;
+  uint8_t data[32];
+} reply_t;
+
+typedef struct {
+  int fd;
+  bool mbtcp;
+  vector<KP184Emu> units;
+  size_t len;
+  uint8_t req[64];
+  vector<reply_t> replies;
+} port_t;
+
+// serves emulated devices until their links are closed
+static void emulate(vector<port_t> &ports, useconds_t latency)
+{
+  struct epoll_event ev, events[64];
+  int epfd, n, open = (int)ports.size();
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  for (size_t i = 0; i < ports.size(); i++) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &ports[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ports[i].fd, &ev);
+  }
+
+  while (open > 0) {
+    struct timespec now;
+    int timeout = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < ports.size(); i++) {
+      port_t &p = ports[i];
+
+      while (!p.replies.empty()) {
+        reply_t &r = p.replies.front();
+        long left = (r.due.tv_sec - now.tv_sec) * 1000000L + (r.due.tv_nsec - now.tv_nsec) / 1000L;
+
+        if (left > 0) {
+          if ((timeout < 0) || (left / 1000 + 1 < timeout))
+            timeout = (int)(left / 1000 + 1);
+          break;
+        }
+        if (write(p.fd, r.data, r.len) < 0) {}
+        p.replies.erase(p.replies.begin());
+      }
+    }
+
+    n = epoll_wait(epfd, events, 64, timeout);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < n; i++) {
+      port_t &p = *(port_t *)events[i].data.ptr;
+      ssize_t rc;
+      size_t flen;
+
+      rc = read(p.fd, p.req + p.len, sizeof(p.req) - p.len);
+      if (rc <= 0) {
+        if ((rc < 0) && (errno == EAGAIN))
+          continue;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p.fd, NULL);
+        open--;
+        continue;
+      }
+      p.len += rc;
+      while (true) {
+        reply_t r;
+
+        flen = p.mbtcp ? KP184Emu::requestLengthTCP(p.req, p.len) :
+                         KP184Emu::requestLength(p.req, p.len);
+        if ((flen == 0) || (p.len < flen))
+          break;
+        r.len = 0;
+        for (size_t u = 0; (u < p.units.size()) && (r.len == 0); u++) {
+          rc = p.mbtcp ? p.units[u].processTCP(p.req, flen, r.data, sizeof(r.data)) :
+                         p.units[u].process(p.req, flen, r.data, sizeof(r.data));
+          if (rc > 0)
+            r.len = rc;
+        }
+        memmove(p.req, p.req + flen, p.len - flen);
+        p.len -= flen;
+        if (r.len == 0)
+          continue;
+        if (latency == 0) {
+          if (write(p.fd, r.data, r.len) < 0) {}
+          continue;
+        }
+        r.due = now;
+        r.due.tv_nsec += (long)latency * 1000L;
+        r.due.tv_sec += r.due.tv_nsec / 1000000000L;
+        r.due.tv_nsec %= 1000000000L;
+        p.replies.push_back(r);
+      }
+      if (p.len >= sizeof(p.req)) // garbage
+        p.len = 0;
+    }
+  }
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-n devices] [-t time] [-i interval] [-l latency] [-B conf]"
+         " [-m] [-u units] [-w window]\n", prog);
+  printf(" -n: number of emulated devices [%lu]\n", defconf_devices);
+  printf(" -t: test time, s [%lu]\n", defconf_time);
+  printf(" -i: status poll interval per device, ms [0, back to back]\n");
+  printf(" -l: emulated device response latency, us [0]\n");
+  printf(" -B: serial configuration string [%s]\n", defconf_serial);
+  printf(" -m: devices are units behind Modbus TCP gateways instead of ttys\n");
+  printf(" -u: units per gateway [%lu]\n", defconf_units);
+  printf(" -w: requests in flight per gateway connection [%lu]\n", defconf_window);
+}
+
+// opens gateway listening on loopback, returns its address
+static int listenGateway(char addr[], size_t size)
+{
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+      (listen(fd, 1) < 0) ||
+      (getsockname(fd, (struct sockaddr *)&sa, &salen) < 0)) {
+    int rc = -errno;
+    ::close(fd);
+    return rc;
+  }
+  snprintf(addr, size, "127.0.0.1:%hu", ntohs(sa.sin_port));
+
+  return fd;
+}
+
+int main(int argc, char *argv[])
+{
+  int op;
+  const char *prog = basename(argv[0]), *lconf = defconf_serial;
+  unsigned long ndev = defconf_devices, seconds = defconf_time, interval = 0, latency = 0;
+  unsigned long units = defconf_units, window = defconf_window;
+  bool mbtcp = false;
+  vector<port_t> ports;
+  vector<KP184 *> devs;
+  struct timespec tint, tstart, tcur;
+  counters_t cnt = { 0, 0, 0 };
+  Reactor reactor;
+  double passed = 0.0;
+  pid_t pid;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "n:t:i:l:B:mu:w:")) != -1) {
+    switch(op) {
+    case 'n': if (Util::str2ul(optarg, ndev)) return -EINVAL; break;
+    case 't': if (Util::str2ul(optarg, seconds)) return -EINVAL; break;
+    case 'i': if (Util::str2ul(optarg, interval)) return -EINVAL; break;
+    case 'l': if (Util::str2ul(optarg, latency)) return -EINVAL; break;
+    case 'B': lconf = optarg; break;
+    case 'm': mbtcp = true; break;
+    case 'u': if (Util::str2ul(optarg, units) || (units == 0)) return -EINVAL; break;
+    case 'w': if (Util::str2ul(optarg, window)) return -EINVAL; break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+
+  tint.tv_sec = interval / 1000;
+  tint.tv_nsec = (long)(interval % 1000) * 1000000L;
+  reactor.setWindow(window);
+
+  for (unsigned long i = 0; i < ndev; i++) {
+    KP184 *dev = new KP184();
+    char name[64];
+    port_t port;
+
+    if (mbtcp && (i % units)) { // next unit behind the gateway
+      dev->attach(*devs.back());
+      dev->setAddress((devaddr_t)(i % units + 1));
+      ports.back().units.push_back(KP184Emu((devaddr_t)(i % units + 1)));
+      devs.push_back(dev);
+      continue;
+    }
+
+    if (mbtcp) {
+      int lfd = listenGateway(name, sizeof(name));
+
+      if (lfd < 0) {
+        fprintf(stderr, "ERR Gateway socket: %s\n", strerror(-lfd));
+        return lfd;
+      }
+      if (dev->open(Link::MBTCP, name, NULL) != 0)
+        return -ENODEV;
+      port.fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      ::close(lfd);
+      if (port.fd < 0) {
+        perror("ERR accept");
+        return -errno;
+      }
+    } else {
+      struct termios tattr;
+      int slave;
+
+      if (openpty(&port.fd, &slave, name, NULL, NULL) < 0) {
+        perror("ERR openpty");
+        return -errno;
+      }
+      tcgetattr(slave, &tattr);
+      cfmakeraw(&tattr);
+      tcsetattr(slave, TCSANOW, &tattr);
+      if (dev->open(Link::SERIAL, name, lconf) != 0)
+        return -ENODEV;
+      ::close(slave);
+    }
+
+    port.mbtcp = mbtcp;
+    port.len = 0;
+    port.units.push_back(KP184Emu());
+    ports.push_back(port);
+    devs.push_back(dev);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    perror("ERR fork");
+    return -errno;
+  } else if (pid == 0) {
+    for (size_t i = devs.size(); i > 0; i--) // attached ones first
+      devs[i - 1]->close();
+    emulate(ports, (useconds_t)latency);
+    _exit(0);
+  }
+  for (size_t i = 0; i < ports.size(); i++)
+    ::close(ports[i].fd);
+
+  for (size_t i = 0; i < devs.size(); i++)
+    reactor.add(*devs[i], tint, completion, &cnt);
+
+  clock_gettime(CLOCK_MONOTONIC, &tstart);
+  do {
+    if (reactor.runOnce(100) < 0)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &tcur);
+    passed = (double)(tcur.tv_sec - tstart.tv_sec) +
+             (double)(tcur.tv_nsec - tstart.tv_nsec) / 1e9;
+  } while (passed < (double)seconds);
+
+  for (size_t i = devs.size(); i > 0; i--) {
+    reactor.remove(*devs[i - 1]);
+    delete devs[i - 1];
+  }
+  waitpid(pid, NULL, 0);
+
+  printf("devices %lu time %.3f s transactions %lu timeouts %lu errors %lu\n",
+         ndev, passed, cnt.ok, cnt.timeouts, cnt.errors);
+  printf("%.1f transactions/s, %.1f per device\n",
+         cnt.ok / passed, cnt.ok / passed / (ndev ? ndev : 1));
+
+  return 0;
+}
@@ -0,0 +1,330 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "faultlink.h"
+#include "iostats.h"
+#include "util.h"
+
+// samples the device at a fixed interval over a link failing frames at
+// random and measures how long recovery strategies take to get samples
+// flowing again and how many samples they lose on the way; the driver's own
+// retries are off unless asked for, they'd absorb the faults before any
+// strategy sees one
+
+using namespace std;
+
+static const char *defconf_serial = "19200,8,N,1";
+static const char *defconf_faults = "drop=1,delay=1:1000,truncate=1,corrupt=1,reset=0.2";
+static const unsigned long defconf_time = 30;
+static const unsigned long defconf_interval = 200;
+static const unsigned long defconf_retries = 3;
+static const double defconf_load = 0.1;        // CC, A
+static const useconds_t interframe_delay = 10000;
+
+typedef enum {
+  RS_BATTERY,  // what battery does: 900 ms pause, then mode, value and output on
+  RS_LEGACY,   // what battery did: 900 ms pause, reopen and setup
+  RS_RETRY,    // retry the sample at once, then reopen and setup without a pause
+  RS_REOPEN,   // reopen and setup at once
+  RS_MAX = RS_REOPEN
+} strategy_t;
+
+static const char *rsnames[RS_MAX + 1] = { "battery", "legacy", "retry", "reopen" };
+
+typedef FaultLink<KP184> FaultKP184;
+
+typedef struct {
+  unsigned long expected;  // samples the interval asks for
+  unsigned long taken;
+  unsigned long incidents; // failed samples after a good one
+  Histogram recovery;      // us, first failure to the next good sample
+  uint32_t maxgap;         // us, between good samples
+} result_t;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// same as battery does after connecting, load is switched on
+// restore skips switching it off, as battery does after errors
+static int setup(KP184 &dev, bool restore = false)
+{
+  bool out;
+  KP184::mode_t mode;
+  double voltage, current;
+  int rc;
+
+  if (restore)
+    rc = dev.getStatus(out, mode, voltage, current);
+  else
+    rc = dev.setOutput(false);
+  if (rc != 0)
+    return rc;
+  usleep(interframe_delay);
+  if ((rc = dev.setMode(KP184::MODE_CC)) != 0)
+    return rc;
+  usleep(interframe_delay);
+  if ((rc = dev.setModeValue(KP184::MODE_CC, defconf_load)) != 0)
+    return rc;
+  usleep(interframe_delay);
+  return dev.setOutput(true);
+}
+
+// gets the device back after a failed sample, gives up at the end time
+static int recover(FaultKP184 &dev, strategy_t rs, unsigned long retries, double end)
+{
+  bool out;
+  KP184::mode_t mode;
+  double voltage, current;
+  int rc = -EIO;
+
+  if (rs == RS_RETRY)
+    for (unsigned long i = 0; (i < retries) && (rc != 0); i++) {
+      dev.countRetry();
+      rc = dev.getStatus(out, mode, voltage, current);
+    }
+
+  while ((rc != 0) && (now() < end)) {
+    dev.countRetry();
+    if (rs == RS_BATTERY) {
+      usleep(900000UL);
+      rc = setup(dev, true);
+      continue;
+    }
+    if (rs == RS_LEGACY)
+      usleep(900000UL);
+    if ((rc = dev.reOpen()) != 0)
+      continue;
+    rc = setup(dev);
+  }
+
+  return rc;
+}
+
+static void run(FaultKP184 &dev, strategy_t rs, unsigned long retries, double seconds,
+                double interval, result_t &res)
+{
+  double start = now(), end = start + seconds, next = start, last = start, failed = 0.0;
+  bool out;
+  KP184::mode_t mode;
+  double voltage, current, t;
+
+  res.taken = res.incidents = 0;
+  res.maxgap = 0;
+  res.recovery.reset();
+
+  while ((t = now()) < end) {
+    if (t < next) {
+      usleep((useconds_t)((next - t) * 1e6));
+      continue;
+    }
+
+    if (dev.getStatus(out, mode, voltage, current) == 0) {
+      t = now();
+      res.taken++;
+      if (failed > 0.0) {
+        res.recovery.record((uint32_t)((t - failed) * 1e6));
+        failed = 0.0;
+      }
+      if ((uint32_t)((t - last) * 1e6) > res.maxgap)
+        res.maxgap = (uint32_t)((t - last) * 1e6);
+      last = t;
+    } else {
+      if (failed == 0.0) {
+        failed = t;
+        res.incidents++;
+      }
+      // battery takes the sample again right after recovering
+      if (recover(dev, rs, retries, end) == 0)
+        continue;
+    }
+
+    // missed ticks are skipped, as the interval timer does
+    while (next <= now())
+      next += interval;
+  }
+
+  res.expected = (unsigned long)(seconds / interval);
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s <-t tty|-s host[:port]|-m host[:port]> [-B conf] [-a addr] [-T time]"
+         " [-i interval] [-f faults] [-r strategies] [-n retries] [-o timeout] [-z seed] [-D]\n", prog);
+  printf(" -t: communicate via TTY port\n");
+  printf(" -s: communicate via socket\n");
+  printf(" -m: communicate via Modbus TCP gateway\n");
+  printf(" -B: serial configuration string [%s]\n", defconf_serial);
+  printf(" -a: device address [%hhu]\n", KP184::defAddress());
+  printf(" -T: time of each run, s [%lu]\n", defconf_time);
+  printf(" -i: sample interval, ms [%lu]\n", defconf_interval);
+  printf(" -f: faults, fault=percent list of drop,delay,truncate,corrupt,reset\n"
+         "     delay takes :ms after the percentage [%s]\n", defconf_faults);
+  printf(" -r: recovery strategies, battery,legacy,retry,reopen [all]\n");
+  printf(" -n: sample retries of the retry strategy [%lu]\n", defconf_retries);
+  printf(" -o: receive timeout, ms [driver default]\n");
+  printf(" -z: fault seed, runs with the same seed see the same faults [1]\n");
+  printf(" -D: retries by the driver, off so failed transactions fail at once\n");
+  printf("the load is set to CC %g A and switched on\n", defconf_load);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *lpath = NULL, *lconf = defconf_serial;
+  const char *faults = defconf_faults;
+  Link::linktype_t ltype = Link::NONE;
+  unsigned long addr = KP184::defAddress(), seconds = defconf_time, interval = defconf_interval;
+  unsigned long retries = defconf_retries, timeout = 0, seed = 1;
+  bool rss[RS_MAX + 1] = { true, true, true, true }, noretry = true;
+  FaultKP184 dev;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "t:s:m:B:a:T:i:f:r:n:o:z:D")) != -1) {
+    switch(op) {
+    case 't': ltype = Link::SERIAL; lpath = optarg; break;
+    case 's': ltype = Link::SOCKET; lpath = optarg; break;
+    case 'm': ltype = Link::MBTCP; lpath = optarg; break;
+    case 'B': lconf = optarg; break;
+    case 'a':
+      if (Util::str2ul(optarg, addr) || (addr > 255)) {
+        fprintf(stderr, "ERR Malformed address value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'T':
+      if (Util::str2ul(optarg, seconds) || (seconds == 0)) {
+        fprintf(stderr, "ERR Malformed time value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'i':
+      if (Util::str2ul(optarg, interval) || (interval == 0)) {
+        fprintf(stderr, "ERR Malformed interval value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'f':
+      faults = optarg;
+      if (dev.setFaults(faults) != 0) {
+        fprintf(stderr, "ERR Malformed fault list\n");
+        return -EINVAL;
+      }
+      dev.clearFaults();
+      break;
+    case 'r': {
+      string s(optarg);
+      for (int i = 0; i <= RS_MAX; i++)
+        rss[i] = false;
+      for (size_t pos = 0; pos <= s.size();) {
+        size_t end = s.find(',', pos);
+        int i;
+        if (end == string::npos)
+          end = s.size();
+        for (i = 0; i <= RS_MAX; i++)
+          if (s.compare(pos, end - pos, rsnames[i]) == 0)
+            break;
+        if (i > RS_MAX) {
+          fprintf(stderr, "ERR Unknown strategy\n");
+          return -EINVAL;
+        }
+        rss[i] = true;
+        pos = end + 1;
+      }
+      break;
+    }
+    case 'n':
+      if (Util::str2ul(optarg, retries)) {
+        fprintf(stderr, "ERR Malformed retries value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'o':
+      if (Util::str2ul(optarg, timeout) || (timeout == 0)) {
+        fprintf(stderr, "ERR Malformed timeout value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'z':
+      if (Util::str2ul(optarg, seed)) {
+        fprintf(stderr, "ERR Malformed seed value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'D': noretry = false; break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  if (lpath == NULL) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  printf("faults %s, %lu ms interval, driver retries %s\n", faults, interval,
+         noretry ? "off" : "on");
+  printf("%-8s %6s %8s %6s %6s %7s %9s %8s %8s %8s %8s %7s %7s\n", "strategy", "faults",
+         "expected", "taken", "lost", "lost %", "incidents", "p50 ms", "p99 ms", "max ms",
+         "gap ms", "retries", "reopens");
+  for (int r = 0; r <= RS_MAX; r++) {
+    result_t res;
+    const IOStats *st;
+
+    if (!rss[r])
+      continue;
+
+    // fresh link and the same faults for each strategy
+    if ((rc = dev.open(ltype, lpath, lconf)) != 0) {
+      fprintf(stderr, "ERR Can't open %s: %s\n", lpath, strerror(-rc));
+      return rc;
+    }
+    dev.setAddress((devaddr_t)addr);
+    if (timeout)
+      dev.setTimeout((int)timeout, Link::TIMEOUT_RECV);
+    if (noretry) {
+      KP184::retry_t none = { 0, 0, 0, 0 };
+      dev.setRetry(none);
+    }
+    dev.flush(Link::QUEUE_INOUT);
+    if ((rc = setup(dev)) != 0) {
+      fprintf(stderr, "ERR Setting the load up: %s\n", strerror(-rc));
+      return rc;
+    }
+
+    dev.setSeed(seed);
+    dev.setFaults(faults);
+    dev.resetFaultStats();
+    dev.resetStats();
+
+    run(dev, (strategy_t)r, retries, (double)seconds, interval / 1000.0, res);
+    st = &dev.getStats();
+
+    printf("%-8s %6lu %8lu %6lu %6lu %7.2f %9lu %8.1f %8.1f %8.1f %8.1f %7llu %7llu\n",
+           rsnames[r], dev.getFaultCount(), res.expected, res.taken,
+           (res.taken < res.expected) ? res.expected - res.taken : 0,
+           (res.taken < res.expected) ? 100.0 * (res.expected - res.taken) / res.expected : 0.0,
+           res.incidents, res.recovery.percentile(50.0) / 1000.0,
+           res.recovery.percentile(99.0) / 1000.0, res.recovery.max() / 1000.0,
+           res.maxgap / 1000.0, (unsigned long long)st->retries,
+           (unsigned long long)st->reopens);
+    fflush(stdout);
+
+    dev.clearFaults();
+    dev.setOutput(false);
+    dev.close();
+  }
+
+  return 0;
+}
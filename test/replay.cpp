@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <libgen.h> // basename
+
+#include "KP184.h"
+#include "trace.h"
+#include "util.h"
+
+// feeds recorded replies back through the KP184 decode path,
+// requests of the trace are reissued by their function and register
+
+using namespace std;
+
+static const unsigned long defconf_rounds = 1;
+
+// device whose link plays replies of the trace back
+class ReplayKP184 : public KP184 {
+public:
+  ReplayKP184() : m_reply(NULL), m_len(0), m_rc(-ETIMEDOUT), m_mismatch(0) {
+    static const retry_t none = { 0, 0, 0, 0 };
+
+    // every recorded request is reissued once, as it was
+    setRetry(none);
+    setShadow(false);
+  }
+
+  // reply to the next request, NULL with rc if there is none
+  void setReply(const uint8_t frame[], size_t len, int rc, const uint8_t request[], size_t rlen) {
+    m_reply = frame;
+    m_len = len;
+    m_rc = rc;
+    m_request = request;
+    m_reqlen = rlen;
+  }
+
+  // requests which differ from the recorded ones
+  unsigned long mismatches() { return m_mismatch; }
+
+  ssize_t send(const uint8_t buf[], size_t len) {
+    // values are converted back and forth, compare up to the register
+    if ((len < 4) || (m_reqlen < 4) || (memcmp(buf, m_request, 4) != 0))
+      m_mismatch++;
+    return len;
+  }
+
+  ssize_t recvFrame(uint8_t buf[], size_t size, size_t expect, useconds_t gap) {
+    if (m_reply == NULL)
+      return m_rc;
+    if (m_len > size)
+      return -ENOBUFS;
+    memcpy(buf, m_reply, m_len);
+    return m_len;
+  }
+
+  int flush(queue_t queue) { return 0; }
+
+private:
+  const uint8_t *m_reply;
+  size_t m_len;
+  int m_rc;
+  const uint8_t *m_request;
+  size_t m_reqlen;
+  unsigned long m_mismatch;
+};
+
+typedef struct {
+  unsigned long requests;
+  unsigned long ok;
+  unsigned long failed;
+  unsigned long skipped;
+} counters_t;
+
+static int32_t val32(const uint8_t buf[])
+{
+  return (int32_t)((uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+                   (uint32_t)buf[2] << 8 | buf[3]);
+}
+
+// reissues recorded request, returns 0 or -errno, -ENOSYS if unknown
+static int reissue(ReplayKP184 &dev, const uint8_t req[], size_t len, bool verbose, uint64_t time)
+{
+  int rc = -ENOSYS;
+
+  dev.setAddress(req[0]);
+  if ((len == 8) && (req[1] == 0x03)) {
+    bool out;
+    KP184::mode_t mode;
+    double voltage, current;
+
+    rc = dev.getStatus(out, mode, voltage, current);
+    if (verbose && (rc == 0))
+      printf("%.6f %hhu status %s %s %.3f V %.3f A\n", time / 1e6, req[0],
+             out ? "ON" : "OFF", KP184::modeStr(mode), voltage, current);
+  } else if ((len == 13) && (req[1] == 0x06) && (req[6] == 4)) {
+    int32_t val = val32(req + 7);
+
+    switch ((uint16_t)req[2] << 8 | req[3]) {
+    case 0x010E: rc = dev.setOutput(val != 0); break;
+    case 0x0110: rc = dev.setMode((KP184::mode_t)val); break;
+    case 0x0112: rc = dev.setVoltage(val / 1000.0); break;
+    case 0x0116: rc = dev.setCurrent(val / 1000.0); break;
+    case 0x011A: rc = dev.setResistance(val / 10.0); break;
+    case 0x011E: rc = dev.setPower(val / 100.0); break;
+    default: break;
+    }
+    if (verbose && (rc == 0))
+      printf("%.6f %hhu write %02X%02X %d\n", time / 1e6, req[0], req[2], req[3], val);
+  }
+
+  if (verbose && (rc < 0) && (rc != -ENOSYS))
+    printf("%.6f %hhu error %s\n", time / 1e6, req[0], strerror(-rc));
+
+  return rc;
+}
+
+static void dump(TraceReader &tr)
+{
+  static const char *types[] = { "TX", "RX", "ERR" };
+  TraceReader::record_t rec;
+
+  while (tr.next(rec) > 0) {
+    printf("%.6f %-3s", rec.time / 1e6, (rec.type <= Trace::REC_ERR) ? types[rec.type] : "?");
+    if (rec.type == Trace::REC_ERR)
+      printf(" %s", strerror(-(int32_t)Trace::get32(rec.data)));
+    else
+      for (size_t i = 0; i < rec.len; i++)
+        printf(" %02X", rec.data[i]);
+    printf("\n");
+  }
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s [-d] [-v] [-n rounds] <trace>\n", prog);
+  printf(" -d: dump the trace\n");
+  printf(" -v: print decoded transactions\n");
+  printf(" -n: replay the trace number of times [%lu]\n", defconf_rounds);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]);
+  unsigned long rounds = defconf_rounds;
+  bool fdump = false, verbose = false;
+  counters_t cnt = {};
+  struct timespec t0, t1;
+  TraceReader tr;
+  ReplayKP184 dev;
+  double passed;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "dvn:")) != -1) {
+    switch(op) {
+    case 'd': fdump = true; break;
+    case 'v': verbose = true; break;
+    case 'n':
+      if ((Util::str2ul(optarg, rounds) != 0) || (rounds == 0)) {
+        fprintf(stderr, "ERR Malformed rounds value\n");
+        return -EINVAL;
+      }
+      break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc < 1) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  if ((rc = tr.open(argv[0])) != 0) {
+    fprintf(stderr, "ERR Can't read trace %s: %s\n", argv[0], strerror(-rc));
+    return rc;
+  }
+  if (tr.getLinkType() == Link::MBTCP) {
+    fprintf(stderr, "ERR Modbus TCP traces are not supported\n");
+    return -ENOTSUP;
+  }
+
+  if (fdump) {
+    dump(tr);
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (unsigned long r = 0; r < rounds; r++) {
+    TraceReader::record_t req, rep;
+    int more;
+
+    tr.rewind();
+    more = tr.next(req);
+    while (more > 0) {
+      if (req.type != Trace::REC_TX) {
+        more = tr.next(req);
+        continue;
+      }
+
+      // reply is whatever follows the request
+      more = tr.next(rep);
+      if ((more > 0) && (rep.type == Trace::REC_RX))
+        dev.setReply(rep.data, rep.len, 0, req.data, req.len);
+      else if ((more > 0) && (rep.type == Trace::REC_ERR))
+        dev.setReply(NULL, 0, (int32_t)Trace::get32(rep.data), req.data, req.len);
+      else
+        dev.setReply(NULL, 0, -ETIMEDOUT, req.data, req.len);
+
+      cnt.requests++;
+      rc = reissue(dev, req.data, req.len, verbose && (r == 0), req.time);
+      if (rc == 0)
+        cnt.ok++;
+      else if (rc == -ENOSYS)
+        cnt.skipped++;
+      else
+        cnt.failed++;
+
+      if ((more > 0) && (rep.type == Trace::REC_TX))
+        req = rep; // no reply recorded
+      else if (more > 0)
+        more = tr.next(req);
+    }
+    if (more < 0) {
+      fprintf(stderr, "ERR Trace is truncated\n");
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  passed = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  printf("requests %lu ok %lu failed %lu skipped %lu request mismatches %lu\n",
+         cnt.requests, cnt.ok, cnt.failed, cnt.skipped, dev.mismatches());
+  printf("%.3f s %.1f transactions/s\n", passed, passed > 0.0 ? cnt.requests / passed : 0.0);
+
+  return 0;
+}
@@ -0,0 +1,330 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <libgen.h> // basename
+#include <semaphore.h>
+
+#include "KP184.h"
+#include "worker.h"
+#include "iostats.h"
+#include "util.h"
+
+// producer threads queue commands to a KP184Worker while reader threads take
+// status snapshots as fast as they can; every command has to complete and
+// no reader may see the snapshot go back in time or torn
+
+using namespace std;
+
+static const char *defconf_serial = "19200,8,N,1";
+static const unsigned long defconf_time = 5;
+static const unsigned long defconf_producers = 4;
+static const unsigned long defconf_readers = 2;
+static const unsigned long defconf_window = 4;
+static const unsigned long defconf_interval = 50;
+static const double defconf_load = 0.1;        // CC, A
+
+typedef struct producer {
+  sem_t window;                 // commands it may have queued
+  unsigned long submitted;
+  unsigned long refused;        // not queued
+  atomic<unsigned long> done;
+  atomic<unsigned long> failed; // done with an error
+  Histogram latency;            // us, queued to done, recorded by the worker
+} producer_t;
+
+typedef struct {
+  unsigned long reads;
+  unsigned long samples;        // new ones seen
+  unsigned long regressions;    // seq or time went back
+  unsigned long tears;          // same seq, different values
+  uint32_t maxage;              // us, of a new sample when first seen
+} reader_t;
+
+typedef struct {
+  producer_t *p;
+  struct timespec queued;
+} request_t;
+
+static atomic<bool> running;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint32_t elapsed(const struct timespec &from, const struct timespec &to)
+{
+  return (uint32_t)((to.tv_sec - from.tv_sec) * 1000000L + (to.tv_nsec - from.tv_nsec) / 1000L);
+}
+
+static bool tsless(const struct timespec &a, const struct timespec &b)
+{
+  return (a.tv_sec < b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec < b.tv_nsec));
+}
+
+static void done(int rc, void *ctx)
+{
+  request_t *r = (request_t *)ctx;
+  producer_t *p = r->p;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (rc == 0)
+    p->latency.record(elapsed(r->queued, ts));
+  else
+    p->failed.fetch_add(1, memory_order_relaxed);
+  p->done.fetch_add(1, memory_order_release);
+  delete r;
+  sem_post(&p->window);
+}
+
+// setpoint writes alternating between two values, every fourth a status read
+static void produceCommands(KP184Worker &worker, producer_t *p, unsigned int id)
+{
+  unsigned long i = id;
+  int rc;
+
+  while (running.load(memory_order_relaxed)) {
+    request_t *r = new request_t;
+
+    while ((sem_wait(&p->window) < 0) && (errno == EINTR));
+    r->p = p;
+    clock_gettime(CLOCK_MONOTONIC, &r->queued);
+    if ((i & 3) == 3)
+      rc = worker.refreshAsync(done, r);
+    else
+      rc = worker.setModeValueAsync(KP184::MODE_CC, defconf_load * (1 + (i & 1)), done, r);
+    i++;
+
+    if (rc < 0) {
+      p->refused++;
+      delete r;
+      sem_post(&p->window);
+      continue;
+    }
+    p->submitted++;
+  }
+}
+
+static void readSnapshots(KP184Worker &worker, Clock &clk, reader_t *r)
+{
+  KP184Worker::status_t last, st;
+  struct timespec ts;
+
+  memset(&last, 0, sizeof(last));
+  while (running.load(memory_order_relaxed)) {
+    worker.getStatus(st);
+    r->reads++;
+
+    if ((st.seq < last.seq) || tsless(st.time, last.time))
+      r->regressions++;
+    else if (st.seq == last.seq) {
+      if ((st.seq != 0) && ((st.out != last.out) || (st.mode != last.mode) ||
+                            (st.voltage != last.voltage) || (st.current != last.current)))
+        r->tears++;
+    } else {
+      clk.now(ts);
+      if (elapsed(st.time, ts) > r->maxage)
+        r->maxage = elapsed(st.time, ts);
+      r->samples++;
+    }
+    last = st;
+  }
+}
+
+void usage(const char prog[])
+{
+  printf("usage: %s <-t tty|-s host[:port]|-m host[:port]> [-B conf] [-a addr] [-T time]"
+         " [-p producers] [-w window] [-r readers] [-i interval]\n", prog);
+  printf(" -t: communicate via TTY port\n");
+  printf(" -s: communicate via socket\n");
+  printf(" -m: communicate via Modbus TCP gateway\n");
+  printf(" -B: serial configuration string [%s]\n", defconf_serial);
+  printf(" -a: device address [%hhu]\n", KP184::defAddress());
+  printf(" -T: time, s [%lu]\n", defconf_time);
+  printf(" -p: producer threads [%lu]\n", defconf_producers);
+  printf(" -w: commands each producer keeps queued [%lu]\n", defconf_window);
+  printf(" -r: snapshot reader threads [%lu]\n", defconf_readers);
+  printf(" -i: status poll interval, ms [%lu]\n", defconf_interval);
+  printf("the load is set to CC %g A and switched on\n", defconf_load);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *prog = basename(argv[0]), *lpath = NULL, *lconf = defconf_serial;
+  Link::linktype_t ltype = Link::NONE;
+  unsigned long addr = KP184::defAddress(), seconds = defconf_time;
+  unsigned long nproducers = defconf_producers, nreaders = defconf_readers;
+  unsigned long window = defconf_window, interval = defconf_interval;
+  unsigned long submitted = 0, refused = 0, completed = 0, failed = 0;
+  unsigned long reads = 0, samples = 0, regressions = 0, tears = 0;
+  uint32_t maxage = 0;
+  Histogram latency;
+  KP184Worker::status_t st;
+  KP184 dev;
+  double start, t;
+  int rc, op;
+
+  opterr = 0;
+  while ((op = getopt(argc, argv, "t:s:m:B:a:T:p:w:r:i:")) != -1) {
+    switch(op) {
+    case 't': ltype = Link::SERIAL; lpath = optarg; break;
+    case 's': ltype = Link::SOCKET; lpath = optarg; break;
+    case 'm': ltype = Link::MBTCP; lpath = optarg; break;
+    case 'B': lconf = optarg; break;
+    case 'a':
+      if (Util::str2ul(optarg, addr) || (addr > 255)) {
+        fprintf(stderr, "ERR Malformed address value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'T':
+      if (Util::str2ul(optarg, seconds) || (seconds == 0)) {
+        fprintf(stderr, "ERR Malformed time value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'p':
+      if (Util::str2ul(optarg, nproducers) || (nproducers == 0)) {
+        fprintf(stderr, "ERR Malformed producers value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'w':
+      if (Util::str2ul(optarg, window) || (window == 0)) {
+        fprintf(stderr, "ERR Malformed window value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'r':
+      if (Util::str2ul(optarg, nreaders)) {
+        fprintf(stderr, "ERR Malformed readers value\n");
+        return -EINVAL;
+      }
+      break;
+    case 'i':
+      if (Util::str2ul(optarg, interval)) {
+        fprintf(stderr, "ERR Malformed interval value\n");
+        return -EINVAL;
+      }
+      break;
+    case '?':
+    case 'h':
+    default: usage(prog); return -EINVAL;
+    }
+  }
+  if (lpath == NULL) {
+    usage(prog);
+    return -EINVAL;
+  }
+
+  if ((rc = dev.open(ltype, lpath, lconf)) != 0) {
+    fprintf(stderr, "ERR Can't open %s: %s\n", lpath, strerror(-rc));
+    return rc;
+  }
+  dev.setAddress((devaddr_t)addr);
+  // every write is to reach the device
+  dev.setShadow(false);
+  dev.flush(Link::QUEUE_INOUT);
+  if (((rc = dev.setOutput(false)) != 0) ||
+      ((rc = dev.setMode(KP184::MODE_CC)) != 0) ||
+      ((rc = dev.setModeValue(KP184::MODE_CC, defconf_load)) != 0) ||
+      ((rc = dev.setOutput(true)) != 0)) {
+    fprintf(stderr, "ERR Setting the load up: %s\n", strerror(-rc));
+    return rc;
+  }
+  dev.resetStats();
+
+  KP184Worker worker(dev);
+  vector<producer_t> producers(nproducers);
+  vector<reader_t> readers(nreaders);
+  vector<thread> threads;
+
+  worker.setInterval((unsigned int)interval);
+  if ((rc = worker.start()) != 0) {
+    fprintf(stderr, "ERR Starting the worker: %s\n", strerror(-rc));
+    return rc;
+  }
+
+  running.store(true);
+  start = now();
+  for (unsigned long i = 0; i < nproducers; i++) {
+    producer_t *p = &producers[i];
+
+    sem_init(&p->window, 0, (unsigned int)window);
+    p->submitted = p->refused = 0;
+    p->done.store(0);
+    p->failed.store(0);
+    threads.push_back(thread(produceCommands, ref(worker), p, (unsigned int)i));
+  }
+  for (unsigned long i = 0; i < nreaders; i++) {
+    memset(&readers[i], 0, sizeof(reader_t));
+    threads.push_back(thread(readSnapshots, ref(worker), ref(dev.getClock()), &readers[i]));
+  }
+
+  sleep((unsigned int)seconds);
+  running.store(false);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  // what's still queued runs before the worker stops
+  for (unsigned long i = 0; i < nproducers; i++)
+    for (unsigned long w = 0; w < window; w++)
+      while ((sem_wait(&producers[i].window) < 0) && (errno == EINTR));
+  t = now() - start;
+  worker.getStatus(st);
+  worker.stop();
+
+  for (unsigned long i = 0; i < nproducers; i++) {
+    producer_t *p = &producers[i];
+
+    submitted += p->submitted;
+    refused += p->refused;
+    completed += p->done.load(memory_order_acquire);
+    failed += p->failed.load(memory_order_relaxed);
+    latency.merge(p->latency);
+    sem_destroy(&p->window);
+  }
+  for (unsigned long i = 0; i < nreaders; i++) {
+    reads += readers[i].reads;
+    samples += readers[i].samples;
+    regressions += readers[i].regressions;
+    tears += readers[i].tears;
+    if (readers[i].maxage > maxage)
+      maxage = readers[i].maxage;
+  }
+
+  printf("%lu producers, %lu queued each, %lu readers, %lu ms poll, %.1f s\n",
+         nproducers, window, nreaders, interval, t);
+  printf("commands %lu, done %lu, failed %lu, refused %lu, %.0f/s\n",
+         submitted, completed, failed, refused, completed / t);
+  printf("latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", latency.percentile(50.0) / 1000.0,
+         latency.percentile(99.0) / 1000.0, latency.max() / 1000.0);
+  printf("status samples %u, %.1f/s\n", st.seq, st.seq / t);
+  printf("snapshots %lu, %.0f/s, new samples seen %lu, max age %.2f ms\n",
+         reads, reads / t, samples, maxage / 1000.0);
+  printf("regressions %lu, tears %lu\n", regressions, tears);
+  dev.getStats().print(stdout);
+
+  dev.setOutput(false);
+  dev.close();
+
+  if (completed != submitted) {
+    fprintf(stderr, "ERR %lu commands never completed\n", submitted - completed);
+    return -EIO;
+  }
+  if (regressions || tears) {
+    fprintf(stderr, "ERR Inconsistent snapshots\n");
+    return -EIO;
+  }
+
+  return 0;
+}